@@ -0,0 +1,436 @@
+
+// bcache.c
+//
+// Block buffer cache.
+//
+// Author: Ajay Tatachar <ajaymt2@illinois.edu>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kheap/kheap.h>
+#include <klock/klock.h>
+#include <fs/fs.h>
+#include <util/util.h>
+#include <common/errno.h>
+#include <debug/log.h>
+#include "bcache.h"
+
+#define CHECK(err, msg, code) if ((err)) {          \
+    log_error("bcache", msg "\n"); return (code);   \
+  }
+#define CHECK_UNLOCK(err, msg, code) if ((err)) {           \
+    log_error("bcache", msg "\n"); kunlock(&bcache_lock);   \
+    return (code);                                          \
+  }
+
+// Buffers are kept in a hash table keyed by (device, block number)
+// and in a doubly linked LRU list. The head of the LRU list is the
+// most recently used buffer and the tail is the next one to be
+// evicted. Dirty buffers are written back when they are evicted or
+// synced. The lock is released while blocks are read from or written
+// to a device, so that lookups of cached blocks don't wait behind slow
+// device requests.
+typedef struct bcache_buf_s {
+  fs_node_t *dev;
+  uint32_t block_num;
+  uint32_t block_size;
+  uint8_t dirty;
+  uint8_t *data;
+  struct bcache_buf_s *hash_next;
+  struct bcache_buf_s *lru_prev;
+  struct bcache_buf_s *lru_next;
+} bcache_buf_t;
+
+static bcache_buf_t **buckets = NULL;
+static uint32_t bucket_mask = 0;
+static bcache_buf_t *lru_head = NULL;
+static bcache_buf_t *lru_tail = NULL;
+static uint32_t buf_count = 0;
+static uint32_t capacity = 0;
+static bcache_stats_t stats;
+static volatile uint32_t bcache_lock = 0;
+
+// Incremented whenever blocks are written to a device behind the
+// cache's back or a dirty buffer is evicted, so that a read that raced
+// with the write doesn't cache or return stale data.
+static uint32_t generation = 0;
+
+static inline uint32_t hash(fs_node_t *dev, uint32_t block_num)
+{ return (((uint32_t)dev >> 4) ^ (block_num * 2654435761u)) & bucket_mask; }
+
+static void lru_unlink(bcache_buf_t *buf)
+{
+  if (buf->lru_prev) buf->lru_prev->lru_next = buf->lru_next;
+  else lru_head = buf->lru_next;
+  if (buf->lru_next) buf->lru_next->lru_prev = buf->lru_prev;
+  else lru_tail = buf->lru_prev;
+  buf->lru_prev = NULL;
+  buf->lru_next = NULL;
+}
+
+static void lru_push_front(bcache_buf_t *buf)
+{
+  buf->lru_prev = NULL;
+  buf->lru_next = lru_head;
+  if (lru_head) lru_head->lru_prev = buf;
+  lru_head = buf;
+  if (lru_tail == NULL) lru_tail = buf;
+}
+
+static void hash_remove(bcache_buf_t *buf)
+{
+  bcache_buf_t **p = &(buckets[hash(buf->dev, buf->block_num)]);
+  for (; *p && *p != buf; p = &((*p)->hash_next));
+  if (*p) *p = buf->hash_next;
+  buf->hash_next = NULL;
+}
+
+static void hash_insert(bcache_buf_t *buf)
+{
+  uint32_t h = hash(buf->dev, buf->block_num);
+  buf->hash_next = buckets[h];
+  buckets[h] = buf;
+}
+
+static bcache_buf_t *lookup(
+  fs_node_t *dev, uint32_t block_size, uint32_t block_num
+  )
+{
+  bcache_buf_t *buf = buckets[hash(dev, block_num)];
+  for (; buf; buf = buf->hash_next)
+    if (
+      buf->dev == dev
+      && buf->block_num == block_num
+      && buf->block_size == block_size
+      ) return buf;
+  return NULL;
+}
+
+static uint32_t writeback(bcache_buf_t *buf)
+{
+  if (buf->dirty == 0) return 0;
+  int32_t res = fs_write(
+    buf->dev, buf->block_size * buf->block_num, buf->block_size, buf->data
+    );
+  CHECK(res != (int32_t)buf->block_size, "Failed to write block.", EIO);
+  buf->dirty = 0;
+  --(stats.dirty);
+  ++(stats.writebacks);
+  return 0;
+}
+
+// Get an unused buffer, evicting the least recently used one
+// if the cache is full.
+static bcache_buf_t *get_free_buf(uint32_t block_size)
+{
+  bcache_buf_t *buf = NULL;
+  if (buf_count < capacity) {
+    buf = kmalloc(sizeof(bcache_buf_t));
+    CHECK(buf == NULL, "No memory.", NULL);
+    u_memset(buf, 0, sizeof(bcache_buf_t));
+    ++buf_count;
+  } else {
+    buf = lru_tail;
+    if (buf->dirty) ++generation;
+    uint32_t res = writeback(buf);
+    CHECK(res, "Failed to write back evicted block.", NULL);
+    lru_unlink(buf);
+    hash_remove(buf);
+    ++(stats.evictions);
+  }
+
+  if (buf->data && buf->block_size != block_size) {
+    kfree(buf->data);
+    buf->data = NULL;
+  }
+  if (buf->data == NULL) {
+    buf->data = kmalloc(block_size);
+    if (buf->data == NULL) {
+      log_error("bcache", "No memory.\n");
+      kfree(buf);
+      --buf_count;
+      return NULL;
+    }
+  }
+  buf->block_size = block_size;
+  buf->dirty = 0;
+  return buf;
+}
+
+// Initialize the cache with room for `size` blocks.
+uint32_t bcache_init(uint32_t size)
+{
+  CHECK(size == 0, "Invalid cache size.", EINVAL);
+  uint32_t bucket_count = 1;
+  for (; bucket_count < size; bucket_count <<= 1);
+  buckets = kmalloc(bucket_count * sizeof(bcache_buf_t *));
+  CHECK(buckets == NULL, "No memory.", ENOMEM);
+  u_memset(buckets, 0, bucket_count * sizeof(bcache_buf_t *));
+  bucket_mask = bucket_count - 1;
+  capacity = size;
+  u_memset(&stats, 0, sizeof(bcache_stats_t));
+  stats.capacity = size;
+  return 0;
+}
+
+// Read a block of a block device through the cache.
+uint32_t bcache_read(
+  fs_node_t *dev, uint32_t block_size, uint32_t block_num, uint8_t *buf
+  )
+{
+  klock(&bcache_lock);
+
+  bcache_buf_t *cbuf = lookup(dev, block_size, block_num);
+  if (cbuf) {
+    ++(stats.hits);
+    lru_unlink(cbuf);
+    lru_push_front(cbuf);
+    u_memcpy(buf, cbuf->data, block_size);
+    kunlock(&bcache_lock);
+    return block_size;
+  }
+
+  ++(stats.misses);
+  cbuf = get_free_buf(block_size);
+  CHECK_UNLOCK(cbuf == NULL, "Failed to get buffer.", 0);
+  uint32_t gen = generation;
+  kunlock(&bcache_lock);
+
+  int32_t res = fs_read(dev, block_size * block_num, block_size, cbuf->data);
+
+  klock(&bcache_lock);
+  if (res != (int32_t)block_size) {
+    log_error("bcache", "Failed to read block.\n");
+    kfree(cbuf->data);
+    kfree(cbuf);
+    --buf_count;
+    kunlock(&bcache_lock);
+    return res < 0 ? 0 : res;
+  }
+
+  // Someone else may have loaded or written the block in the meantime,
+  // in which case their copy wins and ours is dropped.
+  bcache_buf_t *other = lookup(dev, block_size, block_num);
+  if (other || gen != generation) {
+    u_memcpy(buf, other ? other->data : cbuf->data, block_size);
+    kfree(cbuf->data);
+    kfree(cbuf);
+    --buf_count;
+    kunlock(&bcache_lock);
+    return block_size;
+  }
+
+  cbuf->dev = dev;
+  cbuf->block_num = block_num;
+  hash_insert(cbuf);
+  lru_push_front(cbuf);
+  u_memcpy(buf, cbuf->data, block_size);
+
+  kunlock(&bcache_lock);
+  return block_size;
+}
+
+// Write a block of a block device into the cache.
+uint32_t bcache_write(
+  fs_node_t *dev, uint32_t block_size, uint32_t block_num, uint8_t *buf
+  )
+{
+  klock(&bcache_lock);
+
+  bcache_buf_t *cbuf = lookup(dev, block_size, block_num);
+  if (cbuf) {
+    ++(stats.hits);
+    lru_unlink(cbuf);
+  } else {
+    // The whole block is overwritten so there is no need to read it.
+    ++(stats.misses);
+    cbuf = get_free_buf(block_size);
+    CHECK_UNLOCK(cbuf == NULL, "Failed to get buffer.", 0);
+    cbuf->dev = dev;
+    cbuf->block_num = block_num;
+    hash_insert(cbuf);
+  }
+
+  lru_push_front(cbuf);
+  u_memcpy(cbuf->data, buf, block_size);
+  if (cbuf->dirty == 0) ++(stats.dirty);
+  cbuf->dirty = 1;
+
+  kunlock(&bcache_lock);
+  return block_size;
+}
+
+// Read `count` consecutive blocks of a block device with a single
+// device request. Cached copies of blocks in the range take precedence
+// over the data read from the device.
+uint32_t bcache_read_run(
+  fs_node_t *dev,
+  uint32_t block_size,
+  uint32_t block_num,
+  uint32_t count,
+  uint8_t *buf
+  )
+{
+  klock(&bcache_lock);
+
+  uint32_t cached = 0;
+  for (uint32_t i = 0; i < count; ++i)
+    if (lookup(dev, block_size, block_num + i)) ++cached;
+
+  if (cached == count) stats.hits += count;
+  else {
+    stats.misses += count;
+    uint32_t gen = generation;
+    kunlock(&bcache_lock);
+    int32_t res = fs_read(
+      dev, block_size * block_num, block_size * count, buf
+      );
+    CHECK(res != (int32_t)(block_size * count), "Failed to read blocks.", 0);
+    klock(&bcache_lock);
+
+    // A cached block in the range may have been written back and
+    // evicted while the lock was released, so the device data can be
+    // older than it. Fall back to reading block by block.
+    if (gen != generation) {
+      kunlock(&bcache_lock);
+      for (uint32_t i = 0; i < count; ++i) {
+        uint32_t n = bcache_read(
+          dev, block_size, block_num + i, buf + (i * block_size)
+          );
+        CHECK(n != block_size, "Failed to read block.", 0);
+      }
+      return block_size * count;
+    }
+  }
+
+  // Blocks may have been cached while the lock was released, so look
+  // them all up again.
+  for (uint32_t i = 0; i < count; ++i) {
+    bcache_buf_t *cbuf = lookup(dev, block_size, block_num + i);
+    if (cbuf == NULL) continue;
+    u_memcpy(buf + (i * block_size), cbuf->data, block_size);
+  }
+
+  kunlock(&bcache_lock);
+  return block_size * count;
+}
+
+// Write `count` consecutive blocks of a block device with a single
+// device request. Cached copies of blocks in the range are updated and
+// are clean afterwards.
+uint32_t bcache_write_run(
+  fs_node_t *dev,
+  uint32_t block_size,
+  uint32_t block_num,
+  uint32_t count,
+  uint8_t *buf
+  )
+{
+  // Readers that miss while the device write is in flight drop what
+  // they read, and readers that hit see the new data straight away.
+  klock(&bcache_lock);
+  ++generation;
+  for (uint32_t i = 0; i < count; ++i) {
+    bcache_buf_t *cbuf = lookup(dev, block_size, block_num + i);
+    if (cbuf == NULL) continue;
+    u_memcpy(cbuf->data, buf + (i * block_size), block_size);
+  }
+  kunlock(&bcache_lock);
+
+  int32_t res = fs_write(
+    dev, block_size * block_num, block_size * count, buf
+    );
+
+  klock(&bcache_lock);
+  ++generation;
+  for (uint32_t i = 0; i < count; ++i) {
+    bcache_buf_t *cbuf = lookup(dev, block_size, block_num + i);
+    if (cbuf == NULL) continue;
+
+    // A copy cached while the lock was released may be stale. If the
+    // write failed, the cached copies are the only place the new data
+    // lives, so they are left dirty for a later writeback.
+    u_memcpy(cbuf->data, buf + (i * block_size), block_size);
+    if (res == (int32_t)(block_size * count)) {
+      if (cbuf->dirty) --(stats.dirty);
+      cbuf->dirty = 0;
+    } else {
+      if (cbuf->dirty == 0) ++(stats.dirty);
+      cbuf->dirty = 1;
+    }
+  }
+  CHECK_UNLOCK(
+    res != (int32_t)(block_size * count), "Failed to write blocks.", 0
+    );
+
+  kunlock(&bcache_lock);
+  return block_size * count;
+}
+
+// Write back all dirty blocks of a device.
+uint32_t bcache_sync(fs_node_t *dev)
+{
+  klock(&bcache_lock);
+
+  uint32_t err = 0;
+  for (bcache_buf_t *buf = lru_head; buf && stats.dirty; buf = buf->lru_next) {
+    if (dev && buf->dev != dev) continue;
+    uint32_t res = writeback(buf);
+    if (res) err = res;
+  }
+
+  kunlock(&bcache_lock);
+  return err;
+}
+
+// Write back the dirty cached blocks in a range of blocks of a device.
+uint32_t bcache_sync_blocks(
+  fs_node_t *dev, uint32_t block_size, uint32_t block_num, uint32_t count
+  )
+{
+  klock(&bcache_lock);
+
+  uint32_t err = 0;
+  for (uint32_t i = 0; i < count && stats.dirty; ++i) {
+    bcache_buf_t *buf = lookup(dev, block_size, block_num + i);
+    if (buf == NULL) continue;
+    uint32_t res = writeback(buf);
+    if (res) err = res;
+  }
+
+  kunlock(&bcache_lock);
+  return err;
+}
+
+// Write back and drop all cached blocks of a device.
+uint32_t bcache_invalidate(fs_node_t *dev)
+{
+  klock(&bcache_lock);
+
+  ++generation;
+  bcache_buf_t *buf = lru_head;
+  while (buf) {
+    bcache_buf_t *next = buf->lru_next;
+    if (buf->dev == dev) {
+      uint32_t res = writeback(buf);
+      CHECK_UNLOCK(res, "Failed to write back block.", res);
+      lru_unlink(buf);
+      hash_remove(buf);
+      kfree(buf->data);
+      kfree(buf);
+      --buf_count;
+    }
+    buf = next;
+  }
+
+  kunlock(&bcache_lock);
+  return 0;
+}
+
+// Get a snapshot of the cache counters.
+void bcache_stats(bcache_stats_t *out)
+{
+  klock(&bcache_lock);
+  u_memcpy(out, &stats, sizeof(bcache_stats_t));
+  kunlock(&bcache_lock);
+}
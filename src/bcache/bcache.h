@@ -0,0 +1,59 @@
+// bcache.h
+//
+// Block buffer cache.
+//
+// Author: Ajay Tatachar <ajaymt2@illinois.edu>
+
+#ifndef _BCACHE_H_
+#define _BCACHE_H_
+
+#include <stdint.h>
+#include <fs/fs.h>
+
+// Default number of cached blocks.
+#define BCACHE_DEFAULT_SIZE 1024
+
+// Cache counters.
+typedef struct bcache_stats_s {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t writebacks;
+  uint32_t evictions;
+  uint32_t dirty;
+  uint32_t capacity;
+} bcache_stats_t;
+
+// Initialize the cache with room for `size` blocks.
+uint32_t bcache_init(uint32_t size);
+
+// Read a block of a block device through the cache. Returns the
+// number of bytes read.
+uint32_t bcache_read(fs_node_t *, uint32_t, uint32_t, uint8_t *);
+
+// Write a block of a block device into the cache. The block is
+// written to the device when it is evicted or synced. Returns the
+// number of bytes written.
+uint32_t bcache_write(fs_node_t *, uint32_t, uint32_t, uint8_t *);
+
+// Read consecutive blocks of a block device with a single device
+// request, preferring cached copies. Returns the number of bytes read.
+uint32_t bcache_read_run(fs_node_t *, uint32_t, uint32_t, uint32_t, uint8_t *);
+
+// Write consecutive blocks of a block device with a single device
+// request, updating cached copies. Returns the number of bytes written.
+uint32_t bcache_write_run(fs_node_t *, uint32_t, uint32_t, uint32_t, uint8_t *);
+
+// Write back all dirty blocks of a device, or of every device
+// if the device is NULL.
+uint32_t bcache_sync(fs_node_t *);
+
+// Write back the dirty cached blocks in a range of blocks of a device.
+uint32_t bcache_sync_blocks(fs_node_t *, uint32_t, uint32_t, uint32_t);
+
+// Write back and drop all cached blocks of a device.
+uint32_t bcache_invalidate(fs_node_t *);
+
+// Get a snapshot of the cache counters.
+void bcache_stats(bcache_stats_t *);
+
+#endif /* _BCACHE_H_ */
@@ -0,0 +1,85 @@
+
+// defrag.c
+//
+// Report and reduce file fragmentation.
+//
+// Author: Ajay Tatachar <ajaymt2@illinois.edu>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+static uint8_t report_only = 0;
+static uint32_t file_count = 0;
+static uint32_t fragmented_count = 0;
+
+// Print the number of extents and blocks of a file and, unless only
+// reporting, move it into a single extent if it has more than one.
+// Files on filesystems that don't support the requests are skipped.
+static void defrag_file(const char *path)
+{
+  int32_t fd = open(path, O_RDONLY);
+  if (fd < 0) { perror((char *)path); return; }
+
+  struct fs_fraginfo info;
+  if (ioctl(fd, FS_IOC_FRAGINFO, &info)) { close(fd); return; }
+  ++file_count;
+  printf("%6u %8u %s", info.extents, info.blocks, path);
+  if (info.extents > 1) {
+    ++fragmented_count;
+    if (report_only == 0) {
+      if (ioctl(fd, FS_IOC_DEFRAG, &info)) printf(" (failed)");
+      else printf(" -> %u", info.extents);
+    }
+  }
+  printf("\n");
+  close(fd);
+}
+
+static void defrag_path(const char *path)
+{
+  struct stat st;
+  if (lstat(path, &st)) { perror((char *)path); return; }
+  if (st.st_dev & 0x20) return; // Symlink.
+  if (st.st_dev & 1) { defrag_file(path); return; }
+  if ((st.st_dev & 2) == 0) return;
+
+  DIR *d = opendir((char *)path);
+  if (d == NULL) { perror((char *)path); return; }
+  size_t path_len = strlen(path);
+  struct dirent *ent = readdir(d);
+  for (; ent != NULL; ent = readdir(d)) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+    char *child = malloc(path_len + strlen(ent->d_name) + 2);
+    if (child == NULL) break;
+    strcpy(child, path);
+    if (path_len == 0 || path[path_len - 1] != '/') strcat(child, "/");
+    strcat(child, ent->d_name);
+    defrag_path(child);
+    free(child);
+  }
+  closedir(d);
+}
+
+int main(int argc, char *argv[])
+{
+  int32_t first = 1;
+  if (argc > 1 && strcmp(argv[1], "-n") == 0) {
+    report_only = 1;
+    ++first;
+  }
+
+  printf("%6s %8s %s\n", "EXTS", "BLOCKS", "FILE");
+  if (first >= argc) defrag_path(".");
+  for (int32_t i = first; i < argc; ++i) defrag_path(argv[i]);
+  printf("%u of %u files fragmented\n", fragmented_count, file_count);
+
+  return 0;
+}
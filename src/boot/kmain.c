@@ -24,6 +24,7 @@
 #include <klock/klock.h>
 #include <elf/elf.h>
 #include <drivers/ata/ata.h>
+#include <bcache/bcache.h>
 #include <ext2/ext2.h>
 #include <fpu/fpu.h>
 #include <ui/ui.h>
@@ -125,6 +126,8 @@ void kmain(
   CHECK(res, "rd");
   res = ata_init();
   CHECK(res, "ata");
+  res = bcache_init(BCACHE_DEFAULT_SIZE);
+  CHECK(res, "bcache");
   res = ext2_init("/dev/hda");
   CHECK(res, "ext2");
   res = keyboard_init();
@@ -169,6 +172,8 @@ void kmain(
   process_t *init = kmalloc(sizeof(process_t));
   process_create_init(init, p);
   process_schedule(init);
+  res = fs_start_flusher();
+  CHECK(res, "flusher");
 
   kfree(init_text);
   kfree(p.text);
@@ -43,5 +43,6 @@
 #define EDOM    33
 #define ERANGE  34
 #define EAGAIN  35
+#define ENAMETOOLONG 63
 
 #endif /* __ERRNO_H_ */
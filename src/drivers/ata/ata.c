@@ -36,6 +36,15 @@ static const uint16_t ATA_DEVICE_ID    = 0x7010;
 static const uint16_t SECTOR_SIZE      = 0x200;
 static const uint16_t PRDT_END         = 0x8000;
 
+// Size of each device's DMA buffer.
+#define ATA_DMA_PAGES   8
+#define ATA_DMA_SECTORS ((ATA_DMA_PAGES * PAGE_SIZE) / SECTOR_SIZE)
+
+// Size of each device's PRDT. Transfers straight to or from a caller's
+// buffer take one PRD per page, plus one if the buffer isn't aligned.
+#define ATA_PRDT_ENTRIES   64
+#define ATA_DIRECT_SECTORS (((ATA_PRDT_ENTRIES - 1) * PAGE_SIZE) / SECTOR_SIZE)
+
 // Control/Alt-status register.
 static const uint8_t CONTROL_RESET     = 4;
 
@@ -59,14 +68,53 @@ static volatile uint32_t ata_lock = 0;
 static void wait_io(ata_dev_t *);
 static uint8_t wait_status(ata_dev_t *, int32_t);
 
-static uint8_t ata_read_sector(
-  ata_dev_t *dev, uint32_t block, uint8_t *buf
+// Describe a transfer to or from a buffer in the device's PRDT, with
+// one PRD for each page the buffer touches. Fails if part of the buffer
+// is not mapped or it needs more PRDs than the table has. Must be
+// called with ata_lock held.
+static uint8_t ata_prdt(ata_dev_t *dev, uint8_t *buf, uint32_t size)
+{
+  uint32_t vaddr = (uint32_t)buf;
+  for (uint32_t i = 0; i < ATA_PRDT_ENTRIES && size; ++i) {
+    uint32_t paddr = paging_get_paddr(vaddr);
+    if (paddr == 0) return 1;
+    uint32_t transfer_size = PAGE_SIZE - (vaddr & (PAGE_SIZE - 1));
+    if (transfer_size > size) transfer_size = size;
+    dev->prdt[i].buf_paddr = paddr;
+    dev->prdt[i].transfer_size = transfer_size;
+    size -= transfer_size;
+    vaddr += transfer_size;
+    dev->prdt[i].end = size ? 0 : PRDT_END;
+  }
+  return size != 0;
+}
+
+// Set up the PRDT for a transfer of up to `*count` sectors. The
+// caller's buffer is used directly if the transfer is made of whole
+// sectors and the buffer is word-aligned, as the busmaster requires;
+// otherwise the transfer is cut down to fit the device's DMA buffer,
+// and 0 is returned. Must be called with ata_lock held.
+static uint8_t ata_direct(
+  ata_dev_t *dev, uint8_t *buf, uint8_t aligned, uint32_t *count
   )
 {
-  klock(&ata_lock);
+  if (aligned && ((uint32_t)buf & 1) == 0) {
+    if (*count > ATA_DIRECT_SECTORS) *count = ATA_DIRECT_SECTORS;
+    if (ata_prdt(dev, buf, *count * SECTOR_SIZE) == 0) return 1;
+  }
+  if (*count > ATA_DMA_SECTORS) *count = ATA_DMA_SECTORS;
+  ata_prdt(dev, dev->buf, *count * SECTOR_SIZE);
+  return 0;
+}
 
+// Transfer `count` sectors between the disk and the buffer described
+// by the PRDT with a single command. Must be called with ata_lock held.
+static uint8_t ata_dma(
+  ata_dev_t *dev, uint32_t block, uint32_t count, uint8_t is_write
+  )
+{
   wait_io(dev);
-  CHECK_UNLOCK(wait_status(dev, -1) & STATUS_ERR, "Error status.", 1);
+  CHECK(wait_status(dev, -1) & STATUS_ERR, "Error status.", 1);
 
   // Reset busmaster command register.
   outb(dev->ports.busmaster_command, 0);
@@ -75,14 +123,17 @@ static uint8_t ata_read_sector(
   outl(dev->ports.busmaster_prdt, dev->prdt_paddr);
 
   // Set read bit.
-  outb(dev->ports.busmaster_command, 8);
+  if (!is_write) outb(dev->ports.busmaster_command, 8);
 
   // Enable error and IRQ status.
   uint8_t busmaster_status = inb(dev->ports.busmaster_status);
   outb(dev->ports.busmaster_status, busmaster_status | 2 | 4);
   uint32_t eflags = interrupt_save_disable();
   enable_interrupts();
-  CHECK_UNLOCK(wait_status(dev, -1) & STATUS_ERR, "Error status.", 1);
+  if (wait_status(dev, -1) & STATUS_ERR) {
+    interrupt_restore(eflags);
+    CHECK(1, "Error status.", 1);
+  }
 
   // Select drive.
   outb(dev->ports.control_alt_status, 0);
@@ -90,11 +141,11 @@ static uint8_t ata_read_sector(
   wait_io(dev);
 
   // Set sector count and LBA registers.
-  outb(dev->ports.sector_count, 0);
+  outb(dev->ports.sector_count, (count >> 8) & 0xFF);
   outb(dev->ports.lba_1, (block & 0xFF000000) >> 24);
-  outb(dev->ports.lba_2, (block & 0xFF00000000) >> 32);
-  outb(dev->ports.lba_3, (block & 0xFF0000000000) >> 40);
-  outb(dev->ports.sector_count, 1);
+  outb(dev->ports.lba_2, 0);
+  outb(dev->ports.lba_3, 0);
+  outb(dev->ports.sector_count, count & 0xFF);
   outb(dev->ports.lba_1, block & 0xFF);
   outb(dev->ports.lba_2, (block & 0xFF00) >> 8);
   outb(dev->ports.lba_3, (block & 0xFF0000) >> 16);
@@ -104,14 +155,16 @@ static uint8_t ata_read_sector(
       break;
   }
 
-  // Set the command register to the READ DMA command.
-  outb(dev->ports.command_status, COMMAND_DMA_READ);
+  // Set the command register to the READ/WRITE DMA command.
+  outb(
+    dev->ports.command_status, is_write ? COMMAND_DMA_WRITE : COMMAND_DMA_READ
+    );
   wait_io(dev);
 
-  // Start reading.
-  outb(dev->ports.busmaster_command, 8 | 1);
+  // Start the transfer.
+  outb(dev->ports.busmaster_command, is_write ? 1 : 8 | 1);
 
-  // Wait for DMA write to complete.
+  // Wait for the DMA transfer to complete.
   busmaster_status = inb(dev->ports.busmaster_status);
   uint8_t status = inb(dev->ports.command_status);
   for (
@@ -123,14 +176,10 @@ static uint8_t ata_read_sector(
 
   interrupt_restore(eflags);
 
-  // Copy to output buffer.
-  u_memcpy(buf, dev->buf, SECTOR_SIZE);
-
   // Inform device we are done.
   busmaster_status = inb(dev->ports.busmaster_status);
   outb(dev->ports.busmaster_status, busmaster_status | 4 | 2);
 
-  kunlock(&ata_lock);
   return 0;
 }
 
@@ -143,107 +192,36 @@ static uint32_t ata_read(
   if (offset > max_offset) return 0;
   if (offset + size > max_offset)
     size = max_offset - offset;
+  if (size == 0) return 0;
 
   uint32_t start_block = offset / SECTOR_SIZE;
-  uint32_t start_offset = offset % SECTOR_SIZE;
   uint32_t end_block = (offset + size - 1) / SECTOR_SIZE;
-  uint32_t end_offset = (offset + size - 1) % SECTOR_SIZE;
+  uint32_t skip = offset % SECTOR_SIZE;
   uint32_t read_size = 0;
+  uint8_t aligned = skip == 0 && size % SECTOR_SIZE == 0;
 
-  uint8_t *bufp = buf;
+  // Whole sectors are read straight into the caller's buffer. Other
+  // reads go through the DMA buffer, up to ATA_DMA_SECTORS at a time.
   uint32_t current_block = start_block;
-  uint8_t *tmp_buf = kmalloc(SECTOR_SIZE);
-  CHECK(tmp_buf == NULL, "No memory.", read_size);
-
   while (current_block <= end_block) {
-    uint32_t res = ata_read_sector(dev, current_block, tmp_buf);
-    CHECK(res, "Error reading ATA device.", read_size);
-
-    uint32_t offset = 0;
-    uint32_t size = SECTOR_SIZE;
-    if (current_block == start_block) {
-      offset = start_offset;
-      size -= start_offset;
-    }
-    if (current_block == end_block)
-      size = end_offset - offset + 1;
-
-    u_memcpy(bufp, tmp_buf + offset, size);
-    bufp += size;
-    read_size += size;
-    ++current_block;
-  }
-
-  kfree(tmp_buf);
-  return read_size;
-}
-
-static uint8_t ata_write_sector(
-  ata_dev_t *dev, uint32_t block, uint8_t *buf
-  )
-{
-  klock(&ata_lock);
-
-  u_memcpy(dev->buf, buf, SECTOR_SIZE);
-  wait_io(dev);
-  CHECK_UNLOCK(wait_status(dev, -1) & STATUS_ERR, "Error status.", 1);
-  // Reset busmaster command register.
-  outb(dev->ports.busmaster_command, 0);
+    uint32_t count = end_block - current_block + 1;
 
-  // Set PRDT.
-  outl(dev->ports.busmaster_prdt, dev->prdt_paddr);
+    klock(&ata_lock);
+    uint8_t direct = ata_direct(dev, buf + read_size, aligned, &count);
+    uint32_t res = ata_dma(dev, current_block, count, 0);
+    CHECK_UNLOCK(res, "Error reading ATA device.", read_size);
 
-  // Enable error and IRQ status.
-  uint8_t busmaster_status = inb(dev->ports.busmaster_status);
-  outb(dev->ports.busmaster_status, busmaster_status | 2 | 4);
-  uint32_t eflags = interrupt_save_disable();
-  enable_interrupts();
-  CHECK_UNLOCK(wait_status(dev, -1) & STATUS_ERR, "Error status.", 1);
+    uint32_t chunk = (count * SECTOR_SIZE) - skip;
+    if (chunk > size - read_size) chunk = size - read_size;
+    if (direct == 0) u_memcpy(buf + read_size, dev->buf + skip, chunk);
+    kunlock(&ata_lock);
 
-  // Select drive.
-  outb(dev->ports.control_alt_status, 0);
-  outb(dev->ports.drive, 0xE0 | (dev->is_slave << 4));
-
-  // Set sector count and LBA registers.
-  outb(dev->ports.sector_count, 0);
-  outb(dev->ports.lba_1, (block & 0xFF000000) >> 24);
-  outb(dev->ports.lba_2, (block & 0xFF00000000) >> 32);
-  outb(dev->ports.lba_3, (block & 0xFF0000000000) >> 40);
-  outb(dev->ports.sector_count, 1);
-  outb(dev->ports.lba_1, block & 0xFF);
-  outb(dev->ports.lba_2, (block & 0xFF00) >> 8);
-  outb(dev->ports.lba_3, (block & 0xFF0000) >> 16);
-  while (1) {
-    uint8_t status = inb(dev->ports.command_status);
-    if (!(status & STATUS_BSY) && (status & STATUS_DRDY))
-      break;
+    read_size += chunk;
+    current_block += count;
+    skip = 0;
   }
 
-  // Set the command register to the WRITE DMA command.
-  outb(dev->ports.command_status, COMMAND_DMA_WRITE);
-  wait_io(dev);
-
-  // Start writing.
-  outb(dev->ports.busmaster_command, 1);
-
-  // Wait for DMA write to complete.
-  busmaster_status = inb(dev->ports.busmaster_status);
-  uint8_t status = inb(dev->ports.command_status);
-  for (
-    ;
-    (!(busmaster_status & 4)) || (status & STATUS_BSY);
-    busmaster_status = inb(dev->ports.busmaster_status),
-      status = inb(dev->ports.command_status)
-    );
-
-  interrupt_restore(eflags);
-
-  // Inform device we are done.
-  busmaster_status = inb(dev->ports.busmaster_status);
-  outb(dev->ports.busmaster_status, busmaster_status | 4 | 2);
-
-  kunlock(&ata_lock);
-  return 0;
+  return read_size;
 }
 
 static uint32_t ata_write(
@@ -255,38 +233,75 @@ static uint32_t ata_write(
   if (offset > max_offset) return 0;
   if (offset + size > max_offset)
     size = max_offset - offset;
+  if (size == 0) return 0;
 
   uint32_t start_block = offset / SECTOR_SIZE;
-  uint32_t start_offset = offset % SECTOR_SIZE;
   uint32_t end_block = (offset + size - 1) / SECTOR_SIZE;
-  uint32_t end_offset = (offset + size - 1) % SECTOR_SIZE;
+  uint32_t end_offset = (offset + size) % SECTOR_SIZE;
+  uint32_t skip = offset % SECTOR_SIZE;
   uint32_t written_size = 0;
+  uint8_t aligned = skip == 0 && end_offset == 0;
+
+  // Whole sectors are written straight from the caller's buffer.
+  if (aligned) {
+    uint32_t current_block = start_block;
+    while (current_block <= end_block) {
+      uint32_t count = end_block - current_block + 1;
+      klock(&ata_lock);
+      uint8_t direct = ata_direct(dev, buf + written_size, 1, &count);
+      if (direct == 0)
+        u_memcpy(dev->buf, buf + written_size, count * SECTOR_SIZE);
+      uint8_t res = ata_dma(dev, current_block, count, 1);
+      CHECK_UNLOCK(res, "Error writing ATA device.", written_size);
+      kunlock(&ata_lock);
+      written_size += count * SECTOR_SIZE;
+      current_block += count;
+    }
+    return written_size;
+  }
 
-  uint8_t *bufp = buf;
-  uint32_t current_block = start_block;
   uint8_t *tmp_buf = kmalloc(SECTOR_SIZE);
   CHECK(tmp_buf == NULL, "No memory.", written_size);
 
+  // Write up to ATA_DMA_SECTORS sectors per command. Sectors that are
+  // only partially overwritten are read first.
+  uint32_t current_block = start_block;
   while (current_block <= end_block) {
-    uint32_t res = ata_read_sector(dev, current_block, tmp_buf);
-    CHECK(res, "Error reading ATA device.", written_size);
-
-    uint32_t offset = 0;
-    uint32_t size = SECTOR_SIZE;
-    if (current_block == start_block) {
-      offset = start_offset;
-      size -= start_offset;
+    uint32_t count = end_block - current_block + 1;
+    if (count > ATA_DMA_SECTORS) count = ATA_DMA_SECTORS;
+    uint32_t last = current_block + count - 1;
+
+    klock(&ata_lock);
+    ata_prdt(dev, dev->buf, SECTOR_SIZE);
+    uint8_t res = 0;
+    if (last == end_block && end_offset) {
+      res = ata_dma(dev, last, 1, 0);
+      u_memcpy(tmp_buf, dev->buf, SECTOR_SIZE);
     }
-    if (current_block == end_block)
-      size = end_offset - offset + 1;
-
-    u_memcpy(tmp_buf + offset, bufp, size);
-    res = ata_write_sector(dev, current_block, tmp_buf);
-    CHECK(res, "Error writing ATA device.", written_size);
+    if (res == 0 && skip) res = ata_dma(dev, current_block, 1, 0);
+    if (res) {
+      kfree(tmp_buf);
+      CHECK_UNLOCK(1, "Error reading ATA device.", written_size);
+    }
+    if (last == end_block && end_offset && (count > 1 || skip == 0))
+      u_memcpy(
+        dev->buf + ((count - 1) * SECTOR_SIZE), tmp_buf, SECTOR_SIZE
+        );
+
+    uint32_t chunk = (count * SECTOR_SIZE) - skip;
+    if (chunk > size - written_size) chunk = size - written_size;
+    u_memcpy(dev->buf + skip, buf + written_size, chunk);
+    ata_prdt(dev, dev->buf, count * SECTOR_SIZE);
+    res = ata_dma(dev, current_block, count, 1);
+    if (res) {
+      kfree(tmp_buf);
+      CHECK_UNLOCK(1, "Error writing ATA device.", written_size);
+    }
+    kunlock(&ata_lock);
 
-    bufp += size;
-    written_size += size;
-    ++current_block;
+    written_size += chunk;
+    current_block += count;
+    skip = 0;
   }
 
   kfree(tmp_buf);
@@ -314,16 +329,18 @@ static uint8_t ata_dev_init(ata_dev_t *dev, uint8_t is_primary)
 
   dev->prdt_paddr = prdt_page_paddr + prdt_offset;
   dev->prdt = (prd_t *)(prdt_page_vaddr + prdt_offset);
-  prdt_offset += sizeof(prd_t);
+  prdt_offset += ATA_PRDT_ENTRIES * sizeof(prd_t);
 
-  dev->prdt->transfer_size = SECTOR_SIZE;
-  dev->prdt->end = PRDT_END;
-  dev->prdt->buf_paddr = pmm_alloc(1);
-  CHECK(!(dev->prdt->buf_paddr), "No memory.", ENOMEM);
-  dev->buf = (uint8_t *)paging_next_vaddr(1, KERNEL_START_VADDR);
+  // The DMA buffer is contiguous in virtual memory. Each page gets
+  // its own PRD, so the physical pages need not be contiguous.
+  dev->buf = (uint8_t *)paging_next_vaddr(ATA_DMA_PAGES, KERNEL_START_VADDR);
   CHECK(!(dev->buf), "No memory.", ENOMEM);
-  res = paging_map((uint32_t)dev->buf, dev->prdt->buf_paddr, flags);
-  CHECK(res != PAGING_OK, "paging_map failed.", ENOMEM);
+  for (uint32_t i = 0; i < ATA_DMA_PAGES; ++i) {
+    uint32_t paddr = pmm_alloc(1);
+    CHECK(!paddr, "No memory.", ENOMEM);
+    res = paging_map((uint32_t)dev->buf + (i * PAGE_SIZE), paddr, flags);
+    CHECK(res != PAGING_OK, "paging_map failed.", ENOMEM);
+  }
 
   dev->ports.data = is_primary ? 0x1F0 : 0x170;
   dev->ports.error = dev->ports.data + 1;
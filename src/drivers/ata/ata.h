@@ -11,7 +11,8 @@
 #include <stdint.h>
 #include <drivers/pci/pci.h>
 
-// This is always the last PRDT entry.
+// Physical region descriptor. The last entry of a PRDT has the end
+// bit set.
 struct prd_s {
   uint32_t buf_paddr;
   uint16_t transfer_size;
@@ -9,47 +9,183 @@
 #include <stddef.h>
 #include <kheap/kheap.h>
 #include <klock/klock.h>
+#include <bcache/bcache.h>
 #include <process/process.h>
+#include <pit/pit.h>
 #include <fs/fs.h>
 #include <util/util.h>
 #include <common/errno.h>
 #include <debug/log.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include "ext2.h"
 
 #define CHECK(err, msg, code) if ((err)) {      \
     log_error("ext2", msg "\n"); return (code); \
   }
-#define CHECK_UNLOCK_I(err, msg, code) if ((err)) {             \
-    log_error("ext2", msg "\n"); kunlock(&(self->inode_lock));  \
-    return (code);                                              \
+#define CHECK_UNLOCK_G(err, msg, code) if ((err)) {                     \
+    log_error("ext2", msg "\n"); kunlock(&(self->group_locks[group]));  \
+    return (code);                                                      \
   }
-#define CHECK_UNLOCK_B(err, msg, code) if ((err)) {             \
-    log_error("ext2", msg "\n"); kunlock(&(self->block_lock));  \
+#define CHECK_FINISH(err, msg, code) if ((err)) {               \
+    log_error("ext2", msg "\n"); finish_op(self);              \
     return (code);                                              \
   }
-#define CHECK_UNLOCK_O(err, msg, code) if ((err)) {             \
-    log_error("ext2", msg "\n"); kunlock(&(self->ops_lock));    \
-    return (code);                                              \
+#define CHECK_FINISH_I(err, msg, code) if ((err)) {             \
+    log_error("ext2", msg "\n"); iunlock(self, ci);            \
+    finish_op(self); return (code);                             \
   }
 
+// Cached indirect block of an inode.
+typedef struct ext2_mapblock_s {
+  uint32_t block_num;
+  uint32_t *entries;
+} ext2_mapblock_t;
+
+// Number of cached indirect blocks per inode: one for the singly
+// indirect block, two for the doubly indirect path and three for the
+// triply indirect path. Extent-mapped inodes use one slot per level
+// of their extent tree below the root.
+#define EXT2_MAP_SLOTS 6
+#define EXT4_EXTENT_MAX_DEPTH 5
+
+// Entry of an in-memory directory index. Entries are chained in the
+// buckets of a hash table keyed by name, and remember which directory
+// block and offset hold the on-disk entry so that it can be updated
+// without scanning the directory.
+typedef struct ext2_dindex_entry_s {
+  uint32_t hash;
+  uint32_t inode_num;
+  uint32_t block_num;
+  uint32_t offset;
+  struct ext2_dindex_entry_s *next;
+  uint8_t name_len;
+  char name[];
+} ext2_dindex_entry_t;
+
+// The index also keeps the largest gap that a new entry could use in
+// each directory block, so that inserts don't scan the directory.
+// `gap_hint` is the block to start looking for a gap from.
+typedef struct ext2_dindex_s {
+  ext2_dindex_entry_t **buckets;
+  uint32_t bucket_mask;
+  uint32_t count;
+  uint32_t *gaps;
+  uint32_t gap_capacity;
+  uint32_t gap_hint;
+} ext2_dindex_t;
+
+// Readahead state of a file, kept in the `fs_node_t.readahead` that
+// every open of the file shares and protected by the `ra_lock` of the
+// file's in-memory inode. The buffer
+// holds `length` bytes of the file starting at `start`, and is only
+// valid while the inode's version is `version`.
+typedef struct ext2_readahead_s {
+  uint32_t next;
+  uint32_t window;
+  uint32_t start;
+  uint32_t length;
+  uint32_t version;
+  uint8_t *buf;
+} ext2_readahead_t;
+
+// Flags of the `dirty` field of an in-memory inode. Changes to the size
+// or block map are data changes, which fdatasync has to write back;
+// link counts and permissions are only metadata.
+#define EXT2_DIRTY_META 1
+#define EXT2_DIRTY_DATA 2
+
+// In-memory copy of an inode. Cached inodes are kept in a hash table
+// keyed by inode number and an LRU list; entries that are referenced
+// are never evicted. Modified inodes are marked dirty and written
+// back to the inode table when they are evicted or synced. Each inode
+// also caches the indirect blocks on its most recently used path
+// through the block map, so sequential lookups don't re-read them.
+// Directories get an index of their entries on the first name lookup,
+// which is kept up to date by the operations that add or remove entries.
+// `version` changes whenever the data of the inode does, so copies of
+// the data kept outside the block cache can tell when they are stale.
+// An inode that loses its last link while the file is still open is
+// marked as an orphan and holds a reference to itself, so it stays
+// cached until the last node of the file is released.
+//
+// `lock` is held for reading by operations that only look at an inode
+// and its data, and for writing by operations that change them. The
+// block map and directory index caches are filled in lazily by readers,
+// so they have their own locks. Preallocation windows are guarded by
+// the filesystem's `prealloc_lock`, because syncs return the windows of
+// every cached inode.
+typedef struct ext2_cinode_s {
+  uint32_t inode_num;
+  uint32_t refcount;
+  krwlock_t lock;
+  volatile uint32_t map_lock;
+  volatile uint32_t dindex_lock;
+  volatile uint32_t ra_lock;
+  uint8_t dirty;
+  uint8_t orphan;
+  uint32_t version;
+  ext2_inode_t inode;
+  ext2_mapblock_t map[EXT2_MAP_SLOTS];
+  uint32_t prealloc_start;
+  uint32_t prealloc_count;
+  ext2_dindex_t *dindex;
+  struct ext2_cinode_s *hash_next;
+  struct ext2_cinode_s *lru_prev;
+  struct ext2_cinode_s *lru_next;
+} ext2_cinode_t;
+
 typedef struct ext2_fs_s {
   fs_node_t *block_device;
   ext2_superblock_t *superblock;
   ext2_bgd_t *bgds;
+  uint8_t *bgd_raw;
+  uint32_t desc_size;
   uint32_t block_size;
   uint32_t blocks_per_group;
   uint32_t inodes_per_group;
   uint32_t group_count;
   uint32_t bgd_block_count;
-  volatile uint32_t lock;
-  volatile uint32_t inode_lock;
-  volatile uint32_t block_lock;
-  volatile uint32_t bgds_lock;
-  volatile uint32_t ops_lock;
+  uint32_t inode_size;
+  uint8_t **block_bitmaps;
+  uint8_t **inode_bitmaps;
+  uint8_t *block_bitmap_dirty;
+  uint8_t *inode_bitmap_dirty;
+  uint32_t *block_hints;
+  uint32_t *inode_hints;
+  uint8_t metadata_dirty;
+  ext2_cinode_t **icache;
+  ext2_cinode_t *icache_lru_head;
+  ext2_cinode_t *icache_lru_tail;
+  uint32_t icache_count;
+  uint32_t next_version;
+  uint32_t last_dir_group;
+  volatile uint32_t icache_lock;
+  volatile uint32_t *group_locks;
+  volatile uint32_t super_lock;
+  volatile uint32_t prealloc_lock;
+  volatile uint32_t sync_lock;
 } ext2_fs_t;
 
 static const uint32_t EXT2_DIRECT_BLOCKS = 12;
 static const uint16_t EXT2_MAGIC         = 0xEF53;
+static const uint32_t EXT2_ICACHE_SIZE   = 256;
+static const uint32_t EXT2_PREALLOC_MIN  = 8;
+static const uint32_t EXT2_PREALLOC_MAX  = 64;
+static const uint32_t EXT2_DINDEX_MIN    = 16;
+static const uint32_t EXT2_READAHEAD_MIN = 8192;
+static const uint32_t EXT2_READAHEAD_MAX = 65536;
+static const uint32_t EXT4_EXTENT_MAX_LEN = 32768;
+
+// Incompatible and read-only features this driver understands. Any
+// other feature in these sets would be broken by writes.
+static const uint32_t EXT2_SUPPORTED_INCOMPAT =
+  EXT2_FEATURE_INCOMPAT_FILETYPE | EXT4_FEATURE_INCOMPAT_EXTENTS
+  | EXT4_FEATURE_INCOMPAT_64BIT | EXT4_FEATURE_INCOMPAT_FLEX_BG;
+static const uint32_t EXT2_SUPPORTED_RO_COMPAT =
+  EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | EXT2_FEATURE_RO_COMPAT_LARGE_FILE
+  | EXT4_FEATURE_RO_COMPAT_HUGE_FILE | EXT4_FEATURE_RO_COMPAT_DIR_NLINK
+  | EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE;
 
 static inline uint8_t blockbyte(uint8_t *buf, uint32_t n)
 { return buf[n >> 3]; }
@@ -59,794 +195,2248 @@ static inline uint8_t blockbit(uint8_t *buf, uint32_t n)
 { return blockbyte(buf, n) & setbit(n); }
 
 static void make_ext2_node(
-  ext2_fs_t *, fs_node_t *, ext2_inode_t *, ext2_dir_entry_t *
+  ext2_fs_t *, fs_node_t *, ext2_inode_t *, uint32_t, char *, uint32_t
   );
 
 static uint32_t read_block(
   ext2_fs_t *self, uint32_t block_num, uint8_t *buf
   )
+{ return bcache_read(self->block_device, self->block_size, block_num, buf); }
+
+static uint32_t write_block(
+  ext2_fs_t *self, uint32_t block_num, uint8_t *buf
+  )
+{ return bcache_write(self->block_device, self->block_size, block_num, buf); }
+
+static uint32_t read_blocks(
+  ext2_fs_t *self, uint32_t block_num, uint32_t count, uint8_t *buf
+  )
 {
-  klock(&(self->lock));
-  uint32_t res = fs_read(
-    self->block_device,
-    self->block_size * block_num,
-    self->block_size,
-    buf
+  return bcache_read_run(
+    self->block_device, self->block_size, block_num, count, buf
     );
-  kunlock(&(self->lock));
-  return res;
 }
 
-static uint32_t write_block(
-  ext2_fs_t *self, uint32_t block_num, uint8_t *buf
+static uint32_t write_blocks(
+  ext2_fs_t *self, uint32_t block_num, uint32_t count, uint8_t *buf
   )
 {
-  klock(&(self->lock));
-  uint32_t res = fs_write(
-    self->block_device,
-    self->block_size * block_num,
-    self->block_size,
-    buf
+  return bcache_write_run(
+    self->block_device, self->block_size, block_num, count, buf
     );
-  kunlock(&(self->lock));
-  return res;
 }
 
+static uint32_t write_superblock(ext2_fs_t *self)
+{
+  // The superblock is always 1024 bytes into the disk.
+  if (self->block_size == 1024) {
+    uint32_t res = write_block(self, 1, (uint8_t *)self->superblock);
+    CHECK(res != self->block_size, "Failed to write superblock.", EAGAIN);
+    return 0;
+  }
+
+  uint8_t *buf = kmalloc(self->block_size);
+  CHECK(buf == NULL, "No memory.", ENOMEM);
+  uint32_t res = read_block(self, 0, buf);
+  if (res != self->block_size) kfree(buf);
+  CHECK(res != self->block_size, "Failed to read block.", EAGAIN);
+  u_memcpy(buf + 1024, self->superblock, sizeof(ext2_superblock_t));
+  res = write_block(self, 0, buf);
+  kfree(buf);
+  CHECK(res != self->block_size, "Failed to write superblock.", EAGAIN);
+  return 0;
+}
+
+// Descriptors larger than `ext2_bgd_t` are kept on the side, and only
+// their first part is copied in and out of `bgds`.
 static uint32_t write_bgds(ext2_fs_t *self)
 {
-  klock(&(self->bgds_lock));
+  uint8_t *descs = (uint8_t *)self->bgds;
+  if (self->bgd_raw) {
+    descs = self->bgd_raw;
+    for (uint32_t group = 0; group < self->group_count; ++group) {
+      u_memcpy(
+        descs + (group * self->desc_size),
+        &(self->bgds[group]),
+        sizeof(ext2_bgd_t)
+        );
+    }
+  }
 
   uint32_t bgd_block_offset = self->block_size > 1024 ? 1 : 2;
   for (uint32_t i = 0; i < self->bgd_block_count; ++i) {
     uint32_t res = write_block(
       self,
       bgd_block_offset + i,
-      (uint8_t *)((uint32_t)self->bgds + (i * self->block_size))
+      descs + (i * self->block_size)
+      );
+    CHECK(
+      res != self->block_size,
+      "Failed to write block group descriptors.",
+      EAGAIN
       );
-    if (res != self->block_size) {
-      log_error("ext2", "Failed to write block group descriptors.");
-      kunlock(&(self->bgds_lock));
-      return EAGAIN;
-    }
   }
 
-  kunlock(&(self->bgds_lock));
   return 0;
 }
 
-static uint32_t alloc_block(ext2_fs_t *self)
+// Get the in-memory copy of a bitmap block of a group, reading it
+// from the disk on first use.
+static uint8_t *load_bitmap(
+  ext2_fs_t *self, uint8_t **bitmaps, uint32_t group, uint32_t block_num
+  )
 {
-  klock(&(self->block_lock));
+  if (bitmaps[group]) return bitmaps[group];
+  uint8_t *bitmap = kmalloc(self->block_size);
+  CHECK(bitmap == NULL, "No memory.", NULL);
+  uint32_t res = read_block(self, block_num, bitmap);
+  if (res != self->block_size) {
+    kfree(bitmap);
+    CHECK(1, "Failed to read bitmap.", NULL);
+  }
+  bitmaps[group] = bitmap;
+  return bitmap;
+}
 
-  uint32_t res = 0;
-  uint32_t block_num = 0;
-  uint32_t block_offset = 0;
-  uint32_t group_num = 0;
-  uint8_t *bg_buf = kmalloc(self->block_size);
-  CHECK_UNLOCK_B(bg_buf == NULL, "No memory.", 0);
-  for (uint32_t i = 0; i < self->group_count; ++i) {
-    if (
-      self->bgds[i].free_block_count <= 0
-      || self->bgds[i].free_block_count >= (self->block_size << 3)
-      ) continue;
-
-    res = read_block(self, self->bgds[i].block_bitmap, bg_buf);
-    CHECK_UNLOCK_B(res != self->block_size, "Failed to read block.", 0);
-    while (blockbit(bg_buf, block_offset)) ++block_offset;
-    block_num = block_offset + (self->blocks_per_group * i);
-    group_num = i;
+// Claim up to `max` consecutive free bits of a bitmap, starting the
+// search at bit `start`. Returns the first claimed bit, or `nbits` if
+// there are no free bits past `start`.
+static uint32_t claim_bits(
+  uint8_t *bitmap, uint32_t nbits, uint32_t start, uint32_t max, uint32_t *count
+  )
+{
+  uint32_t bit = start;
+  while (bit < nbits) {
+    if (bitmap[bit >> 3] == 0xFF) { bit = (bit | 7) + 1; continue; }
+    if (blockbit(bitmap, bit)) { ++bit; continue; }
     break;
   }
+  if (bit >= nbits) return nbits;
 
-  if (block_num == 0) { kfree(bg_buf); return 0; }
+  uint32_t n = 0;
+  for (; n < max && bit + n < nbits && !blockbit(bitmap, bit + n); ++n)
+    bitmap[(bit + n) >> 3] |= setbit(bit + n);
+  *count = n;
+  return bit;
+}
 
-  bg_buf[block_offset >> 3] |= setbit(block_offset);
-  res = write_block(self, self->bgds[group_num].block_bitmap, bg_buf);
-  CHECK_UNLOCK_B(res != self->block_size, "Failed to write block.", 0);
-  --(self->bgds[group_num].free_block_count);
-  res = write_bgds(self);
-  CHECK_UNLOCK_B(res, "Failed to write block group descriptors.", res);
+// Number of blocks in a block group. The last group may be short.
+static uint32_t group_block_count(ext2_fs_t *self, uint32_t group)
+{
+  uint32_t first = self->superblock->superblock_idx
+    + (group * self->blocks_per_group);
+  uint32_t left = self->superblock->block_count - first;
+  return left < self->blocks_per_group ? left : self->blocks_per_group;
+}
 
-  --(self->superblock->free_block_count);
-  res = fs_write(
-    self->block_device,
-    1024,
-    sizeof(ext2_superblock_t),
-    (uint8_t *)self->superblock
-    );
-  CHECK_UNLOCK_B(
-    res != sizeof(ext2_superblock_t), "Failed to write superblock.", 0
-    );
+// Allocate up to `max` contiguous blocks, as close to the goal block
+// as possible. The number of blocks allocated is stored in `count`.
+// Returns the first block, or 0 if the disk is full. Allocated blocks
+// are not cleared. Each group is locked on its own, so allocations in
+// different groups don't wait for each other.
+static uint32_t alloc_blocks(
+  ext2_fs_t *self, uint32_t goal, uint32_t max, uint32_t *count
+  )
+{
+  uint32_t first_data_block = self->superblock->superblock_idx;
+  if (goal < first_data_block || goal >= self->superblock->block_count)
+    goal = first_data_block;
+  uint32_t goal_group = (goal - first_data_block) / self->blocks_per_group;
+  uint32_t goal_bit = (goal - first_data_block) % self->blocks_per_group;
+
+  // Try the goal first, then every group from its search hint.
+  for (uint32_t i = 0; i <= self->group_count; ++i) {
+    uint32_t group = (goal_group + i) % self->group_count;
+    if (self->bgds[group].free_block_count == 0) continue;
+    klock(&(self->group_locks[group]));
+    uint8_t *bitmap = load_bitmap(
+      self, self->block_bitmaps, group, self->bgds[group].block_bitmap
+      );
+    CHECK_UNLOCK_G(bitmap == NULL, "Failed to load block bitmap.", 0);
+
+    uint32_t nbits = group_block_count(self, group);
+    uint32_t start = i == 0 ? goal_bit : self->block_hints[group];
+    uint32_t bit = claim_bits(bitmap, nbits, start, max, count);
+    if (bit >= nbits) { kunlock(&(self->group_locks[group])); continue; }
+
+    if (bit == self->block_hints[group])
+      self->block_hints[group] = bit + *count;
+    self->bgds[group].free_block_count -= *count;
+    self->block_bitmap_dirty[group] = 1;
+    kunlock(&(self->group_locks[group]));
+
+    klock(&(self->super_lock));
+    self->superblock->free_block_count -= *count;
+    self->metadata_dirty = 1;
+    kunlock(&(self->super_lock));
+    return first_data_block + (group * self->blocks_per_group) + bit;
+  }
 
-  u_memset(bg_buf, 0, self->block_size);
-  res = write_block(self, block_num, bg_buf);
-  CHECK_UNLOCK_B(res != self->block_size, "Failed to clear block.", 0);
+  return 0;
+}
 
-  kfree(bg_buf);
-  kunlock(&(self->block_lock));
-  return block_num;
+static uint32_t alloc_block(ext2_fs_t *self, uint32_t goal)
+{
+  uint32_t count = 0;
+  return alloc_blocks(self, goal, 1, &count);
 }
 
-static uint32_t alloc_inode(ext2_fs_t *self)
+// Allocate exactly `count` contiguous blocks within a single group,
+// trying the goal's group first. Returns the first block, or 0 if no
+// group has a long enough run of free blocks.
+static uint32_t alloc_contiguous(
+  ext2_fs_t *self, uint32_t goal, uint32_t count
+  )
 {
-  klock(&(self->inode_lock));
+  if (count == 0 || count > self->blocks_per_group) return 0;
+  uint32_t first_data_block = self->superblock->superblock_idx;
+  if (goal < first_data_block || goal >= self->superblock->block_count)
+    goal = first_data_block;
+  uint32_t goal_group = (goal - first_data_block) / self->blocks_per_group;
 
-  uint32_t res = 0;
-  uint32_t inode_num = 0;
-  uint32_t inode_offset = 0;
-  uint32_t group_num = 0;
-  uint8_t *bg_buf = kmalloc(self->block_size);
-  CHECK_UNLOCK_I(bg_buf == NULL, "No memory.", 0);
   for (uint32_t i = 0; i < self->group_count; ++i) {
-    if (self->bgds[i].free_block_count == 0) continue;
-
-    res = read_block(self, self->bgds[i].inode_bitmap, bg_buf);
-    CHECK_UNLOCK_I(res != self->block_size, "Failed to read block.", 0);
-    while (blockbit(bg_buf, inode_offset)) ++inode_offset;
-    inode_num = inode_offset + (self->inodes_per_group * i);
-    group_num = i;
-    break;
+    uint32_t group = (goal_group + i) % self->group_count;
+    if (self->bgds[group].free_block_count < count) continue;
+    klock(&(self->group_locks[group]));
+    uint8_t *bitmap = load_bitmap(
+      self, self->block_bitmaps, group, self->bgds[group].block_bitmap
+      );
+    CHECK_UNLOCK_G(bitmap == NULL, "Failed to load block bitmap.", 0);
+
+    // Find the first run of `count` free bits, skipping full bytes.
+    uint32_t nbits = group_block_count(self, group);
+    uint32_t bit = 0, run = 0;
+    while (bit < nbits && run < count) {
+      if ((bit & 7) == 0 && bitmap[bit >> 3] == 0xFF) {
+        bit += 8; run = 0; continue;
+      }
+      run = blockbit(bitmap, bit) ? 0 : run + 1;
+      ++bit;
+    }
+    if (run < count) { kunlock(&(self->group_locks[group])); continue; }
+
+    uint32_t first = bit - count;
+    for (bit = first; bit < first + count; ++bit)
+      bitmap[bit >> 3] |= setbit(bit);
+    if (first == self->block_hints[group])
+      self->block_hints[group] = first + count;
+    self->bgds[group].free_block_count -= count;
+    self->block_bitmap_dirty[group] = 1;
+    kunlock(&(self->group_locks[group]));
+
+    klock(&(self->super_lock));
+    self->superblock->free_block_count -= count;
+    self->metadata_dirty = 1;
+    kunlock(&(self->super_lock));
+    return first_data_block + (group * self->blocks_per_group) + first;
   }
 
-  if (inode_num == 0) { kfree(bg_buf); return 0; }
-
-  bg_buf[inode_offset >> 3] |= 1 << (inode_offset % 8);
-  res = write_block(self, self->bgds[group_num].inode_bitmap, bg_buf);
-  CHECK_UNLOCK_I(res != self->block_size, "Failed to write block.", 0);
-  --(self->bgds[group_num].free_inode_count);
-  res = write_bgds(self);
-  CHECK_UNLOCK_I(res, "Failed to write block group descriptors.", res);
+  return 0;
+}
 
-  --(self->superblock->free_inode_count);
-  res = fs_write(
-    self->block_device,
-    1024,
-    sizeof(ext2_superblock_t),
-    (uint8_t *)self->superblock
-    );
-  CHECK_UNLOCK_I(
-    res != sizeof(ext2_superblock_t), "Failed to write superblock.", 0
-    );
+// Pick the group for a new directory, following the Orlov allocator.
+// Top-level directories are spread out: they go to the group with the
+// fewest directories among those with at least the average number of
+// free inodes and blocks. Other directories stay near their parent
+// unless its group is running out of inodes or blocks or already has
+// more than its share of directories. The counters are only read, so
+// no locks are taken; a stale value just gives a worse placement.
+static uint32_t find_dir_group(
+  ext2_fs_t *self, uint32_t parent_group, uint8_t top_level
+  )
+{
+  uint32_t group_count = self->group_count;
+  uint32_t avg_free_inodes =
+    self->superblock->free_inode_count / group_count;
+  uint32_t avg_free_blocks =
+    self->superblock->free_block_count / group_count;
+  uint32_t dir_count = 0;
+  for (uint32_t group = 0; group < group_count; ++group)
+    dir_count += self->bgds[group].dir_count;
+
+  if (top_level) {
+    // Ties go to the group after the last top-level directory, so
+    // that directories created one after another still spread out.
+    uint32_t best_group = group_count;
+    uint32_t best_dirs = 0xFFFFFFFF;
+    for (uint32_t i = 1; i <= group_count; ++i) {
+      uint32_t group = (self->last_dir_group + i) % group_count;
+      ext2_bgd_t *bgd = &(self->bgds[group]);
+      if (bgd->free_inode_count == 0) continue;
+      if (bgd->dir_count >= best_dirs) continue;
+      if (bgd->free_inode_count < avg_free_inodes) continue;
+      if (bgd->free_block_count < avg_free_blocks) continue;
+      best_group = group;
+      best_dirs = bgd->dir_count;
+    }
+    if (best_group < group_count) {
+      self->last_dir_group = best_group;
+      return best_group;
+    }
+  } else {
+    uint32_t max_dirs =
+      (dir_count / group_count) + (self->inodes_per_group / 16);
+    uint32_t min_inodes = avg_free_inodes > self->inodes_per_group / 4
+      ? avg_free_inodes - (self->inodes_per_group / 4) : 1;
+    uint32_t min_blocks = avg_free_blocks > self->blocks_per_group / 4
+      ? avg_free_blocks - (self->blocks_per_group / 4) : 1;
+    for (uint32_t i = 0; i < group_count; ++i) {
+      uint32_t group = (parent_group + i) % group_count;
+      ext2_bgd_t *bgd = &(self->bgds[group]);
+      if (bgd->dir_count >= max_dirs) continue;
+      if (bgd->free_inode_count < min_inodes) continue;
+      if (bgd->free_block_count < min_blocks) continue;
+      return group;
+    }
+  }
 
-  kfree(bg_buf);
-  kunlock(&(self->inode_lock));
-  return inode_num;
+  for (uint32_t i = 0; i < group_count; ++i) {
+    uint32_t group = (parent_group + i) % group_count;
+    if (self->bgds[group].free_inode_count >= avg_free_inodes) return group;
+  }
+  return parent_group;
 }
 
-static uint32_t free_block(ext2_fs_t *self, uint32_t block_num)
+// Pick the group for a new inode. Files go in their parent directory's
+// group, or the next group with both free inodes and free blocks, so
+// that their data can be allocated near the inode.
+static uint32_t find_inode_group(
+  ext2_fs_t *self, uint32_t parent_inode_num, uint8_t is_dir
+  )
 {
-  klock(&(self->block_lock));
+  uint32_t parent_group = (parent_inode_num - 1) / self->inodes_per_group;
+  if (parent_group >= self->group_count) parent_group = 0;
+  if (is_dir)
+    return find_dir_group(self, parent_group, parent_inode_num == 2);
 
-  uint32_t group_num = block_num / self->blocks_per_group;
-  uint32_t bitmap_num = (block_num % self->blocks_per_group) / 4;
-  uint32_t idx = (block_num % self->blocks_per_group) % 4;
-  uint32_t *blk_buf = kmalloc(self->block_size);
-  CHECK_UNLOCK_B(blk_buf == NULL, "No memory.", ENOMEM);
-  uint32_t res = read_block(
-    self, self->bgds[group_num].block_bitmap, (uint8_t *)blk_buf
-    );
-  CHECK_UNLOCK_B(
-    res != self->block_size, "Failed to read disk block.", EAGAIN
-    );
+  for (uint32_t i = 0; i < self->group_count; ++i) {
+    uint32_t group = (parent_group + i) % self->group_count;
+    ext2_bgd_t *bgd = &(self->bgds[group]);
+    if (bgd->free_inode_count && bgd->free_block_count) return group;
+  }
+  return parent_group;
+}
 
-  uint32_t mask = ~(1 << idx);
-  blk_buf[bitmap_num] = blk_buf[bitmap_num] & mask;
+// Allocate an inode, preferably in the goal group.
+static uint32_t alloc_inode(
+  ext2_fs_t *self, uint32_t goal_group, uint8_t is_dir
+  )
+{
+  if (goal_group >= self->group_count) goal_group = 0;
+  for (uint32_t i = 0; i < self->group_count; ++i) {
+    uint32_t group = (goal_group + i) % self->group_count;
+    if (self->bgds[group].free_inode_count == 0) continue;
+    klock(&(self->group_locks[group]));
+    uint8_t *bitmap = load_bitmap(
+      self, self->inode_bitmaps, group, self->bgds[group].inode_bitmap
+      );
+    CHECK_UNLOCK_G(bitmap == NULL, "Failed to load inode bitmap.", 0);
 
-  res = write_block(
-    self, self->bgds[group_num].block_bitmap, (uint8_t *)blk_buf
-    );
-  CHECK_UNLOCK_B(
-    res != self->block_size, "Failed to write disk block.", EAGAIN
-    );
-  ++(self->bgds[group_num].free_block_count);
-  res = write_bgds(self);
-  CHECK_UNLOCK_B(res, "Failed to write block group descriptors.", res);
-
-  ++(self->superblock->free_block_count);
-  res = fs_write(
-    self->block_device,
-    1024,
-    sizeof(ext2_superblock_t),
-    (uint8_t *)self->superblock
-    );
-  CHECK_UNLOCK_B(
-    res != sizeof(ext2_superblock_t), "Failed to write superblock.", EAGAIN
-    );
+    uint32_t count = 0;
+    uint32_t bit = claim_bits(
+      bitmap, self->inodes_per_group, self->inode_hints[group], 1, &count
+      );
+    if (bit >= self->inodes_per_group) {
+      kunlock(&(self->group_locks[group]));
+      continue;
+    }
+
+    self->inode_hints[group] = bit + 1;
+    --(self->bgds[group].free_inode_count);
+    if (is_dir) ++(self->bgds[group].dir_count);
+    self->inode_bitmap_dirty[group] = 1;
+    kunlock(&(self->group_locks[group]));
+
+    klock(&(self->super_lock));
+    --(self->superblock->free_inode_count);
+    self->metadata_dirty = 1;
+    kunlock(&(self->super_lock));
+    // Inode numbers start at 1.
+    return (group * self->inodes_per_group) + bit + 1;
+  }
 
-  kunlock(&(self->block_lock));
   return 0;
 }
 
-static uint32_t free_inode(ext2_fs_t *self, uint32_t inode_num)
+// Free `count` consecutive blocks. Each group the run falls in is
+// locked and updated once, and the superblock once for the whole run.
+static uint32_t free_blocks(
+  ext2_fs_t *self, uint32_t block_num, uint32_t count
+  )
 {
-  klock(&(self->inode_lock));
-
-  uint32_t group_num = inode_num / self->inodes_per_group;
-  uint32_t bitmap_num = (inode_num % self->inodes_per_group) / 4;
-  uint32_t idx = (inode_num % self->inodes_per_group) % 4;
-  uint32_t *blk_buf = kmalloc(self->block_size);
-  CHECK_UNLOCK_B(blk_buf == NULL, "No memory.", ENOMEM);
-  uint32_t res = read_block(
-    self, self->bgds[group_num].inode_bitmap, (uint8_t *)blk_buf
-    );
-  CHECK_UNLOCK_B(
-    res != self->block_size, "Failed to read disk block.", EAGAIN
+  uint32_t first_data_block = self->superblock->superblock_idx;
+  CHECK(
+    block_num < first_data_block
+    || block_num + count > self->superblock->block_count
+    || block_num + count < block_num,
+    "Invalid block number.",
+    EINVAL
     );
 
-  uint32_t mask = ~(1 << idx);
-  blk_buf[bitmap_num] = blk_buf[bitmap_num] & mask;
+  uint32_t freed = 0, total = 0, err = 0;
+  while (freed < count) {
+    uint32_t offset = block_num + freed - first_data_block;
+    uint32_t group = offset / self->blocks_per_group;
+    uint32_t bit = offset % self->blocks_per_group;
+    uint32_t n = self->blocks_per_group - bit;
+    if (n > count - freed) n = count - freed;
+
+    klock(&(self->group_locks[group]));
+    uint8_t *bitmap = load_bitmap(
+      self, self->block_bitmaps, group, self->bgds[group].block_bitmap
+      );
+    if (bitmap == NULL) {
+      kunlock(&(self->group_locks[group]));
+      log_error("ext2", "Failed to load block bitmap.\n");
+      err = EAGAIN; break;
+    }
+    uint32_t cleared = 0;
+    for (uint32_t i = bit; i < bit + n; ++i) {
+      if (!blockbit(bitmap, i)) { err = EINVAL; continue; }
+      bitmap[i >> 3] &= ~setbit(i);
+      ++cleared;
+    }
+    if (bit < self->block_hints[group]) self->block_hints[group] = bit;
+    self->bgds[group].free_block_count += cleared;
+    self->block_bitmap_dirty[group] = 1;
+    kunlock(&(self->group_locks[group]));
+    total += cleared;
+    freed += n;
+  }
+
+  klock(&(self->super_lock));
+  self->superblock->free_block_count += total;
+  self->metadata_dirty = 1;
+  kunlock(&(self->super_lock));
+
+  CHECK(err == EINVAL, "Block is already free.", err);
+  CHECK(err, "Failed to free blocks.", err);
+  return 0;
+}
 
-  res = write_block(
-    self, self->bgds[group_num].inode_bitmap, (uint8_t *)blk_buf
+static uint32_t free_inode(ext2_fs_t *self, uint32_t inode_num, uint8_t is_dir)
+{
+  CHECK(
+    inode_num == 0 || inode_num > self->superblock->inode_count,
+    "Invalid inode number.",
+    EINVAL
     );
-  CHECK_UNLOCK_B(
-    res != self->block_size, "Failed to write disk block.", EAGAIN
+  uint32_t group = (inode_num - 1) / self->inodes_per_group;
+  uint32_t bit = (inode_num - 1) % self->inodes_per_group;
+
+  klock(&(self->group_locks[group]));
+  uint8_t *bitmap = load_bitmap(
+    self, self->inode_bitmaps, group, self->bgds[group].inode_bitmap
     );
-  ++(self->bgds[group_num].free_inode_count);
-  res = write_bgds(self);
-  CHECK_UNLOCK_I(res, "Failed to write block group descriptors.", res);
+  CHECK_UNLOCK_G(bitmap == NULL, "Failed to load inode bitmap.", EAGAIN);
+  CHECK_UNLOCK_G(!blockbit(bitmap, bit), "Inode is already free.", EINVAL);
 
+  bitmap[bit >> 3] &= ~setbit(bit);
+  if (bit < self->inode_hints[group]) self->inode_hints[group] = bit;
+  ++(self->bgds[group].free_inode_count);
+  if (is_dir) --(self->bgds[group].dir_count);
+  self->inode_bitmap_dirty[group] = 1;
+  kunlock(&(self->group_locks[group]));
+
+  klock(&(self->super_lock));
   ++(self->superblock->free_inode_count);
-  res = fs_write(
-    self->block_device,
-    1024,
-    sizeof(ext2_superblock_t),
-    (uint8_t *)self->superblock
-    );
-  CHECK_UNLOCK_I(
-    res != sizeof(ext2_superblock_t), "Failed to write superblock.", EAGAIN
-    );
+  self->metadata_dirty = 1;
+  kunlock(&(self->super_lock));
+  return 0;
+}
+
+// Write modified bitmaps, block group descriptors and the superblock
+// to the block cache. Allocations only update the in-memory copies.
+static uint32_t sync_metadata(ext2_fs_t *self)
+{
+  klock(&(self->super_lock));
+  uint8_t dirty = self->metadata_dirty;
+  self->metadata_dirty = 0;
+  kunlock(&(self->super_lock));
+  if (dirty == 0) return 0;
+
+  klock(&(self->sync_lock));
+  uint32_t err = 0;
+  for (uint32_t group = 0; group < self->group_count; ++group) {
+    klock(&(self->group_locks[group]));
+    uint32_t res = self->block_size;
+    if (self->block_bitmap_dirty[group]) {
+      res = write_block(
+        self, self->bgds[group].block_bitmap, self->block_bitmaps[group]
+        );
+      if (res == self->block_size) self->block_bitmap_dirty[group] = 0;
+    }
+    if (res == self->block_size && self->inode_bitmap_dirty[group]) {
+      res = write_block(
+        self, self->bgds[group].inode_bitmap, self->inode_bitmaps[group]
+        );
+      if (res == self->block_size) self->inode_bitmap_dirty[group] = 0;
+    }
+    kunlock(&(self->group_locks[group]));
+    if (res != self->block_size) err = EAGAIN;
+  }
+
+  if (err == 0) err = write_bgds(self);
+  if (err == 0) {
+    klock(&(self->super_lock));
+    err = write_superblock(self);
+    kunlock(&(self->super_lock));
+  }
+  kunlock(&(self->sync_lock));
 
-  kunlock(&(self->inode_lock));
+  if (err) {
+    // Try again on the next sync.
+    klock(&(self->super_lock));
+    self->metadata_dirty = 1;
+    kunlock(&(self->super_lock));
+  }
+  CHECK(err, "Failed to write metadata.", err);
   return 0;
 }
 
-static uint32_t read_inode_info(
+// Find the inode table block and byte offset of an inode.
+static uint32_t locate_inode(
+  ext2_fs_t *self, uint32_t inode_num, uint32_t *block, uint32_t *offset
+  )
+{
+  // Inode numbers start at 1.
+  uint32_t group_idx = (inode_num - 1) / self->inodes_per_group;
+  CHECK(
+    inode_num == 0 || group_idx >= self->group_count,
+    "Invalid inode number.",
+    EAGAIN
+    );
+  uint32_t byte_offset = ((inode_num - 1) % self->inodes_per_group)
+    * self->inode_size;
+  *block = self->bgds[group_idx].inode_table + (byte_offset / self->block_size);
+  *offset = byte_offset % self->block_size;
+  return 0;
+}
+
+static uint32_t load_inode(
   ext2_fs_t *self, ext2_inode_t *inode, uint32_t inode_num
   )
 {
-  uint32_t group_idx = inode_num / self->inodes_per_group;
-  CHECK(group_idx > self->group_count, "Invalid group number.", EAGAIN);
-  uint32_t inode_table_block = self->bgds[group_idx].inode_table;
-  uint32_t group_offset = inode_num % self->inodes_per_group;
-  // group_offset - 1 since inode numbers start at 1.
-  uint32_t block_idx = ((group_offset - 1) * self->superblock->inode_size)
-    / self->block_size;
-  uint32_t block_offset = (group_offset - 1)
-    - (block_idx * (self->block_size / self->superblock->inode_size));
+  uint32_t block, offset;
+  uint32_t res = locate_inode(self, inode_num, &block, &offset);
+  CHECK(res, "Failed to locate inode.", res);
 
   uint8_t *buf = kmalloc(self->block_size);
   CHECK(buf == NULL, "No memory.", ENOMEM);
-  uint32_t res = read_block(self, inode_table_block + block_idx, buf);
-  CHECK(res != self->block_size, "Failed to read block.", res);
-  u_memcpy(
-    inode,
-    buf + (block_offset * self->superblock->inode_size),
-    self->superblock->inode_size
-    );
+  res = read_block(self, block, buf);
+  if (res != self->block_size) {
+    kfree(buf);
+    CHECK(1, "Failed to read block.", EAGAIN);
+  }
+  // Only the first 128 bytes of an inode are used, even if the
+  // filesystem has larger inodes.
+  u_memcpy(inode, buf + offset, sizeof(ext2_inode_t));
   kfree(buf);
 
   return 0;
 }
 
-static uint32_t write_inode_info(
+static uint32_t store_inode(
   ext2_fs_t *self, ext2_inode_t *inode, uint32_t inode_num
   )
 {
-  uint32_t group_idx = inode_num / self->inodes_per_group;
-  CHECK(group_idx > self->group_count, "Invalid group number.", EAGAIN);
-  uint32_t inode_table_block = self->bgds[group_idx].inode_table;
-  uint32_t group_offset = inode_num % self->inodes_per_group;
-  // group_offset - 1 since inode numbers start at 1.
-  uint32_t block_idx = ((group_offset - 1) * self->superblock->inode_size)
-    / self->block_size;
-  uint32_t block_offset = (group_offset - 1)
-    - (block_idx * (self->block_size / self->superblock->inode_size));
+  uint32_t block, offset;
+  uint32_t res = locate_inode(self, inode_num, &block, &offset);
+  CHECK(res, "Failed to locate inode.", res);
 
   uint8_t *buf = kmalloc(self->block_size);
   CHECK(buf == NULL, "No memory.", ENOMEM);
-  uint32_t res = read_block(self, inode_table_block + block_idx, buf);
-  CHECK(res != self->block_size, "Failed to read block.", res);
-  u_memcpy(
-    buf + (block_offset * self->superblock->inode_size),
-    inode,
-    self->superblock->inode_size
-    );
-  res = write_block(self, inode_table_block + block_idx, buf);
-  CHECK(res != self->block_size, "Failed to write block.", res);
+  res = read_block(self, block, buf);
+  if (res != self->block_size) {
+    kfree(buf);
+    CHECK(1, "Failed to read block.", EAGAIN);
+  }
+  u_memcpy(buf + offset, inode, sizeof(ext2_inode_t));
+  res = write_block(self, block, buf);
   kfree(buf);
+  CHECK(res != self->block_size, "Failed to write block.", EAGAIN);
 
   return 0;
 }
 
-static uint32_t get_disk_block_number(
-  ext2_fs_t *self, ext2_inode_t *inode, uint32_t block_num
-  )
+static void icache_lru_unlink(ext2_fs_t *self, ext2_cinode_t *ci)
 {
-  uint32_t p = self->block_size / 4;
-  uint32_t res = 0;
-  int32_t a, b, c, d, e, f, g; // Some jugaad happens here.
-  uint32_t *tmp = kmalloc(self->block_size);
-  CHECK(tmp == NULL, "No memory.", -ENOMEM);
-
-  a = block_num - EXT2_DIRECT_BLOCKS;
-  if (a < 0) {
-    kfree(tmp);
-    return inode->block_pointer[block_num];
-  }
+  if (ci->lru_prev) ci->lru_prev->lru_next = ci->lru_next;
+  else self->icache_lru_head = ci->lru_next;
+  if (ci->lru_next) ci->lru_next->lru_prev = ci->lru_prev;
+  else self->icache_lru_tail = ci->lru_prev;
+  ci->lru_prev = NULL;
+  ci->lru_next = NULL;
+}
 
-  b = a - p;
-  if (b < 0) {
-    res = read_block(
-      self, inode->block_pointer[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp
-      );
-    CHECK(res != self->block_size, "Failed to read block.", -1);
-    res = tmp[a];
-    kfree(tmp);
-    return res;
-  }
+static void icache_lru_push_front(ext2_fs_t *self, ext2_cinode_t *ci)
+{
+  ci->lru_prev = NULL;
+  ci->lru_next = self->icache_lru_head;
+  if (self->icache_lru_head) self->icache_lru_head->lru_prev = ci;
+  self->icache_lru_head = ci;
+  if (self->icache_lru_tail == NULL) self->icache_lru_tail = ci;
+}
 
-  c = b - (p * p);
-  if (c < 0) {
-    c = b / p;
-    d = b - (c * p);
-    res = read_block(
-      self, inode->block_pointer[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp
-      );
-    CHECK(res != self->block_size, "Failed to read block.", -1);
-    res = read_block(self, tmp[c], (uint8_t *)tmp);
-    CHECK(res != self->block_size, "Failed to read block.", -1);
-    res = tmp[d];
-    kfree(tmp);
-    return res;
-  }
-
-  d = c - (p * p * p);
-  if (d < 0) {
-    e = c / (p * p);
-    f = (c - (e * p * p)) / p;
-    g = (c - (e * p * p) - (f * p));
-    res = read_block(
-      self, inode->block_pointer[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp
-      );
-    CHECK(res != self->block_size, "Failed to read block.", -1);
-    res = read_block(self, tmp[e], (uint8_t *)tmp);
-    CHECK(res != self->block_size, "Failed to read block.", -1);
-    res = read_block(self, tmp[f], (uint8_t *)tmp);
-    CHECK(res != self->block_size, "Failed to read block.", -1);
-    res = tmp[g];
-    kfree(tmp);
-    return res;
+// Drop the cached indirect blocks of an inode.
+static void release_map(ext2_cinode_t *ci)
+{
+  for (uint32_t i = 0; i < EXT2_MAP_SLOTS; ++i) {
+    kfree(ci->map[i].entries);
+    ci->map[i].entries = NULL;
+    ci->map[i].block_num = 0;
   }
-
-  kfree(tmp);
-  return 0;
 }
 
-static uint32_t set_disk_block_number(
-  ext2_fs_t *self,
-  ext2_inode_t *inode,
-  uint32_t inode_num,
-  uint32_t inode_block_num,
-  uint32_t disk_block_num
-  )
+// Return the unused blocks of an inode's preallocation window.
+static void release_prealloc(ext2_fs_t *self, ext2_cinode_t *ci)
 {
-  // This is beyond science.
+  klock(&(self->prealloc_lock));
+  uint32_t start = ci->prealloc_start;
+  uint32_t count = ci->prealloc_count;
+  ci->prealloc_start = 0;
+  ci->prealloc_count = 0;
+  kunlock(&(self->prealloc_lock));
+  if (count == 0) return;
+  uint32_t res = free_blocks(self, start, count);
+  if (res) log_error("ext2", "Failed to release preallocated blocks.\n");
+}
 
-  uint32_t p = self->block_size / 4;
-  uint32_t res = 0;
-  int32_t a, b, c, d, e, f, g;
-  uint32_t *tmp = kmalloc(self->block_size);
-  CHECK(tmp == NULL, "No memory.", ENOMEM);
+// Return the preallocation windows of all cached inodes. Windows are
+// only reserved in memory, so this is done before every sync to keep
+// them out of the bitmaps and free counts written to the disk.
+static void release_all_prealloc(ext2_fs_t *self)
+{
+  klock(&(self->icache_lock));
+  ext2_cinode_t *ci = self->icache_lru_head;
+  for (; ci; ci = ci->lru_next) release_prealloc(self, ci);
+  kunlock(&(self->icache_lock));
+}
 
-  a = inode_block_num - EXT2_DIRECT_BLOCKS;
-  if (a <= 0) {
-    inode->block_pointer[inode_block_num] = disk_block_num;
-    kfree(tmp);
-    return 0;
-  }
+static inline uint32_t name_hash(const char *name, uint32_t len)
+{
+  uint32_t h = 2166136261u;
+  for (uint32_t i = 0; i < len; ++i) h = (h ^ (uint8_t)name[i]) * 16777619u;
+  return h;
+}
 
-  b = a - p;
-  if (b <= 0) {
-    if (inode->block_pointer[EXT2_DIRECT_BLOCKS] == 0) {
-      uint32_t bn = alloc_block(self);
-      CHECK(bn == 0, "No space.", ENOSPC);
-      inode->block_pointer[EXT2_DIRECT_BLOCKS] = bn;
-      res = write_inode_info(self, inode, inode_num);
-      CHECK(res, "Failed to write inode info.", res);
+// Drop the directory index of an inode.
+static void release_dindex(ext2_cinode_t *ci)
+{
+  ext2_dindex_t *d = ci->dindex;
+  if (d == NULL) return;
+  for (uint32_t i = 0; i <= d->bucket_mask; ++i) {
+    ext2_dindex_entry_t *e = d->buckets[i];
+    while (e) {
+      ext2_dindex_entry_t *next = e->next;
+      kfree(e);
+      e = next;
     }
-    res = read_block(
-      self, inode->block_pointer[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp
-      );
-    CHECK(res != self->block_size, "Failed to read block.", EAGAIN);
-    tmp[a] = disk_block_num;
-    res = write_block(
-      self, inode->block_pointer[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp
-      );
-    CHECK(res != self->block_size, "Failed to write block.", EAGAIN);
-    kfree(tmp);
-    return 0;
   }
+  kfree(d->buckets);
+  kfree(d->gaps);
+  kfree(d);
+  ci->dindex = NULL;
+}
 
-  c = b - (p * p);
-  if (c <= 0) {
-    c = b / p;
-    d = b - (c * p);
-    if (inode->block_pointer[EXT2_DIRECT_BLOCKS + 1] == 0) {
-      uint32_t bn = alloc_block(self);
-      CHECK(bn == 0, "No space.", ENOSPC);
-      inode->block_pointer[EXT2_DIRECT_BLOCKS + 1] = bn;
-      res = write_inode_info(self, inode, inode_num);
-      CHECK(res, "Failed to write inode info.", res);
-    }
-    res = read_block(
-      self, inode->block_pointer[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp
-      );
-    CHECK(res != self->block_size, "Failed to read block.", EAGAIN);
-    if (tmp[c] == 0) {
-      uint32_t bn = alloc_block(self);
-      CHECK(bn == 0, "No space.", ENOSPC);
-      tmp[c] = bn;
-      res = write_block(
-        self, inode->block_pointer[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp
-        );
-      CHECK(res != self->block_size, "Failed to write block.", EAGAIN);
-    }
-    uint32_t bn = tmp[c];
-    res = read_block(self, bn, (uint8_t *)tmp);
-    CHECK(res != self->block_size, "Failed to read block.", EAGAIN);
-    tmp[d] = disk_block_num;
-    res = write_block(self, bn, (uint8_t *)tmp);
-    CHECK(res != self->block_size, "Failed to write block.", EAGAIN);
-    kfree(tmp);
-    return 0;
+static ext2_dindex_t *dindex_new()
+{
+  ext2_dindex_t *d = kmalloc(sizeof(ext2_dindex_t));
+  CHECK(d == NULL, "No memory.", NULL);
+  uint32_t size = EXT2_DINDEX_MIN * sizeof(ext2_dindex_entry_t *);
+  d->buckets = kmalloc(size);
+  if (d->buckets == NULL) { kfree(d); CHECK(1, "No memory.", NULL); }
+  u_memset(d->buckets, 0, size);
+  d->bucket_mask = EXT2_DINDEX_MIN - 1;
+  d->count = 0;
+  d->gaps = NULL;
+  d->gap_capacity = 0;
+  d->gap_hint = 0;
+  return d;
+}
+
+static ext2_dindex_entry_t *dindex_find(
+  ext2_dindex_t *d, const char *name, uint32_t len
+  )
+{
+  uint32_t h = name_hash(name, len);
+  ext2_dindex_entry_t *e = d->buckets[h & d->bucket_mask];
+  for (; e; e = e->next) {
+    if (e->hash != h || e->name_len != len) continue;
+    uint32_t i = 0;
+    for (; i < len && e->name[i] == name[i]; ++i);
+    if (i == len) return e;
   }
+  return NULL;
+}
 
-  d = c - (p * p * p);
-  if (d <= 0) {
-    e = c / (p * p);
-    f = (c - (e * p * p)) / p;
-    g = (c - (e * p * p) - (f * p));
-    if (inode->block_pointer[EXT2_DIRECT_BLOCKS + 2] == 0) {
-      uint32_t bn = alloc_block(self);
-      CHECK(bn == 0, "No space.", ENOSPC);
-      inode->block_pointer[EXT2_DIRECT_BLOCKS + 2] = bn;
-      res = write_inode_info(self, inode, inode_num);
-      CHECK(res, "Failed to write inode info.", res);
-    }
-    res = read_block(
-      self, inode->block_pointer[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp
-      );
-    CHECK(res != self->block_size, "Failed to read block.", EAGAIN);
-    if (tmp[e] == 0) {
-      uint32_t bn = alloc_block(self);
-      CHECK(bn == 0, "No space.", ENOSPC);
-      tmp[e] = bn;
-      res = write_block(
-        self, inode->block_pointer[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp
-        );
-      CHECK(res != self->block_size, "Failed to write block.", EAGAIN);
-    }
-    uint32_t nblock = tmp[e];
-    res = read_block(self, nblock, (uint8_t *)tmp);
-    CHECK(res != self->block_size, "Failed to read block.", EAGAIN);
-    if (tmp[f] == 0) {
-      uint32_t bn = alloc_block(self);
-      CHECK(bn == 0, "No space.", ENOSPC);
-      tmp[f] = bn;
-      res = write_block(self, nblock, (uint8_t *)tmp);
-      CHECK(res != self->block_size, "Failed to write block.", EAGAIN);
+// Double the number of buckets of a directory index. The index stays
+// usable with longer chains if there is no memory to grow it.
+static void dindex_grow(ext2_dindex_t *d)
+{
+  uint32_t bucket_count = (d->bucket_mask + 1) << 1;
+  ext2_dindex_entry_t **buckets =
+    kmalloc(bucket_count * sizeof(ext2_dindex_entry_t *));
+  if (buckets == NULL) return;
+  u_memset(buckets, 0, bucket_count * sizeof(ext2_dindex_entry_t *));
+  for (uint32_t i = 0; i <= d->bucket_mask; ++i) {
+    ext2_dindex_entry_t *e = d->buckets[i];
+    while (e) {
+      ext2_dindex_entry_t *next = e->next;
+      e->next = buckets[e->hash & (bucket_count - 1)];
+      buckets[e->hash & (bucket_count - 1)] = e;
+      e = next;
     }
-    nblock = tmp[f];
-    res = read_block(self, nblock, (uint8_t *)tmp);
-    CHECK(res != self->block_size, "Failed to read block.", EAGAIN);
-    tmp[g] = disk_block_num;
-    res = write_block(self, nblock, (uint8_t *)tmp);
-    CHECK(res != self->block_size, "Failed to write block.", EAGAIN);
-    kfree(tmp);
-    return 0;
   }
-
-  kfree(tmp);
-  return res;
+  kfree(d->buckets);
+  d->buckets = buckets;
+  d->bucket_mask = bucket_count - 1;
 }
 
-static uint32_t alloc_inode_block(
-  ext2_fs_t *self, ext2_inode_t *inode, uint32_t inode_num, uint32_t block_num
+static uint32_t dindex_insert(
+  ext2_dindex_t *d,
+  const char *name,
+  uint32_t len,
+  uint32_t inode_num,
+  uint32_t block_num,
+  uint32_t offset
   )
 {
-  uint32_t disk_block_num = alloc_block(self);
-  CHECK(disk_block_num == 0, "No space.", ENOSPC);
-
-  uint32_t res = set_disk_block_number(
-    self, inode, inode_num, block_num, disk_block_num
-    );
-  CHECK(res, "Failed to set block number.", res);
-
-  uint32_t tmp = (block_num + 1) * (self->block_size / 512);
-  if (inode->sector_count < tmp) inode->sector_count = tmp;
-
-  res = write_inode_info(self, inode, inode_num);
-  CHECK(res, "Failed to write inode info.", res);
-
+  ext2_dindex_entry_t *e = kmalloc(sizeof(ext2_dindex_entry_t) + len);
+  CHECK(e == NULL, "No memory.", ENOMEM);
+  e->hash = name_hash(name, len);
+  e->inode_num = inode_num;
+  e->block_num = block_num;
+  e->offset = offset;
+  e->name_len = len;
+  u_memcpy(e->name, name, len);
+
+  if (d->count >= (d->bucket_mask + 1) << 1) dindex_grow(d);
+  e->next = d->buckets[e->hash & d->bucket_mask];
+  d->buckets[e->hash & d->bucket_mask] = e;
+  ++(d->count);
   return 0;
 }
 
-static uint32_t free_inode_block(
-  ext2_fs_t *self, ext2_inode_t *inode, uint32_t inode_num, uint32_t block_num
-  )
+static void dindex_remove(ext2_dindex_t *d, ext2_dindex_entry_t *e)
 {
-  uint32_t disk_block_num = get_disk_block_number(self, inode, block_num);
-  CHECK(
-    disk_block_num >= (uint32_t)(-ENOMEM),
-    "Failed to get disk block number.",
-    EAGAIN
-    );
-  uint32_t res = free_block(self, disk_block_num);
-  CHECK(res, "Failed to free disk block.", res);
-  res = set_disk_block_number(self, inode, inode_num, block_num, 0);
-  CHECK(res, "Failed to set disk block number.", res);
-  return write_inode_info(self, inode, inode_num);
+  ext2_dindex_entry_t **p = &(d->buckets[e->hash & d->bucket_mask]);
+  for (; *p && *p != e; p = &((*p)->next));
+  if (*p == NULL) return;
+  *p = e->next;
+  --(d->count);
+  kfree(e);
 }
 
-static uint32_t read_inode_block(
-  ext2_fs_t *self, ext2_inode_t *inode, uint32_t block_num, uint8_t *buf
+// Record the largest gap of a directory block, growing the gap map if
+// the block is past its end.
+static uint32_t dindex_set_gap(
+  ext2_dindex_t *d, uint32_t block_num, uint32_t gap
   )
 {
-  uint32_t disk_block_num = get_disk_block_number(self, inode, block_num);
-  CHECK(
-    disk_block_num >= (uint32_t)(-ENOMEM),
-    "Failed to get disk block number.",
-    0
-    );
-  return read_block(self, disk_block_num, buf);
+  if (block_num >= d->gap_capacity) {
+    uint32_t capacity = d->gap_capacity ? d->gap_capacity : 1;
+    while (capacity <= block_num) capacity <<= 1;
+    uint32_t *gaps = kmalloc(capacity * sizeof(uint32_t));
+    CHECK(gaps == NULL, "No memory.", ENOMEM);
+    u_memset(gaps, 0, capacity * sizeof(uint32_t));
+    if (d->gaps) {
+      u_memcpy(gaps, d->gaps, d->gap_capacity * sizeof(uint32_t));
+      kfree(d->gaps);
+    }
+    d->gaps = gaps;
+    d->gap_capacity = capacity;
+  }
+  d->gaps[block_num] = gap;
+  return 0;
 }
 
-static uint32_t write_inode_block(
-  ext2_fs_t *self,
-  ext2_inode_t *inode,
-  uint32_t inode_num,
-  uint32_t block_num,
-  uint8_t *buf
+// Find a directory block with a gap of at least `size` bytes, starting
+// at the hint and wrapping around. Returns `block_count` if there is
+// no such block.
+static uint32_t dindex_find_gap(
+  ext2_dindex_t *d, uint32_t block_count, uint32_t size
   )
 {
-  uint32_t res = 0;
-  while (block_num >= inode->sector_count / (self->block_size / 512)) {
-    res = alloc_inode_block(
-      self, inode, inode_num, inode->sector_count / (self->block_size / 512)
-      );
-    CHECK(res, "Failed to allocate block.", 0);
-    res = read_inode_info(self, inode, inode_num);
-    CHECK(res, "Failed to read inode info.", 0);
+  uint32_t start = d->gap_hint < block_count ? d->gap_hint : 0;
+  for (uint32_t i = 0; i < block_count; ++i) {
+    uint32_t block_num = (start + i) % block_count;
+    if (d->gaps[block_num] >= size) return block_num;
   }
+  return block_count;
+}
 
-  uint32_t disk_block_num = get_disk_block_number(self, inode, block_num);
-  CHECK(
-    disk_block_num >= (uint32_t)(-ENOMEM),
-    "Failed to get disk block number.",
-    0
-    );
+// Evict the least recently used unreferenced inode.
+static void icache_evict(ext2_fs_t *self)
+{
+  ext2_cinode_t *ci = self->icache_lru_tail;
+  for (; ci && ci->refcount; ci = ci->lru_prev);
+  if (ci == NULL) return;
 
-  return write_block(self, disk_block_num, buf);
+  if (ci->dirty) {
+    uint32_t res = store_inode(self, &(ci->inode), ci->inode_num);
+    if (res) { log_error("ext2", "Failed to write inode.\n"); return; }
+  }
+
+  ext2_cinode_t **p = &(self->icache[ci->inode_num % EXT2_ICACHE_SIZE]);
+  for (; *p && *p != ci; p = &((*p)->hash_next));
+  if (*p) *p = ci->hash_next;
+  icache_lru_unlink(self, ci);
+  --(self->icache_count);
+  release_prealloc(self, ci);
+  release_map(ci);
+  release_dindex(ci);
+  kfree(ci);
 }
 
-static int32_t create_dir_entry(
-  fs_node_t *node, char *name, uint32_t inode_num
-  )
+// Get a referenced in-memory inode, reading it from the disk if
+// it is not cached.
+static ext2_cinode_t *iget(ext2_fs_t *self, uint32_t inode_num)
 {
-  ext2_fs_t *self = node->device;
-  ext2_inode_t inode;
-  uint32_t res = read_inode_info(self, &inode, node->inode);
-  CHECK(res, "Failed to read inode info.", -res);
-  if ((inode.permissions & EXT2_S_IFDIR) == 0)
-    return -ENOTDIR;
-
-  uint32_t ent_size = sizeof(ext2_dir_entry_t) + u_strlen(name);
-  if (ent_size % 4) ent_size += 4 - (ent_size % 4);
-  uint8_t *blk_buf = kmalloc(self->block_size);
-  CHECK(blk_buf == NULL, "No memory.", -ENOMEM);
-  uint32_t block_num = 0;
-  res = read_inode_block(self, &inode, block_num, blk_buf);
-  CHECK(res != self->block_size, "Failed to read inode block.", -EAGAIN);
+  klock(&(self->icache_lock));
+
+  ext2_cinode_t *ci = self->icache[inode_num % EXT2_ICACHE_SIZE];
+  for (; ci && ci->inode_num != inode_num; ci = ci->hash_next);
+  if (ci) {
+    icache_lru_unlink(self, ci);
+    icache_lru_push_front(self, ci);
+    ++(ci->refcount);
+    kunlock(&(self->icache_lock));
+    return ci;
+  }
 
-  uint32_t idx = 0;
-  uint32_t dir_idx = 0;
-  ext2_dir_entry_t *current_entry = NULL;
-  for (
-    ;
-    idx < inode.size;
-    idx += current_entry->size, dir_idx += current_entry->size
-    )
-  {
-    if (dir_idx >= self->block_size) {
-      ++block_num;
-      dir_idx = 0;
-      res = read_inode_block(self, &inode, block_num, blk_buf);
-      CHECK(res != self->block_size, "Failed to read inode block.", -EAGAIN);
-    }
+  if (self->icache_count >= EXT2_ICACHE_SIZE) icache_evict(self);
+
+  ci = kmalloc(sizeof(ext2_cinode_t));
+  if (ci == NULL) {
+    kunlock(&(self->icache_lock));
+    CHECK(1, "No memory.", NULL);
+  }
+  u_memset(ci, 0, sizeof(ext2_cinode_t));
+  uint32_t res = load_inode(self, &(ci->inode), inode_num);
+  if (res) {
+    kfree(ci);
+    kunlock(&(self->icache_lock));
+    CHECK(1, "Failed to read inode.", NULL);
+  }
+
+  ci->inode_num = inode_num;
+  ci->refcount = 1;
+  ci->version = ++(self->next_version);
+  uint32_t h = inode_num % EXT2_ICACHE_SIZE;
+  ci->hash_next = self->icache[h];
+  self->icache[h] = ci;
+  icache_lru_push_front(self, ci);
+  ++(self->icache_count);
+
+  kunlock(&(self->icache_lock));
+  return ci;
+}
+
+// Give an inode a new version after its data changed.
+static void bump_version(ext2_fs_t *self, ext2_cinode_t *ci)
+{
+  klock(&(self->icache_lock));
+  ci->version = ++(self->next_version);
+  kunlock(&(self->icache_lock));
+}
+
+// Drop a reference to an in-memory inode.
+static void iput(ext2_fs_t *self, ext2_cinode_t *ci)
+{
+  if (ci == NULL) return;
+  klock(&(self->icache_lock));
+  --(ci->refcount);
+  kunlock(&(self->icache_lock));
+}
+
+// Write all dirty in-memory inodes to the inode table.
+static uint32_t sync_inodes(ext2_fs_t *self)
+{
+  klock(&(self->icache_lock));
+
+  uint32_t err = 0;
+  ext2_cinode_t *ci = self->icache_lru_head;
+  for (; ci; ci = ci->lru_next) {
+    uint8_t dirty = ci->dirty;
+    if (dirty == 0) continue;
+    // Clear the flags first so that changes made during the write
+    // keep the inode dirty.
+    ci->dirty = 0;
+    uint32_t res = store_inode(self, &(ci->inode), ci->inode_num);
+    if (res) { ci->dirty |= dirty; err = res; }
+  }
+
+  kunlock(&(self->icache_lock));
+  return err;
+}
+
+static uint32_t read_inode_info(
+  ext2_fs_t *self, ext2_inode_t *inode, uint32_t inode_num
+  )
+{
+  ext2_cinode_t *ci = iget(self, inode_num);
+  CHECK(ci == NULL, "Failed to get inode.", EAGAIN);
+  if (inode != &(ci->inode))
+    u_memcpy(inode, &(ci->inode), sizeof(ext2_inode_t));
+  iput(self, ci);
+  return 0;
+}
+
+// Get a referenced in-memory inode and lock it for reading or writing.
+static ext2_cinode_t *ilock(ext2_fs_t *self, uint32_t inode_num, uint8_t write)
+{
+  ext2_cinode_t *ci = iget(self, inode_num);
+  if (ci == NULL) return NULL;
+  if (write) kwlock(&(ci->lock));
+  else krlock(&(ci->lock));
+  return ci;
+}
+
+// Unlock an inode locked with `ilock` and drop the reference to it.
+static void iunlock(ext2_fs_t *self, ext2_cinode_t *ci)
+{
+  if (ci == NULL) return;
+  krwunlock(&(ci->lock));
+  iput(self, ci);
+}
+
+// Write dirty metadata, inodes and cached blocks back to the disk.
+static uint32_t sync_fs(ext2_fs_t *self)
+{
+  release_all_prealloc(self);
+  uint32_t err = 0;
+  uint32_t res = sync_metadata(self);
+  if (res) { log_error("ext2", "Failed to sync metadata.\n"); err = res; }
+  res = sync_inodes(self);
+  if (res) { log_error("ext2", "Failed to sync inodes.\n"); err = res; }
+  res = bcache_sync(self->block_device);
+  if (res) { log_error("ext2", "Failed to sync block cache.\n"); err = res; }
+  return err;
+}
+
+// Called at the end of every operation. Dirty blocks are normally
+// written back by the flusher thread and by sync and fsync; they are
+// only written back here if they fill up half of the block cache, so
+// that evictions don't have to write them one at a time.
+static void finish_op(ext2_fs_t *self)
+{
+  bcache_stats_t stats;
+  bcache_stats(&stats);
+  if (stats.dirty * 2 >= stats.capacity) sync_fs(self);
+}
+
+// Get the entries of an indirect block of an inode from the inode's
+// block map cache, reading the block into the given slot if it is not
+// already there.
+static uint32_t *map_entries(
+  ext2_fs_t *self, ext2_cinode_t *ci, uint32_t slot, uint32_t block_num
+  )
+{
+  ext2_mapblock_t *mb = &(ci->map[slot]);
+  if (mb->entries && mb->block_num == block_num) return mb->entries;
+
+  if (mb->entries == NULL) {
+    mb->entries = kmalloc(self->block_size);
+    CHECK(mb->entries == NULL, "No memory.", NULL);
+  }
+  mb->block_num = 0;
+  uint32_t res = read_block(self, block_num, (uint8_t *)mb->entries);
+  CHECK(res != self->block_size, "Failed to read block.", NULL);
+  mb->block_num = block_num;
+
+  return mb->entries;
+}
+
+// Set up a newly allocated indirect block of an inode in the given
+// slot of its block map cache. The block is cleared on the disk.
+static uint32_t *map_new_entries(
+  ext2_fs_t *self, ext2_cinode_t *ci, uint32_t slot, uint32_t block_num
+  )
+{
+  ext2_mapblock_t *mb = &(ci->map[slot]);
+  if (mb->entries == NULL) {
+    mb->entries = kmalloc(self->block_size);
+    CHECK(mb->entries == NULL, "No memory.", NULL);
+  }
+  u_memset(mb->entries, 0, self->block_size);
+  mb->block_num = block_num;
+  uint32_t res = write_block(self, block_num, (uint8_t *)mb->entries);
+  CHECK(res != self->block_size, "Failed to clear block.", NULL);
+
+  return mb->entries;
+}
+
+// First block of the group an inode belongs to, used as the default
+// allocation goal for its blocks.
+static uint32_t inode_goal(ext2_fs_t *self, ext2_cinode_t *ci)
+{
+  uint32_t group = (ci->inode_num - 1) / self->inodes_per_group;
+  return self->superblock->superblock_idx + (group * self->blocks_per_group);
+}
+
+// Find the level of indirection of a logical block past the direct
+// blocks, and its index and span within that level.
+static uint32_t map_level(
+  ext2_fs_t *self, uint32_t *index, uint32_t *span
+  )
+{
+  uint32_t p = self->block_size / 4;
+  *span = p;
+  for (uint32_t level = 0; level < 3; ++level, *span *= p) {
+    if (*index < *span) return level;
+    *index -= *span;
+  }
+  return 3;
+}
+
+static inline uint8_t has_extents(ext2_inode_t *inode)
+{ return (inode->flags & EXT4_EXTENTS_FL) != 0; }
+
+static inline ext4_extent_header_t *extent_root(ext2_inode_t *inode)
+{ return (ext4_extent_header_t *)inode->block_pointer; }
+
+// Entries of an extent tree node. Index entries and extents are the
+// same size and both start with their first logical block.
+static inline ext4_extent_t *node_extents(ext4_extent_header_t *h)
+{ return (ext4_extent_t *)(h + 1); }
+static inline ext4_extent_idx_t *node_indexes(ext4_extent_header_t *h)
+{ return (ext4_extent_idx_t *)(h + 1); }
+static inline uint32_t node_key(ext4_extent_header_t *h, uint32_t i)
+{ return node_extents(h)[i].block; }
+
+// Number of blocks of an extent, written or not.
+static inline uint32_t extent_len(ext4_extent_t *ext)
+{
+  return ext->len > EXT4_EXTENT_MAX_LEN
+    ? ext->len - EXT4_EXTENT_MAX_LEN : ext->len;
+}
+
+// Make the block pointers of an inode an empty extent tree.
+static void init_extent_root(ext2_inode_t *inode)
+{
+  u_memset(inode->block_pointer, 0, sizeof(inode->block_pointer));
+  ext4_extent_header_t *h = extent_root(inode);
+  h->magic = EXT4_EXTENT_MAGIC;
+  h->max = (sizeof(inode->block_pointer) - sizeof(ext4_extent_header_t))
+    / sizeof(ext4_extent_t);
+  inode->flags |= EXT4_EXTENTS_FL;
+}
+
+// Path from the root of an extent tree to the leaf that covers a
+// logical block. `pos[i]` is the entry followed at level `i`; in the
+// leaf, it is the last extent that starts at or before the block, or
+// -1 if there is none. `next_key` is the first logical block after
+// the block that is covered by a later entry of some node on the path.
+typedef struct ext4_extent_path_s {
+  ext4_extent_header_t *node[EXT4_EXTENT_MAX_DEPTH + 1];
+  uint32_t block[EXT4_EXTENT_MAX_DEPTH + 1];
+  int32_t pos[EXT4_EXTENT_MAX_DEPTH + 1];
+  uint32_t depth;
+  uint32_t next_key;
+} ext4_extent_path_t;
+
+// Walk an extent tree down to the leaf that covers a logical block.
+// The nodes below the root are kept in the block map cache, with the
+// node at level `i` in slot `i - 1`.
+static uint32_t find_extent_path(
+  ext2_fs_t *self, ext2_cinode_t *ci, uint32_t block_num,
+  ext4_extent_path_t *path
+  )
+{
+  ext4_extent_header_t *h = extent_root(&(ci->inode));
+  CHECK(
+    h->magic != EXT4_EXTENT_MAGIC || h->depth > EXT4_EXTENT_MAX_DEPTH,
+    "Bad extent tree root.",
+    EINVAL
+    );
+  path->depth = h->depth;
+  path->next_key = 0xFFFFFFFF;
+  path->block[0] = 0;
+  for (uint32_t level = 0; ; ++level) {
+    path->node[level] = h;
+    int32_t lo = 0, hi = (int32_t)(h->entries) - 1, pos = -1;
+    while (lo <= hi) {
+      int32_t mid = (lo + hi) / 2;
+      if (node_key(h, mid) <= block_num) { pos = mid; lo = mid + 1; }
+      else hi = mid - 1;
+    }
+
+    // Blocks before the first index entry still belong to its subtree.
+    if (level < path->depth) {
+      CHECK(h->entries == 0, "Empty extent index node.", EINVAL);
+      if (pos < 0) pos = 0;
+    }
+    path->pos[level] = pos;
+    if (
+      pos + 1 < h->entries && node_key(h, pos + 1) < path->next_key
+      ) path->next_key = node_key(h, pos + 1);
+    if (level == path->depth) return 0;
+
+    uint32_t child = node_indexes(h)[pos].leaf_lo;
+    h = (ext4_extent_header_t *)map_entries(self, ci, level, child);
+    CHECK(h == NULL, "Failed to read extent tree node.", EAGAIN);
+    CHECK(h->magic != EXT4_EXTENT_MAGIC, "Bad extent tree node.", EINVAL);
+    path->block[level + 1] = child;
+  }
+}
+
+// Find the disk block of a logical block of an extent-mapped inode.
+// Unwritten extents read as holes.
+static uint32_t lookup_extent(
+  ext2_fs_t *self, ext2_cinode_t *ci, uint32_t block_num, uint32_t *hole_count
+  )
+{
+  ext4_extent_path_t path;
+  uint32_t res = find_extent_path(self, ci, block_num, &path);
+  CHECK(res, "Failed to walk extent tree.", -1);
+
+  int32_t pos = path.pos[path.depth];
+  if (pos >= 0) {
+    ext4_extent_t *ext = node_extents(path.node[path.depth]) + pos;
+    uint32_t offset = block_num - ext->block;
+    if (offset < extent_len(ext)) {
+      if (ext->len <= EXT4_EXTENT_MAX_LEN) return ext->start_lo + offset;
+      *hole_count = extent_len(ext) - offset;
+      return 0;
+    }
+  }
+  *hole_count = path.next_key - block_num;
+  return 0;
+}
+
+// Write back a node of an extent tree path. The root lives in the
+// inode.
+static uint32_t write_extent_node(
+  ext2_fs_t *self, ext2_cinode_t *ci, ext4_extent_path_t *path, uint32_t level
+  )
+{
+  if (level == 0) { ci->dirty |= EXT2_DIRTY_DATA; return 0; }
+  uint32_t res = write_block(
+    self, path->block[level], (uint8_t *)(path->node[level])
+    );
+  CHECK(res != self->block_size, "Failed to write extent tree node.", EAGAIN);
+  return 0;
+}
+
+// Allocate and set up a new node of an extent tree, holding `count`
+// entries copied from `entries`.
+static uint32_t new_extent_node(
+  ext2_fs_t *self,
+  ext2_cinode_t *ci,
+  uint32_t goal,
+  uint16_t depth,
+  void *entries,
+  uint32_t count
+  )
+{
+  uint32_t block_num = alloc_block(self, goal);
+  CHECK(block_num == 0, "No space.", 0);
+  ci->inode.sector_count += self->block_size / 512;
+  ci->dirty |= EXT2_DIRTY_DATA;
+
+  uint8_t *buf = kmalloc(self->block_size);
+  if (buf == NULL) {
+    free_blocks(self, block_num, 1);
+    ci->inode.sector_count -= self->block_size / 512;
+    CHECK(1, "No memory.", 0);
+  }
+  u_memset(buf, 0, self->block_size);
+  ext4_extent_header_t *h = (ext4_extent_header_t *)buf;
+  h->magic = EXT4_EXTENT_MAGIC;
+  h->entries = count;
+  h->max = (self->block_size - sizeof(ext4_extent_header_t))
+    / sizeof(ext4_extent_t);
+  h->depth = depth;
+  u_memcpy(h + 1, entries, count * sizeof(ext4_extent_t));
+  uint32_t res = write_block(self, block_num, buf);
+  kfree(buf);
+  CHECK(res != self->block_size, "Failed to write extent tree node.", 0);
+  return block_num;
+}
+
+// Make room on the path to a full leaf. The full node closest to the
+// root below a node with room is split in two, the entries after the
+// path moving to a new node that is added to the parent. If every
+// node on the path is full, the contents of the root move to a new
+// node and the tree grows by a level. Either way the path has to be
+// walked again.
+static uint32_t split_extent_path(
+  ext2_fs_t *self, ext2_cinode_t *ci, ext4_extent_path_t *path, uint32_t goal
+  )
+{
+  int32_t level = path->depth;
+  for (; level >= 0; --level) {
+    if (path->node[level]->entries < path->node[level]->max) break;
+  }
+
+  if (level < 0) {
+    ext4_extent_header_t *root = path->node[0];
+    CHECK(
+      root->depth >= EXT4_EXTENT_MAX_DEPTH, "Extent tree too deep.", ENOSPC
+      );
+    uint32_t child = new_extent_node(
+      self, ci, goal, root->depth, root + 1, root->entries
+      );
+    CHECK(child == 0, "Failed to add extent tree node.", ENOSPC);
+    ext4_extent_idx_t *idx = node_indexes(root);
+    idx->block = node_key(root, 0);
+    idx->leaf_lo = child;
+    idx->leaf_hi = 0;
+    idx->unused = 0;
+    root->entries = 1;
+    ++(root->depth);
+    ci->dirty |= EXT2_DIRTY_DATA;
+    return 0;
+  }
+
+  // Keep at least one entry on each side of the split.
+  ext4_extent_header_t *full = path->node[level + 1];
+  int32_t split = path->pos[level + 1] + 1;
+  if (split < 1) split = 1;
+  if (split > full->entries - 1) split = full->entries - 1;
+  uint32_t key = node_key(full, split);
+  uint32_t child = new_extent_node(
+    self, ci, goal, full->depth,
+    node_extents(full) + split, full->entries - split
+    );
+  CHECK(child == 0, "Failed to add extent tree node.", ENOSPC);
+  full->entries = split;
+  uint32_t res = write_extent_node(self, ci, path, level + 1);
+  CHECK(res, "Failed to write extent tree node.", res);
+
+  ext4_extent_header_t *parent = path->node[level];
+  ext4_extent_idx_t *idx = node_indexes(parent) + path->pos[level] + 1;
+  uint32_t after = parent->entries - (path->pos[level] + 1);
+  u_memmove(idx + 1, idx, after * sizeof(ext4_extent_idx_t));
+  idx->block = key;
+  idx->leaf_lo = child;
+  idx->leaf_hi = 0;
+  idx->unused = 0;
+  ++(parent->entries);
+  return write_extent_node(self, ci, path, level);
+}
+
+// Map `len` logical blocks starting at `block_num`, which must be
+// holes, to the disk blocks starting at `disk_block_num`. The blocks
+// are added to the extent before them if they continue it, and that
+// extent is merged with the next one if they become contiguous.
+static uint32_t insert_extent(
+  ext2_fs_t *self,
+  ext2_cinode_t *ci,
+  uint32_t block_num,
+  uint32_t disk_block_num,
+  uint32_t len
+  )
+{
+  ext4_extent_path_t path;
+  ext4_extent_header_t *leaf = NULL;
+  ext4_extent_t *prev = NULL;
+  int32_t pos = -1;
+  for (;;) {
+    uint32_t res = find_extent_path(self, ci, block_num, &path);
+    CHECK(res, "Failed to walk extent tree.", res);
+    leaf = path.node[path.depth];
+    pos = path.pos[path.depth];
+    prev = pos >= 0 ? node_extents(leaf) + pos : NULL;
+    CHECK(
+      (prev && block_num < prev->block + extent_len(prev))
+      || block_num + len > path.next_key,
+      "Blocks are already mapped.",
+      EINVAL
+      );
 
-    current_entry = (ext2_dir_entry_t *)(blk_buf + dir_idx);
-    uint32_t e_size = sizeof(ext2_dir_entry_t) + current_entry->name_len;
-    if (e_size % 4) e_size += 4 - (e_size % 4);
     if (
-      current_entry->size != e_size && idx + current_entry->size == inode.size
+      prev && prev->len + len <= EXT4_EXTENT_MAX_LEN
+      && prev->block + prev->len == block_num
+      && prev->start_lo + prev->len == disk_block_num
       )
     {
-      idx += e_size;
-      dir_idx += e_size;
-      if (dir_idx + ent_size >= self->block_size) {
-        kfree(blk_buf); return -ENOSPC;
+      prev->len += len;
+      ext4_extent_t *next = prev + 1;
+      if (
+        pos + 1 < leaf->entries
+        && prev->len + next->len <= EXT4_EXTENT_MAX_LEN
+        && prev->block + prev->len == next->block
+        && prev->start_lo + prev->len == next->start_lo
+        )
+      {
+        prev->len += next->len;
+        uint32_t after = leaf->entries - (pos + 2);
+        u_memmove(next, next + 1, after * sizeof(ext4_extent_t));
+        --(leaf->entries);
       }
-      current_entry->size = e_size;
-      break;
+      return write_extent_node(self, ci, &path, path.depth);
     }
+
+    if (leaf->entries < leaf->max) break;
+    res = split_extent_path(self, ci, &path, disk_block_num + len);
+    CHECK(res, "Failed to split extent tree.", res);
   }
 
-  current_entry = (ext2_dir_entry_t *)((uint32_t)blk_buf + dir_idx);
-  current_entry->inode = inode_num;
-  current_entry->size = self->block_size - dir_idx;
-  current_entry->name_len = u_strlen(name);
-  current_entry->type = 0;
-  u_memcpy(current_entry->name, name, current_entry->name_len);
+  ext4_extent_t *ext = node_extents(leaf) + pos + 1;
+  uint32_t after = leaf->entries - (pos + 1);
+  u_memmove(ext + 1, ext, after * sizeof(ext4_extent_t));
+  ext->block = block_num;
+  ext->len = len;
+  ext->start_hi = 0;
+  ext->start_lo = disk_block_num;
+  ++(leaf->entries);
+  uint32_t res = write_extent_node(self, ci, &path, path.depth);
+  CHECK(res, "Failed to write extent tree node.", res);
+
+  // A new first extent of a leaf may come before the keys that lead
+  // to the leaf.
+  for (int32_t level = path.depth - 1; level >= 0 && pos < 0; --level) {
+    ext4_extent_idx_t *idx = node_indexes(path.node[level]) + path.pos[level];
+    if (idx->block <= block_num) break;
+    idx->block = block_num;
+    res = write_extent_node(self, ci, &path, level);
+    CHECK(res, "Failed to write extent tree node.", res);
+    if (path.pos[level]) break;
+  }
+  return 0;
+}
 
-  res = write_inode_block(self, &inode, node->inode, block_num, blk_buf);
-  CHECK(res != self->block_size, "Failed to write inode block", -EAGAIN);
+// Find the disk block of a logical block of an inode. If the block is
+// a hole, `*hole_count` is set to the number of logical blocks from
+// `block_num` on that are known to be holes too, which is more than
+// one when a whole indirect block is missing.
+static uint32_t lookup_disk_block_number(
+  ext2_fs_t *self, ext2_cinode_t *ci, uint32_t block_num, uint32_t *hole_count
+  )
+{
+  ext2_inode_t *inode = &(ci->inode);
+  *hole_count = 1;
+  if (has_extents(inode)) return lookup_extent(self, ci, block_num, hole_count);
+  if (block_num < EXT2_DIRECT_BLOCKS) return inode->block_pointer[block_num];
 
-  dir_idx += current_entry->size;
-  if (dir_idx >= self->block_size) {
-    ++block_num;
-    dir_idx = 0;
-    res = read_inode_block(self, &inode, block_num, blk_buf);
-    CHECK(res != self->block_size, "Failed to read inode block.", -EAGAIN);
+  uint32_t p = self->block_size / 4;
+  uint32_t index = block_num - EXT2_DIRECT_BLOCKS;
+  uint32_t span = 0;
+  uint32_t level = map_level(self, &index, &span);
+  if (level >= 3) { *hole_count = 0xFFFFFFFF - block_num; return 0; }
+
+  // Walk down the indirect blocks, which are cached in the slots
+  // 0 (single), 1-2 (double) and 3-5 (triple).
+  uint32_t slot = (level * (level + 1)) / 2;
+  uint32_t disk_block_num = inode->block_pointer[EXT2_DIRECT_BLOCKS + level];
+  for (uint32_t i = 0; i <= level; ++i, ++slot) {
+    if (disk_block_num == 0) { *hole_count = span - index; return 0; }
+    uint32_t *entries = map_entries(self, ci, slot, disk_block_num);
+    CHECK(entries == NULL, "Failed to read indirect block.", -1);
+    span /= p;
+    disk_block_num = entries[index / span];
+    index %= span;
   }
-  current_entry = (ext2_dir_entry_t *)((uint32_t)blk_buf + dir_idx);
-  u_memset(current_entry, 0, sizeof(ext2_dir_entry_t));
 
-  res = write_inode_block(self, &inode, node->inode, block_num, blk_buf);
-  CHECK(res != self->block_size, "Failed to write inode block", -EAGAIN);
+  return disk_block_num;
+}
+
+// Get the disk block that holds a logical block of an inode, or 0 if
+// the block is not allocated. Readers of an inode may look up blocks
+// concurrently, so the block map cache is locked during the walk.
+static uint32_t get_disk_block_number(
+  ext2_fs_t *self, ext2_cinode_t *ci, uint32_t block_num
+  )
+{
+  if (block_num < EXT2_DIRECT_BLOCKS && !has_extents(&(ci->inode)))
+    return ci->inode.block_pointer[block_num];
+  uint32_t hole_count = 0;
+  klock(&(ci->map_lock));
+  uint32_t disk_block_num =
+    lookup_disk_block_number(self, ci, block_num, &hole_count);
+  kunlock(&(ci->map_lock));
+  return disk_block_num;
+}
+
+static uint32_t set_disk_block_number(
+  ext2_fs_t *self,
+  ext2_cinode_t *ci,
+  uint32_t inode_block_num,
+  uint32_t disk_block_num
+  )
+{
+  ext2_inode_t *inode = &(ci->inode);
+  if (inode_block_num < EXT2_DIRECT_BLOCKS) {
+    inode->block_pointer[inode_block_num] = disk_block_num;
+    ci->dirty |= EXT2_DIRTY_DATA;
+    return 0;
+  }
+
+  uint32_t p = self->block_size / 4;
+  uint32_t index = inode_block_num - EXT2_DIRECT_BLOCKS;
+  uint32_t span = 0;
+  uint32_t level = map_level(self, &index, &span);
+  CHECK(level >= 3, "Block number too large.", EINVAL);
+
+  // `parent_entries` holds the entry at `parent_idx` that refers to
+  // the next block down. It is NULL for the inode's own block pointers.
+  uint32_t slot = (level * (level + 1)) / 2;
+  uint32_t *parent_entries = NULL;
+  uint32_t parent_idx = EXT2_DIRECT_BLOCKS + level;
+  uint32_t parent_block = 0;
+  uint32_t res = 0;
+  for (uint32_t i = 0; i <= level; ++i, ++slot) {
+    uint32_t child_block = parent_entries
+      ? parent_entries[parent_idx] : inode->block_pointer[parent_idx];
+    if (child_block == 0) {
+      // Place new indirect blocks right after the data block.
+      child_block = alloc_block(
+        self, disk_block_num ? disk_block_num + 1 : inode_goal(self, ci)
+        );
+      CHECK(child_block == 0, "No space.", ENOSPC);
+      inode->sector_count += self->block_size / 512;
+      ci->dirty |= EXT2_DIRTY_DATA;
+      if (parent_entries == NULL) {
+        inode->block_pointer[parent_idx] = child_block;
+      } else {
+        parent_entries[parent_idx] = child_block;
+        res = write_block(self, parent_block, (uint8_t *)parent_entries);
+        CHECK(res != self->block_size, "Failed to write block.", EAGAIN);
+      }
+      parent_entries = map_new_entries(self, ci, slot, child_block);
+    } else parent_entries = map_entries(self, ci, slot, child_block);
+
+    parent_block = child_block;
+    CHECK(parent_entries == NULL, "Failed to read indirect block.", EAGAIN);
+    span /= p;
+    parent_idx = index / span;
+    index %= span;
+  }
+
+  parent_entries[parent_idx] = disk_block_num;
+  res = write_block(self, parent_block, (uint8_t *)parent_entries);
+  CHECK(res != self->block_size, "Failed to write block.", EAGAIN);
+
+  return 0;
+}
+
+// There is no wall clock, so deletion times count the uptime from the
+// last write time in the superblock. fsck reads a dtime below the inode
+// count as a link in the orphan list, so the result never goes below it.
+static uint32_t deletion_time(ext2_fs_t *self)
+{
+  uint32_t now = self->superblock->write_time + (pit_get_time() / 1000);
+  if (now < self->superblock->inode_count)
+    now = self->superblock->inode_count;
+  return now;
+}
+
+static inline uint8_t is_fast_symlink(ext2_inode_t *inode)
+{
+  return (inode->permissions & 0xF000) == EXT2_S_IFLNK
+    && inode->sector_count == 0;
+}
+
+// Blocks collected while freeing the block tree of an inode. Blocks
+// that are contiguous on the disk are freed together.
+typedef struct ext2_free_run_s {
+  uint32_t start;
+  uint32_t count;
+} ext2_free_run_t;
+
+static uint32_t free_run_add(
+  ext2_fs_t *self, ext2_free_run_t *run, uint32_t block_num, uint32_t count
+  )
+{
+  if (block_num == 0 || count == 0) return 0;
+  if (run->count && block_num == run->start + run->count) {
+    run->count += count; return 0;
+  }
+  uint32_t res = run->count ? free_blocks(self, run->start, run->count) : 0;
+  run->start = block_num;
+  run->count = count;
+  return res;
+}
+
+// Free an indirect block and everything below it. `depth` is 1 for
+// singly indirect blocks.
+static uint32_t free_indirect_block(
+  ext2_fs_t *self, ext2_free_run_t *run, uint32_t block_num, uint32_t depth
+  )
+{
+  if (block_num == 0) return 0;
+  uint32_t *entries = kmalloc(self->block_size);
+  CHECK(entries == NULL, "No memory.", ENOMEM);
+  uint32_t res = read_block(self, block_num, (uint8_t *)entries);
+  if (res != self->block_size) {
+    kfree(entries);
+    CHECK(1, "Failed to read block.", EAGAIN);
+  }
+
+  // Indirect blocks are allocated just before the blocks they point
+  // to, so they are freed first to keep the runs contiguous.
+  uint32_t err = free_run_add(self, run, block_num, 1);
+  for (uint32_t i = 0; i < self->block_size / sizeof(uint32_t); ++i) {
+    if (depth == 1) res = free_run_add(self, run, entries[i], 1);
+    else res = free_indirect_block(self, run, entries[i], depth - 1);
+    if (res) err = res;
+  }
+  kfree(entries);
+  return err;
+}
+
+// Free the blocks an extent tree node maps, and the nodes below it.
+// Nodes are freed before the blocks they map, like indirect blocks.
+static uint32_t free_extent_node(
+  ext2_fs_t *self, ext2_free_run_t *run, ext4_extent_header_t *h
+  )
+{
+  uint32_t err = 0;
+  if (h->depth == 0) {
+    for (uint32_t i = 0; i < h->entries; ++i) {
+      ext4_extent_t *ext = node_extents(h) + i;
+      uint32_t res = free_run_add(self, run, ext->start_lo, extent_len(ext));
+      if (res) err = res;
+    }
+    return err;
+  }
+
+  uint8_t *buf = kmalloc(self->block_size);
+  CHECK(buf == NULL, "No memory.", ENOMEM);
+  for (uint32_t i = 0; i < h->entries; ++i) {
+    uint32_t child = node_indexes(h)[i].leaf_lo;
+    uint32_t res = read_block(self, child, buf);
+    if (
+      res != self->block_size
+      || ((ext4_extent_header_t *)buf)->magic != EXT4_EXTENT_MAGIC
+      ) { err = EAGAIN; continue; }
+    res = free_run_add(self, run, child, 1);
+    if (res) err = res;
+    res = free_extent_node(self, run, (ext4_extent_header_t *)buf);
+    if (res) err = res;
+  }
+  kfree(buf);
+  return err;
+}
+
+// Free every block of an inode, walking its block tree once. Bitmaps
+// and counters are only changed in memory, and written back once by
+// the next sync.
+static uint32_t free_inode_blocks(ext2_fs_t *self, ext2_cinode_t *ci)
+{
+  ext2_inode_t *inode = &(ci->inode);
+  release_prealloc(self, ci);
+
+  uint32_t err = 0;
+  if (has_extents(inode)) {
+    ext2_free_run_t run = { 0, 0 };
+    ext4_extent_header_t *root = extent_root(inode);
+    if (root->magic == EXT4_EXTENT_MAGIC)
+      err = free_extent_node(self, &run, root);
+    if (run.count) {
+      uint32_t res = free_blocks(self, run.start, run.count);
+      if (res) err = res;
+    }
+  } else if (!is_fast_symlink(inode)) {
+    ext2_free_run_t run = { 0, 0 };
+    for (uint32_t i = 0; i < EXT2_DIRECT_BLOCKS; ++i) {
+      uint32_t res = free_run_add(self, &run, inode->block_pointer[i], 1);
+      if (res) err = res;
+    }
+    for (uint32_t depth = 1; depth <= 3; ++depth) {
+      uint32_t res = free_indirect_block(
+        self, &run, inode->block_pointer[EXT2_DIRECT_BLOCKS + depth - 1], depth
+        );
+      if (res) err = res;
+    }
+    if (run.count) {
+      uint32_t res = free_blocks(self, run.start, run.count);
+      if (res) err = res;
+    }
+  }
+
+  if (has_extents(inode)) init_extent_root(inode);
+  else u_memset(inode->block_pointer, 0, sizeof(inode->block_pointer));
+  inode->sector_count = 0;
+  release_map(ci);
+  ci->dirty |= EXT2_DIRTY_DATA;
+  CHECK(err, "Failed to free inode blocks.", err);
+  return 0;
+}
+
+static uint32_t read_inode_block(
+  ext2_fs_t *self, ext2_cinode_t *ci, uint32_t block_num, uint8_t *buf
+  )
+{
+  uint32_t disk_block_num = get_disk_block_number(self, ci, block_num);
+  CHECK(
+    disk_block_num >= (uint32_t)(-ENOMEM),
+    "Failed to get disk block number.",
+    0
+    );
+  if (disk_block_num == 0) {
+    u_memset(buf, 0, self->block_size);
+    return self->block_size;
+  }
+  return read_block(self, disk_block_num, buf);
+}
+
+// Allocate the blocks of an inode in [first_block, last_block] that
+// are holes. Blocks are allocated in contiguous runs that continue
+// from the previous block of the file where possible. New blocks are
+// not cleared.
+static uint32_t alloc_inode_blocks(
+  ext2_fs_t *self, ext2_cinode_t *ci, uint32_t first_block, uint32_t last_block
+  )
+{
+  uint32_t sectors_per_block = self->block_size / 512;
+  uint32_t block_num = first_block;
+  while (block_num <= last_block) {
+    uint32_t disk_block_num = get_disk_block_number(self, ci, block_num);
+    CHECK(
+      disk_block_num >= (uint32_t)(-ENOMEM),
+      "Failed to get disk block number.",
+      EAGAIN
+      );
+    if (disk_block_num) { ++block_num; continue; }
+
+    uint32_t want = 1;
+    for (; block_num + want <= last_block; ++want) {
+      if (get_disk_block_number(self, ci, block_num + want)) break;
+    }
+    uint32_t goal = inode_goal(self, ci);
+    if (block_num) {
+      uint32_t prev = get_disk_block_number(self, ci, block_num - 1);
+      if (prev && prev < (uint32_t)(-ENOMEM)) goal = prev + 1;
+    }
+
+    // Take blocks from the preallocation window if it continues the
+    // file. Otherwise, allocate the blocks together with a new window
+    // so that later appends stay contiguous even when other files are
+    // growing at the same time. The window grows with the file.
+    // Directories grow a block at a time and get no window.
+    uint32_t count = 0;
+    uint32_t first = 0;
+    klock(&(self->prealloc_lock));
+    if (ci->prealloc_count && ci->prealloc_start == goal) {
+      first = ci->prealloc_start;
+      count = want < ci->prealloc_count ? want : ci->prealloc_count;
+      ci->prealloc_start += count;
+      ci->prealloc_count -= count;
+    }
+    kunlock(&(self->prealloc_lock));
+    if (first == 0) {
+      release_prealloc(self, ci);
+      uint32_t window = block_num;
+      if (window < EXT2_PREALLOC_MIN) window = EXT2_PREALLOC_MIN;
+      if (window > EXT2_PREALLOC_MAX) window = EXT2_PREALLOC_MAX;
+      if ((ci->inode.permissions & 0xF000) == EXT2_S_IFDIR) window = 0;
+      first = alloc_blocks(self, goal, want + window, &count);
+      CHECK(first == 0, "No space.", ENOSPC);
+      if (count > want) {
+        klock(&(self->prealloc_lock));
+        ci->prealloc_start = first + want;
+        ci->prealloc_count = count - want;
+        kunlock(&(self->prealloc_lock));
+        count = want;
+      }
+    }
+
+    // Extent-mapped inodes take the run in as few extents as possible.
+    // If mapping fails, the part of the run that isn't mapped yet is
+    // freed again.
+    uint32_t mapped = 0;
+    uint32_t res = 0;
+    while (mapped < count && res == 0) {
+      uint32_t len = 1;
+      if (has_extents(&(ci->inode))) {
+        len = count - mapped;
+        if (len > EXT4_EXTENT_MAX_LEN) len = EXT4_EXTENT_MAX_LEN;
+        res = insert_extent(self, ci, block_num, first + mapped, len);
+      } else res = set_disk_block_number(self, ci, block_num, first + mapped);
+      if (res == 0) { mapped += len; block_num += len; }
+    }
+    ci->inode.sector_count += mapped * sectors_per_block;
+    ci->dirty |= EXT2_DIRTY_DATA;
+    if (res) {
+      free_blocks(self, first + mapped, count - mapped);
+      CHECK(1, "Failed to map blocks.", res);
+    }
+  }
+
+  return 0;
+}
+
+// Count the blocks starting at `block_num` that are stored
+// contiguously on the disk, starting at `disk_block_num`.
+static uint32_t contiguous_blocks(
+  ext2_fs_t *self,
+  ext2_cinode_t *ci,
+  uint32_t block_num,
+  uint32_t disk_block_num,
+  uint32_t max
+  )
+{
+  if (disk_block_num == 0) return 1;
+  uint32_t count = 1;
+  for (; count < max; ++count) {
+    uint32_t next = get_disk_block_number(self, ci, block_num + count);
+    if (next != disk_block_num + count) break;
+  }
+  return count;
+}
+
+static uint32_t write_inode_block(
+  ext2_fs_t *self, ext2_cinode_t *ci, uint32_t block_num, uint8_t *buf
+  )
+{
+  uint32_t res = alloc_inode_blocks(self, ci, block_num, block_num);
+  CHECK(res, "Failed to allocate blocks.", 0);
+
+  uint32_t disk_block_num = get_disk_block_number(self, ci, block_num);
+  CHECK(
+    disk_block_num >= (uint32_t)(-ENOMEM),
+    "Failed to get disk block number.",
+    0
+    );
+
+  return write_block(self, disk_block_num, buf);
+}
+
+// Size of the on-disk entry for a name of `name_len` bytes.
+static inline uint32_t dir_entry_size(uint32_t name_len)
+{ return (sizeof(ext2_dir_entry_t) + name_len + 3) & ~3; }
+
+// Space that a new entry could use in a directory entry: all of a free
+// entry, or the slack after the name of a used one.
+static inline uint32_t dir_entry_gap(ext2_dir_entry_t *ent)
+{ return ent->inode ? ent->size - dir_entry_size(ent->name_len) : ent->size; }
+
+// Largest gap among the entries of a directory block.
+static uint32_t dir_block_gap(ext2_fs_t *self, uint8_t *blk_buf)
+{
+  uint32_t gap = 0;
+  uint32_t offset = 0;
+  while (offset + sizeof(ext2_dir_entry_t) <= self->block_size) {
+    ext2_dir_entry_t *ent = (ext2_dir_entry_t *)(blk_buf + offset);
+    if (
+      ent->size < sizeof(ext2_dir_entry_t)
+      || offset + ent->size > self->block_size
+      ) break;
+    uint32_t ent_gap = dir_entry_gap(ent);
+    if (ent_gap > gap) gap = ent_gap;
+    offset += ent->size;
+  }
+  return gap;
+}
+
+// Update the gap map after an entry of a directory block was freed, and
+// point the next insert at the block.
+static void dindex_free_slot(
+  ext2_fs_t *self, ext2_dindex_t *d, uint32_t block_num, uint8_t *blk_buf
+  )
+{
+  if (block_num >= d->gap_capacity) return;
+  d->gaps[block_num] = dir_block_gap(self, blk_buf);
+  d->gap_hint = block_num;
+}
+
+// Build the index of a directory from its entries.
+static uint32_t load_dindex(ext2_fs_t *self, ext2_cinode_t *ci)
+{
+  ext2_dindex_t *d = dindex_new();
+  CHECK(d == NULL, "No memory.", ENOMEM);
+  uint8_t *blk_buf = kmalloc(self->block_size);
+  if (blk_buf == NULL) {
+    kfree(d->buckets); kfree(d); CHECK(1, "No memory.", ENOMEM);
+  }
+  ci->dindex = d;
+
+  uint32_t block_count = ci->inode.size / self->block_size;
+  for (uint32_t block_num = 0; block_num < block_count; ++block_num) {
+    uint32_t res = read_inode_block(self, ci, block_num, blk_buf);
+    if (res != self->block_size) {
+      kfree(blk_buf); release_dindex(ci);
+      CHECK(1, "Failed to read inode block.", EAGAIN);
+    }
+
+    uint32_t offset = 0;
+    while (offset + sizeof(ext2_dir_entry_t) <= self->block_size) {
+      ext2_dir_entry_t *ent = (ext2_dir_entry_t *)(blk_buf + offset);
+      if (
+        ent->size < sizeof(ext2_dir_entry_t)
+        || offset + ent->size > self->block_size
+        ) break;
+      if (ent->inode) {
+        res = dindex_insert(
+          d, (char *)ent->name, ent->name_len, ent->inode, block_num, offset
+          );
+        if (res) {
+          kfree(blk_buf); release_dindex(ci);
+          CHECK(1, "Failed to index directory entry.", res);
+        }
+      }
+      offset += ent->size;
+    }
+
+    res = dindex_set_gap(d, block_num, dir_block_gap(self, blk_buf));
+    if (res) {
+      kfree(blk_buf); release_dindex(ci);
+      CHECK(1, "Failed to index directory block.", res);
+    }
+  }
 
   kfree(blk_buf);
   return 0;
 }
 
-static struct dirent *ext2_readdir_inode(
-  ext2_fs_t *self, ext2_inode_t *inode, uint32_t idx
+// Look up a name in a directory, building the directory's index first
+// if it doesn't have one. `*out` is NULL if there is no such entry.
+// Lookups run under the directory's read lock, so the index is built
+// under its own lock.
+static uint32_t find_dir_entry(
+  ext2_fs_t *self, ext2_cinode_t *ci, char *name, ext2_dindex_entry_t **out
   )
 {
+  *out = NULL;
+  klock(&(ci->dindex_lock));
+  if (ci->dindex == NULL) {
+    uint32_t res = load_dindex(self, ci);
+    if (res) kunlock(&(ci->dindex_lock));
+    CHECK(res, "Failed to load directory index.", res);
+  }
+  *out = dindex_find(ci->dindex, name, u_strlen(name));
+  kunlock(&(ci->dindex_lock));
+  return 0;
+}
+
+// The file type stored in directory entries for an inode with the
+// given mode, if the filesystem stores types in its entries.
+static uint8_t dir_entry_type(ext2_fs_t *self, uint16_t permissions)
+{
+  if (
+    (self->superblock->required_features & EXT2_FEATURE_INCOMPAT_FILETYPE)
+    == 0
+    ) return EXT2_FT_UNKNOWN;
+  switch (permissions & 0xF000) {
+  case EXT2_S_IFREG: return EXT2_FT_REG_FILE;
+  case EXT2_S_IFDIR: return EXT2_FT_DIR;
+  case EXT2_S_IFCHR: return EXT2_FT_CHRDEV;
+  case EXT2_S_IFBLK: return EXT2_FT_BLKDEV;
+  case EXT2_S_IFIFO: return EXT2_FT_FIFO;
+  case EXT2_S_IFSOCK: return EXT2_FT_SOCK;
+  case EXT2_S_IFLNK: return EXT2_FT_SYMLINK;
+  }
+  return EXT2_FT_UNKNOWN;
+}
+
+// Add an entry for an inode with the given mode to a directory. The
+// entry goes into the first gap big enough for it that the directory
+// index knows of, or into a new block at the end of the directory.
+// Entries are only ever split, never merged, so that the offsets kept
+// by readdir cursors stay valid.
+static int32_t create_dir_entry_inode(
+  ext2_fs_t *self,
+  ext2_cinode_t *ci,
+  char *name,
+  uint32_t inode_num,
+  uint16_t permissions
+  )
+{
+  ext2_inode_t *inode = &(ci->inode);
+  if ((inode->permissions & EXT2_S_IFDIR) == 0)
+    return -ENOTDIR;
+
+  klock(&(ci->dindex_lock));
+  uint32_t res = ci->dindex ? 0 : load_dindex(self, ci);
+  kunlock(&(ci->dindex_lock));
+  CHECK(res, "Failed to load directory index.", -EAGAIN);
+  ext2_dindex_t *d = ci->dindex;
+
+  uint32_t name_len = u_strlen(name);
+  uint32_t ent_size = dir_entry_size(name_len);
+  if (ent_size > self->block_size) return -EINVAL;
   uint8_t *blk_buf = kmalloc(self->block_size);
-  CHECK(blk_buf == NULL, "No memory.", NULL);
-  uint32_t block_num = 0;
-  uint32_t res = read_inode_block(self, inode, block_num, blk_buf);
-  CHECK(res != self->block_size, "Failed to read inode block.", NULL);
+  CHECK(blk_buf == NULL, "No memory.", -ENOMEM);
 
-  uint32_t t_idx = 0;
-  uint32_t dir_idx_w = 0;
+  uint32_t block_count = inode->size / self->block_size;
+  uint32_t block_num = dindex_find_gap(d, block_count, ent_size);
   uint32_t dir_idx = 0;
   ext2_dir_entry_t *current_entry = NULL;
-  ext2_dir_entry_t *found_entry = NULL;
-  for (
-    ;
-    t_idx < inode->size && dir_idx <= idx;
-    t_idx += current_entry->size, dir_idx_w += current_entry->size
-    )
-  {
-    if (dir_idx_w >= self->block_size) {
-      ++block_num;
-      dir_idx_w -= self->block_size;
-      res = read_inode_block(self, inode, block_num, blk_buf);
-      CHECK(res != self->block_size, "Failed to read inode block.", NULL);
+  if (block_num < block_count) {
+    res = read_inode_block(self, ci, block_num, blk_buf);
+    if (res != self->block_size) kfree(blk_buf);
+    CHECK(res != self->block_size, "Failed to read inode block.", -EAGAIN);
+
+    while (dir_idx + sizeof(ext2_dir_entry_t) <= self->block_size) {
+      current_entry = (ext2_dir_entry_t *)(blk_buf + dir_idx);
+      if (
+        current_entry->size < sizeof(ext2_dir_entry_t)
+        || dir_idx + current_entry->size > self->block_size
+        ) { current_entry = NULL; break; }
+      if (dir_entry_gap(current_entry) >= ent_size) break;
+      dir_idx += current_entry->size;
+      current_entry = NULL;
     }
 
-    current_entry = (ext2_dir_entry_t *)(blk_buf + dir_idx_w);
-    if (current_entry->inode && dir_idx == idx) {
-      found_entry = kmalloc(current_entry->size);
-      CHECK(found_entry == NULL, "No memory.", NULL);
-      u_memcpy(found_entry, current_entry, current_entry->size);
-      break;
+    // The gap map was stale; fix it and append a block instead.
+    if (current_entry == NULL) {
+      d->gaps[block_num] = dir_block_gap(self, blk_buf);
+      block_num = block_count;
+    } else if (current_entry->inode) {
+      uint32_t used = dir_entry_size(current_entry->name_len);
+      uint32_t rest = current_entry->size - used;
+      current_entry->size = used;
+      dir_idx += used;
+      current_entry = (ext2_dir_entry_t *)(blk_buf + dir_idx);
+      current_entry->size = rest;
     }
-    if (current_entry->inode) ++dir_idx;
   }
 
+  // Grow the directory by a block holding a single free entry.
+  if (block_num == block_count) {
+    u_memset(blk_buf, 0, self->block_size);
+    dir_idx = 0;
+    current_entry = (ext2_dir_entry_t *)blk_buf;
+    current_entry->size = self->block_size;
+  }
+
+  current_entry->inode = inode_num;
+  current_entry->name_len = name_len;
+  current_entry->type = dir_entry_type(self, permissions);
+  u_memcpy(current_entry->name, name, name_len);
+
+  res = write_inode_block(self, ci, block_num, blk_buf);
+  if (res != self->block_size) kfree(blk_buf);
+  CHECK(res != self->block_size, "Failed to write inode block", -EAGAIN);
+  if (block_num == block_count) {
+    inode->size += self->block_size;
+    ci->dirty |= EXT2_DIRTY_DATA;
+  }
+
+  d->gap_hint = block_num;
+  if (
+    dindex_set_gap(d, block_num, dir_block_gap(self, blk_buf))
+    || dindex_insert(d, name, name_len, inode_num, block_num, dir_idx)
+    ) release_dindex(ci);
+
   kfree(blk_buf);
+  return 0;
+}
 
-  if (found_entry == NULL) return NULL;
+// Get the `idx`th entry of a directory. `*cursor_idx` and `*cursor_offset`
+// are the index and byte offset of an entry to resume the scan from, and
+// are moved past the returned entry so that sequential reads don't
+// rescan the directory.
+static struct dirent *ext2_readdir_inode(
+  ext2_fs_t *self,
+  ext2_cinode_t *ci,
+  uint32_t idx,
+  uint32_t *cursor_idx,
+  uint32_t *cursor_offset
+  )
+{
+  uint32_t dir_idx = *cursor_idx;
+  uint32_t offset = *cursor_offset;
+  if (idx < dir_idx) { dir_idx = 0; offset = 0; }
+
+  uint8_t *blk_buf = kmalloc(self->block_size);
+  CHECK(blk_buf == NULL, "No memory.", NULL);
+  uint32_t block_num = 0xFFFFFFFF;
+  struct dirent *ent = NULL;
+  while (offset < ci->inode.size) {
+    if (offset / self->block_size != block_num) {
+      block_num = offset / self->block_size;
+      uint32_t res = read_inode_block(self, ci, block_num, blk_buf);
+      if (res != self->block_size) kfree(blk_buf);
+      CHECK(res != self->block_size, "Failed to read inode block.", NULL);
+    }
 
-  struct dirent *ent = kmalloc(sizeof(struct dirent));
-  u_memcpy(ent->name, found_entry->name, found_entry->name_len);
-  ent->name[found_entry->name_len] = '\0';
-  ent->ino = found_entry->inode;
+    uint32_t blk_offset = offset % self->block_size;
+    ext2_dir_entry_t *current_entry =
+      (ext2_dir_entry_t *)(blk_buf + blk_offset);
+    if (
+      current_entry->size < sizeof(ext2_dir_entry_t)
+      || blk_offset + current_entry->size > self->block_size
+      ) break;
+    offset += current_entry->size;
+    if (current_entry->inode == 0) continue;
+    if (dir_idx++ < idx) continue;
+
+    ent = kmalloc(sizeof(struct dirent));
+    if (ent == NULL) break;
+    u_memcpy(ent->name, current_entry->name, current_entry->name_len);
+    ent->name[current_entry->name_len] = '\0';
+    ent->ino = current_entry->inode;
+    *cursor_idx = dir_idx;
+    *cursor_offset = offset;
+    break;
+  }
 
-  kfree(found_entry);
+  kfree(blk_buf);
   return ent;
 }
 
 static struct dirent *ext2_readdir(fs_node_t *node, uint32_t idx)
 {
   ext2_fs_t *self = node->device;
-  klock(&(self->ops_lock));
-  ext2_inode_t inode;
-  uint32_t res = read_inode_info(self, &inode, node->inode);
-  CHECK_UNLOCK_O(res, "Failed to read inode info.", NULL);
-  if ((inode.permissions & EXT2_S_IFDIR) == 0) {
-    kunlock(&(self->ops_lock));
+  ext2_cinode_t *ci = ilock(self, node->inode, 0);
+  CHECK_FINISH(ci == NULL, "Failed to get inode.", NULL);
+  if ((ci->inode.permissions & EXT2_S_IFDIR) == 0) {
+    iunlock(self, ci);
+    finish_op(self);
     return NULL;
   }
 
-  struct dirent *ent = ext2_readdir_inode(self, &inode, idx);
-  kunlock(&(self->ops_lock));
+  // Every open of the directory shares the node, so the cursor is
+  // read and written as a pair under `ra_lock`.
+  klock(&(ci->ra_lock));
+  uint32_t cursor_idx = node->dir_index;
+  uint32_t cursor_offset = node->dir_offset;
+  kunlock(&(ci->ra_lock));
+  struct dirent *ent = ext2_readdir_inode(
+    self, ci, idx, &cursor_idx, &cursor_offset
+    );
+  klock(&(ci->ra_lock));
+  node->dir_index = cursor_idx;
+  node->dir_offset = cursor_offset;
+  kunlock(&(ci->ra_lock));
+  iunlock(self, ci);
+  finish_op(self);
   return ent;
 }
 
 static fs_node_t *ext2_finddir(fs_node_t *node, char *name)
 {
   ext2_fs_t *self = node->device;
-  klock(&(self->ops_lock));
-  ext2_inode_t inode;
-  uint32_t res = read_inode_info(self, &inode, node->inode);
-  CHECK_UNLOCK_O(res, "Failed to read inode info.", NULL);
-  if ((inode.permissions & EXT2_S_IFDIR) == 0) {
-    kunlock(&(self->ops_lock));
+  ext2_cinode_t *ci = ilock(self, node->inode, 0);
+  CHECK_FINISH(ci == NULL, "Failed to get inode.", NULL);
+  if ((ci->inode.permissions & EXT2_S_IFDIR) == 0) {
+    iunlock(self, ci);
+    finish_op(self);
     return NULL;
   }
 
-  uint8_t *blk_buf = kmalloc(self->block_size);
-  CHECK_UNLOCK_O(blk_buf == NULL, "No memory.", NULL);
-  uint32_t block_num = 0;
-  res = read_inode_block(self, &inode, block_num, blk_buf);
-  CHECK_UNLOCK_O(
-    res != self->block_size, "Failed to read inode block.", NULL
+  ext2_dindex_entry_t *found_entry = NULL;
+  uint32_t res = find_dir_entry(self, ci, name, &found_entry);
+  CHECK_FINISH_I(res, "Failed to look up directory entry.", NULL);
+  if (found_entry == NULL) { iunlock(self, ci); finish_op(self); return NULL; }
+
+  fs_node_t *outnode = kmalloc(sizeof(fs_node_t));
+  CHECK_FINISH_I(outnode == NULL, "No memory.", NULL);
+  ext2_inode_t child_inode;
+  res = read_inode_info(self, &child_inode, found_entry->inode_num);
+  if (res) kfree(outnode);
+  CHECK_FINISH_I(res, "Failed to read inode info.", NULL);
+  make_ext2_node(
+    self,
+    outnode,
+    &child_inode,
+    found_entry->inode_num,
+    found_entry->name,
+    found_entry->name_len
     );
 
-  uint32_t idx = 0;
-  uint32_t dir_idx = 0;
-  ext2_dir_entry_t *current_entry = NULL;
-  ext2_dir_entry_t *found_entry = NULL;
-  for (
-    ;
-    idx < inode.size;
-    idx += current_entry->size, dir_idx += current_entry->size
-    )
-  {
-    if (dir_idx >= self->block_size) {
-      ++block_num;
-      dir_idx -= self->block_size;
-      res = read_inode_block(self, &inode, block_num, blk_buf);
-      CHECK_UNLOCK_O(
-        res != self->block_size, "Failed to read inode block.", NULL
-        );
-    }
+  iunlock(self, ci);
+  finish_op(self);
+  return outnode;
+}
 
-    current_entry = (ext2_dir_entry_t *)(blk_buf + dir_idx);
-    if (current_entry->inode == 0 || u_strlen(name) != current_entry->name_len)
+// Bring a node kept in the dentry cache up to date with its inode.
+// Fails if the inode has been freed since the node was made.
+static int32_t ext2_revalidate(fs_node_t *node)
+{
+  ext2_fs_t *self = node->device;
+  ext2_inode_t inode;
+  uint32_t res = read_inode_info(self, &inode, node->inode);
+  CHECK(res, "Failed to read inode info.", -res);
+  if (inode.hard_link_count == 0) return -ENOENT;
+  node->uid = inode.uid;
+  node->gid = inode.gid;
+  node->length = inode.size;
+  node->mask = inode.permissions;
+  node->atime = inode.atime;
+  node->mtime = inode.mtime;
+  node->ctime = inode.ctime;
+  return 0;
+}
+
+// Read the bytes in [offset, end) of an inode, which must be within the
+// file. Returns the number of bytes read.
+static uint32_t read_inode_data(
+  ext2_fs_t *self,
+  ext2_cinode_t *ci,
+  uint32_t offset,
+  uint32_t end,
+  uint8_t *buffer
+  )
+{
+  uint8_t *blk_buf = NULL;
+
+  // Partial blocks are read through the block cache. Runs of whole
+  // blocks that are contiguous on the disk are read straight into
+  // the output buffer with a single request.
+  uint32_t position = offset;
+  while (position < end) {
+    uint32_t block_num = position / self->block_size;
+    uint32_t block_offset = position % self->block_size;
+    uint32_t chunk = self->block_size - block_offset;
+    if (chunk > end - position) chunk = end - position;
+
+    if (chunk < self->block_size) {
+      if (blk_buf == NULL) blk_buf = kmalloc(self->block_size);
+      if (blk_buf == NULL) { log_error("ext2", "No memory.\n"); break; }
+      uint32_t res = read_inode_block(self, ci, block_num, blk_buf);
+      if (res != self->block_size) {
+        log_error("ext2", "Failed to read block.\n"); break;
+      }
+      u_memcpy(buffer + position - offset, blk_buf + block_offset, chunk);
+      position += chunk;
       continue;
+    }
 
-    char *dname = kmalloc(current_entry->name_len + 1);
-    u_memcpy(dname, current_entry->name, current_entry->name_len);
-    dname[current_entry->name_len] = '\0';
-    if (u_strcmp(dname, name) == 0) {
-      kfree(dname);
-      found_entry = kmalloc(current_entry->size);
-      CHECK_UNLOCK_O(found_entry == NULL, "No memory.", NULL);
-      u_memcpy(found_entry, current_entry, current_entry->size);
-      break;
+    uint32_t disk_block_num = get_disk_block_number(self, ci, block_num);
+    if (disk_block_num >= (uint32_t)(-ENOMEM)) {
+      log_error("ext2", "Failed to get disk block number.\n"); break;
+    }
+    if (disk_block_num == 0) {
+      // Holes read as zeros without touching the disk.
+      u_memset(buffer + position - offset, 0, self->block_size);
+      position += self->block_size;
+      continue;
+    }
+    uint32_t count = contiguous_blocks(
+      self,
+      ci,
+      block_num,
+      disk_block_num,
+      (end - position) / self->block_size
+      );
+    uint32_t res = read_blocks(
+      self, disk_block_num, count, buffer + position - offset
+      );
+    if (res != count * self->block_size) {
+      log_error("ext2", "Failed to read blocks.\n"); break;
     }
-    kfree(dname);
+    position += count * self->block_size;
   }
 
   kfree(blk_buf);
+  return position - offset;
+}
 
-  if (found_entry == NULL) { kunlock(&(self->ops_lock)); return NULL; }
+// Read through the readahead buffer of an open file. Each time a
+// sequential read runs past the buffer, the buffer is refilled with a
+// window of the following blocks in one request, and the window grows
+// up to EXT2_READAHEAD_MAX. Returns the number of bytes read, or
+// 0xFFFFFFFF if the read should go straight to the disk instead.
+static uint32_t read_ahead(
+  ext2_fs_t *self,
+  fs_node_t *node,
+  ext2_cinode_t *ci,
+  uint32_t offset,
+  uint32_t end,
+  uint8_t *buffer
+  )
+{
+  ext2_readahead_t *ra = node->readahead;
+  uint8_t sequential = ra ? offset == ra->next : offset == 0;
+  uint8_t buffered = ra && ra->version == ci->version
+    && offset >= ra->start && offset < ra->start + ra->length;
+
+  // Reads that are random, or big enough to be a single efficient
+  // request, or that reach the end of the file don't need a window
+  // of their own.
+  if (buffered == 0 && (
+        sequential == 0
+        || end - offset >= EXT2_READAHEAD_MAX
+        || end == ci->inode.size
+        )) {
+    if (ra) { ra->next = end; if (sequential == 0) ra->window = 0; }
+    return 0xFFFFFFFF;
+  }
 
-  fs_node_t *outnode = kmalloc(sizeof(fs_node_t));
-  CHECK_UNLOCK_O(outnode == NULL, "No memory.", NULL);
-  u_memset(outnode, 0, sizeof(fs_node_t));
-  res = read_inode_info(self, &inode, found_entry->inode);
-  CHECK_UNLOCK_O(res, "Failed to read inode info.", NULL);
-  make_ext2_node(self, outnode, &inode, found_entry);
-
-  kfree(found_entry);
-  kunlock(&(self->ops_lock));
-  return outnode;
+  if (ra == NULL) {
+    ra = kmalloc(sizeof(ext2_readahead_t));
+    CHECK(ra == NULL, "No memory.", 0xFFFFFFFF);
+    u_memset(ra, 0, sizeof(ext2_readahead_t));
+    ra->buf = kmalloc(EXT2_READAHEAD_MAX);
+    if (ra->buf == NULL) { kfree(ra); CHECK(1, "No memory.", 0xFFFFFFFF); }
+    node->readahead = ra;
+  }
+
+  uint32_t position = offset;
+  while (position < end) {
+    if (
+      ra->version == ci->version
+      && position >= ra->start && position < ra->start + ra->length
+      ) {
+      uint32_t chunk = ra->start + ra->length - position;
+      if (chunk > end - position) chunk = end - position;
+      u_memcpy(
+        buffer + position - offset, ra->buf + position - ra->start, chunk
+        );
+      position += chunk;
+      continue;
+    }
+
+    if (ra->window < EXT2_READAHEAD_MIN) ra->window = EXT2_READAHEAD_MIN;
+    else if (ra->window < EXT2_READAHEAD_MAX) ra->window <<= 1;
+    ra->start = position - (position % self->block_size);
+    ra->length = ci->inode.size - ra->start;
+    if (ra->length > ra->window) ra->length = ra->window;
+    ra->version = ci->version;
+    uint32_t res = read_inode_data(
+      self, ci, ra->start, ra->start + ra->length, ra->buf
+      );
+    if (res != ra->length) { ra->length = 0; break; }
+  }
+
+  ra->next = position;
+  return position - offset;
+}
+
+// Read a range of a file that is locked for reading.
+static uint32_t read_inode_range(
+  ext2_fs_t *self,
+  fs_node_t *node,
+  ext2_cinode_t *ci,
+  uint32_t offset,
+  uint32_t size,
+  uint8_t *buffer
+  )
+{
+  ext2_inode_t *inode = &(ci->inode);
+  if (offset >= inode->size) return 0;
+  uint32_t end = offset + size;
+  if (end > inode->size) end = inode->size;
+
+  // O_DIRECT reads skip the readahead buffer, so whole blocks go
+  // straight from the disk into the caller's buffer.
+  uint32_t res = 0xFFFFFFFF;
+  if ((node->flags & FS_DIRECT) == 0) {
+    klock(&(ci->ra_lock));
+    res = read_ahead(self, node, ci, offset, end, buffer);
+    kunlock(&(ci->ra_lock));
+  }
+  if (res == 0xFFFFFFFF) res = read_inode_data(self, ci, offset, end, buffer);
+  return res;
+}
+
+// Read consecutive ranges of a file into several buffers, with the
+// inode locked once for all of them.
+static int32_t ext2_readv(
+  fs_node_t *node, uint32_t offset, struct iovec *iov, uint32_t count
+  )
+{
+  ext2_fs_t *self = node->device;
+  ext2_cinode_t *ci = ilock(self, node->inode, 0);
+  CHECK_FINISH(ci == NULL, "Failed to get inode.", -EAGAIN);
+
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t res = read_inode_range(
+      self, node, ci, offset + total, iov[i].iov_len, iov[i].iov_base
+      );
+    total += res;
+    if (res != iov[i].iov_len) break;
+  }
+
+  iunlock(self, ci);
+  finish_op(self);
+  return total;
 }
 
 static uint32_t ext2_read(
@@ -854,168 +2444,169 @@ static uint32_t ext2_read(
   )
 {
   ext2_fs_t *self = node->device;
-  klock(&(self->ops_lock));
-  ext2_inode_t inode;
-  uint32_t res = read_inode_info(self, &inode, node->inode);
-  CHECK_UNLOCK_O(res, "Failed to read inode info.", 0);
-  if (inode.size == 0) { kunlock(&(self->ops_lock)); return 0; }
+  ext2_cinode_t *ci = ilock(self, node->inode, 0);
+  CHECK_FINISH(ci == NULL, "Failed to get inode.", 0);
+  uint32_t res = read_inode_range(self, node, ci, offset, size, buffer);
+  iunlock(self, ci);
+  finish_op(self);
+  return res;
+}
 
+// Write a range of a file that is locked for writing and already
+// long enough to hold it. `blk_buf` is scratch space for one block.
+// Returns the number of bytes written.
+static uint32_t write_inode_range(
+  ext2_fs_t *self,
+  fs_node_t *node,
+  ext2_cinode_t *ci,
+  uint32_t offset,
+  uint32_t size,
+  uint8_t *buffer,
+  uint8_t *blk_buf
+  )
+{
+  if (size == 0) return 0;
   uint32_t end = offset + size;
-  if (end > inode.size) end = inode.size;
-
-  uint32_t start_block = offset / self->block_size;
-  uint32_t start_offset = offset % self->block_size;
-  uint32_t end_block = end / self->block_size;
-  uint32_t end_post_offset = end - (end_block * self->block_size);
-  uint32_t size_to_read = end - offset;
 
-  uint8_t *blk_buf = kmalloc(self->block_size);
-  CHECK_UNLOCK_O(blk_buf == NULL, "No memory.", 0);
-  if (start_block == end_block) {
-    res = read_inode_block(self, &inode, start_block, blk_buf);
-    CHECK_UNLOCK_O(res != self->block_size, "Failed to read block.", res);
-    u_memcpy(buffer, blk_buf + start_offset, size_to_read);
-
-    kfree(blk_buf);
-    kunlock(&(self->ops_lock));
-    return size_to_read;
-  }
-
-  uint32_t current_block = start_block;
-  uint32_t read_blocks = 0;
-  for (; current_block < end_block; ++current_block, ++read_blocks) {
-    res = read_inode_block(self, &inode, current_block, blk_buf);
-    CHECK_UNLOCK_O(
-      res != self->block_size,
-      "Failed to read block.",
-      (read_blocks * self->block_size) + res
-      );
-    if (current_block == start_block) {
-      u_memcpy(
-        buffer, blk_buf + start_offset, self->block_size - start_offset
+  // Allocate every block in the range up front so that the disk
+  // blocks of an appending write are contiguous where possible. Blocks
+  // skipped over by the write are left as holes. Partially written
+  // blocks that were holes are filled with zeros.
+  uint32_t first_block = offset / self->block_size;
+  uint32_t last_block = (end - 1) / self->block_size;
+  uint8_t first_new = get_disk_block_number(self, ci, first_block) == 0;
+  uint8_t last_new = get_disk_block_number(self, ci, last_block) == 0;
+  uint32_t res = alloc_inode_blocks(self, ci, first_block, last_block);
+  CHECK(res, "Failed to allocate blocks.", 0);
+
+  uint32_t position = offset;
+  while (position < end) {
+    uint32_t block_num = position / self->block_size;
+    uint32_t block_offset = position % self->block_size;
+    uint32_t written_size = position - offset;
+    uint32_t chunk = self->block_size - block_offset;
+    if (chunk > end - position) chunk = end - position;
+
+    if (chunk < self->block_size) {
+      uint8_t new = block_num == first_block ? first_new : last_new;
+      if (new == 0) {
+        res = read_inode_block(self, ci, block_num, blk_buf);
+        CHECK(
+          res != self->block_size, "Failed to read inode block.", written_size
+          );
+      } else u_memset(blk_buf, 0, self->block_size);
+      u_memcpy(blk_buf + block_offset, buffer + written_size, chunk);
+      res = write_inode_block(self, ci, block_num, blk_buf);
+      CHECK(
+        res != self->block_size, "Failed to write inode block.", written_size
         );
+
+      // Whole blocks are written to the disk right away; with O_DIRECT
+      // partial ones are too, instead of staying dirty in the cache.
+      if (node->flags & FS_DIRECT) {
+        res = bcache_sync_blocks(
+          self->block_device,
+          self->block_size,
+          get_disk_block_number(self, ci, block_num),
+          1
+          );
+        CHECK(res, "Failed to write back block.", written_size);
+      }
+      position += chunk;
       continue;
     }
-    u_memcpy(
-      buffer + (read_blocks * self->block_size) - start_offset,
-      blk_buf,
-      self->block_size
-      );
-  }
 
-  if (end_post_offset) {
-    res = read_inode_block(self, &inode, end_block, blk_buf);
-    CHECK_UNLOCK_O(
-      res != self->block_size,
-      "Failed to read block.",
-      (read_blocks * self->block_size) + res
+    uint32_t disk_block_num = get_disk_block_number(self, ci, block_num);
+    CHECK(
+      disk_block_num >= (uint32_t)(-ENOMEM),
+      "Failed to get disk block number.",
+      written_size
       );
-    u_memcpy(
-      buffer + (read_blocks * self->block_size) - start_offset,
-      blk_buf,
-      end_post_offset
+    uint32_t count = contiguous_blocks(
+      self,
+      ci,
+      block_num,
+      disk_block_num,
+      (end - position) / self->block_size
+      );
+    res = write_blocks(self, disk_block_num, count, buffer + written_size);
+    CHECK(
+      res != count * self->block_size, "Failed to write blocks.", written_size
       );
+    position += count * self->block_size;
   }
 
-  kfree(blk_buf);
-  kunlock(&(self->ops_lock));
-  return size_to_read;
+  return size;
 }
 
-static uint32_t ext2_write(
-  fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer
+// Write several buffers to consecutive ranges of a file, with the
+// inode locked and its version bumped once for all of them. A block
+// shared by two buffers is allocated by the first and then read back
+// by the second, so holes are only zero-filled once.
+static int32_t ext2_writev(
+  fs_node_t *node, uint32_t offset, struct iovec *iov, uint32_t count
   )
 {
-  ext2_fs_t *self = node->device;
-  klock(&(self->ops_lock));
-  ext2_inode_t inode;
-  uint32_t res = read_inode_info(self, &inode, node->inode);
-  CHECK_UNLOCK_O(res, "Failed to read inode info.", 0);
-
-  uint32_t end = offset + size;
-  if (end > inode.size) {
-    inode.size = end;
-    res = write_inode_info(self, &inode, node->inode);
-    CHECK_UNLOCK_O(res, "Failed to write inode info.", 0);
-  }
+  uint32_t size = 0;
+  for (uint32_t i = 0; i < count; ++i) size += iov[i].iov_len;
 
-  uint32_t start_block = offset / self->block_size;
-  uint32_t start_offset = offset % self->block_size;
-  uint32_t end_block = end / self->block_size;
-  uint32_t end_post_offset = end - (end_block * self->block_size);
+  ext2_fs_t *self = node->device;
+  ext2_cinode_t *ci = ilock(self, node->inode, 1);
+  CHECK_FINISH(ci == NULL, "Failed to get inode.", -EAGAIN);
+  ext2_inode_t *inode = &(ci->inode);
+  if (size == 0) { iunlock(self, ci); finish_op(self); return 0; }
+  bump_version(self, ci);
 
   uint8_t *blk_buf = kmalloc(self->block_size);
-  CHECK_UNLOCK_O(blk_buf == NULL, "No memory.", 0);
-  if (start_block == end_block) {
-    res = read_inode_block(self, &inode, start_block, blk_buf);
-    CHECK_UNLOCK_O(res != self->block_size, "Failed to read inode block.", 0);
-    u_memcpy(blk_buf + start_offset, buffer, size);
-    res = write_inode_block(self, &inode, node->inode, start_block, blk_buf);
-    CHECK_UNLOCK_O(res != self->block_size, "Failed to write inode block.", res);
-
-    kfree(blk_buf);
-    kunlock(&(self->ops_lock));
-    return size;
-  }
-
-  uint32_t current_block = start_block;
-  uint32_t written_blocks = 0;
-  for (; current_block < end_block; ++current_block, ++written_blocks) {
-    uint32_t written_size = written_blocks * self->block_size;
-    read_inode_block(self, &inode, current_block, blk_buf);
-    if (current_block == start_block) {
-      u_memcpy(
-        blk_buf + start_offset, buffer, self->block_size - start_offset
-        );
-      res = write_inode_block(
-        self, &inode, node->inode, current_block, blk_buf
-        );
-      CHECK_UNLOCK_O(res != self->block_size, "Failed to write inode block", res);
-      res = read_inode_info(self, &inode, node->inode);
-      CHECK_UNLOCK_O(
-        res, "Failed to read inode info.", self->block_size - start_offset
-        );
-      continue;
-    }
+  CHECK_FINISH_I(blk_buf == NULL, "No memory.", -ENOMEM);
 
-    u_memcpy(
-      blk_buf, buffer + written_size - start_offset, self->block_size
-      );
-    res = write_inode_block(self, &inode, node->inode, current_block, blk_buf);
-    CHECK_UNLOCK_O(
-      res != self->block_size,
-      "Failed to write inode block.",
-      res + written_size
-      );
-    res = read_inode_info(self, &inode, node->inode);
-    CHECK_UNLOCK_O(
-      res, "Failed to read inode info.", written_size + self->block_size
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t res = write_inode_range(
+      self, node, ci, offset + total, iov[i].iov_len, iov[i].iov_base,
+      blk_buf
       );
+    total += res;
+    if (res != iov[i].iov_len) break;
   }
 
-  if (end_post_offset) {
-    res = read_inode_block(self, &inode, end_block, blk_buf);
-    CHECK_UNLOCK_O(
-      res != self->block_size,
-      "Failed to read inode block.",
-      (written_blocks * self->block_size) + res
-      );
-    u_memcpy(
-      blk_buf,
-      buffer + (written_blocks * self->block_size) - start_offset,
-      end_post_offset
-      );
-    res = write_inode_block(self, &inode, node->inode, end_block, blk_buf);
-    CHECK_UNLOCK_O(
-      res != self->block_size,
-      "Failed to write inode block.",
-      (written_blocks * self->block_size) + res
-      );
+  // Only extend the file as far as the data actually written.
+  if (offset + total > inode->size) {
+    inode->size = offset + total;
+    ci->dirty |= EXT2_DIRTY_DATA;
   }
 
   kfree(blk_buf);
-  kunlock(&(self->ops_lock));
-  return 0;
+  iunlock(self, ci);
+  finish_op(self);
+  return total;
+}
+
+static uint32_t ext2_write(
+  fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer
+  )
+{
+  struct iovec iov = { .iov_base = buffer, .iov_len = size };
+  int32_t res = ext2_writev(node, offset, &iov, 1);
+  return res < 0 ? 0 : res;
+}
+
+// Free the blocks and then the inode of a file whose last link is gone.
+// The inode must be locked for writing, and is unlocked here.
+static uint32_t destroy_inode(ext2_fs_t *self, ext2_cinode_t *ci)
+{
+  ext2_inode_t *inode = &(ci->inode);
+  uint32_t inode_num = ci->inode_num;
+  uint8_t isdir = (inode->permissions & EXT2_S_IFDIR) == EXT2_S_IFDIR;
+  uint32_t res = free_inode_blocks(self, ci);
+  release_dindex(ci);
+  inode->hard_link_count = 0;
+  inode->size = 0;
+  inode->dtime = deletion_time(self);
+  bump_version(self, ci);
+  iunlock(self, ci);
+  if (res == 0) res = free_inode(self, inode_num, isdir);
+  return res;
 }
 
 static void ext2_open(fs_node_t *node, uint32_t flags)
@@ -1023,325 +2614,332 @@ static void ext2_open(fs_node_t *node, uint32_t flags)
   if ((flags & O_TRUNC) == 0) return;
 
   ext2_fs_t *self = node->device;
-  klock(&(self->ops_lock));
-  ext2_inode_t inode;
-  uint32_t res = read_inode_info(self, &inode, node->inode);
-  if (res) {
-    log_error("ext2", "Failed to read inode.\n");
-    kunlock(&(self->ops_lock)); return;
+  ext2_cinode_t *ci = ilock(self, node->inode, 1);
+  if (ci == NULL) {
+    log_error("ext2", "Failed to get inode.\n");
+    finish_op(self); return;
   }
-  inode.size = 0;
-  res = write_inode_info(self, &inode, node->inode);
-  kunlock(&(self->ops_lock));
-  if (res) { log_error("ext2", "Failed to write inode.\n"); return; }
+  uint32_t res = free_inode_blocks(self, ci);
+  if (res) log_error("ext2", "Failed to free blocks.\n");
+  ci->inode.size = 0;
+  ci->dirty |= EXT2_DIRTY_DATA;
+  bump_version(self, ci);
+  iunlock(self, ci);
+  finish_op(self);
 }
 
-static void ext2_close(fs_node_t *node)
-{}
-
-static int32_t ext2_mkdir(fs_node_t *node, char *name, uint16_t mask)
+// Drop the preallocation window and readahead state of a file once
+// the last reference to its node is gone. An unlinked file is freed
+// along with the last of its nodes.
+static void ext2_release(fs_node_t *node)
 {
   ext2_fs_t *self = node->device;
-  fs_node_t *child = fs_finddir(node, name);
-  kfree(child);
-  if (child) return -EEXIST;
+  ext2_cinode_t *ci = ilock(self, node->inode, 1);
+  if (ci == NULL) {
+    log_error("ext2", "Failed to get inode.\n");
+    finish_op(self); return;
+  }
+  release_prealloc(self, ci);
+  ext2_readahead_t *ra = node->readahead;
+  if (ra) { kfree(ra->buf); kfree(ra); node->readahead = NULL; }
+
+  if (ci->orphan && !fs_vnode_busy(self, node->inode)) {
+    ci->orphan = 0;
+    uint32_t res = destroy_inode(self, ci);
+    if (res) log_error("ext2", "Failed to free inode.\n");
+    iput(self, ci);
+    finish_op(self);
+    return;
+  }
 
-  klock(&(self->ops_lock));
+  iunlock(self, ci);
+  finish_op(self);
+}
 
-  uint32_t inode_num = alloc_inode(self);
-  if (inode_num == 0) { kunlock(&(self->ops_lock)); return -ENOSPC; }
-  ext2_inode_t inode;
-  uint32_t res = read_inode_info(self, &inode, inode_num);
-  CHECK_UNLOCK_O(res, "Failed to read inode info.", -res);
+// Initialize a newly allocated inode.
+static uint32_t init_inode(
+  ext2_fs_t *self, uint32_t inode_num, uint16_t permissions, uint16_t links
+  )
+{
+  ext2_cinode_t *ci = iget(self, inode_num);
+  CHECK(ci == NULL, "Failed to get inode.", EAGAIN);
+  ext2_inode_t *inode = &(ci->inode);
+  release_map(ci);
+  release_dindex(ci);
 
   // TODO atime, mtime, ctime
-  inode.atime = 0;
-  inode.ctime = 0;
-  inode.mtime = 0;
+  inode->atime = 0;
+  inode->ctime = 0;
+  inode->mtime = 0;
+  inode->dtime = 0;
 
-  u_memset(&(inode.block_pointer), 0, sizeof(inode.block_pointer));
-  inode.sector_count = 0;
-  inode.size = 0;
+  u_memset(inode->block_pointer, 0, sizeof(inode->block_pointer));
+  inode->sector_count = 0;
+  inode->size = 0;
 
   // TODO users.
-  inode.uid = 0;
-  inode.gid = 0;
-
-  inode.fragment_addr = 0;
-  inode.hard_link_count = 2;
-  inode.flags = 0;
-  inode.os_1 = 0;
-  inode.generation_number = 0;
-  inode.file_acl = 0;
-  inode.dir_acl = 0;
-  inode.permissions = EXT2_S_IFDIR;
-  inode.permissions |= 0xFFF & mask;
-
-  res = write_inode_info(self, &inode, inode_num);
-  CHECK_UNLOCK_O(res, "Failed to write inode info.", -res);
-  int32_t sres = create_dir_entry(node, name, inode_num);
-  CHECK_UNLOCK_O(sres < 0, "Failed to create directory entry.", res);
-  inode.size = self->block_size;
-  res = write_inode_info(self, &inode, inode_num);
-  CHECK_UNLOCK_O(res, "Failed to write inode info.", -res);
+  inode->uid = 0;
+  inode->gid = 0;
+
+  inode->fragment_addr = 0;
+  inode->hard_link_count = links;
+  inode->flags = 0;
+  // New inodes are extent-mapped when the filesystem supports it,
+  // except symlinks, which may keep their target in the block pointers.
+  if (
+    (self->superblock->required_features & EXT4_FEATURE_INCOMPAT_EXTENTS)
+    && (permissions & 0xF000) != EXT2_S_IFLNK
+    ) init_extent_root(inode);
+  inode->os_1 = 0;
+  inode->generation_number = 0;
+  inode->file_acl = 0;
+  inode->dir_acl = 0;
+  inode->permissions = permissions;
+
+  ci->dirty |= EXT2_DIRTY_DATA;
+  iput(self, ci);
+  return 0;
+}
+
+// Lock a directory for writing and check that it has no entry with
+// the given name.
+static ext2_cinode_t *lock_dir_for_create(
+  ext2_fs_t *self, fs_node_t *node, char *name, int32_t *err
+  )
+{
+  ext2_cinode_t *ci = ilock(self, node->inode, 1);
+  *err = -EAGAIN;
+  CHECK(ci == NULL, "Failed to get inode.", NULL);
+
+  ext2_dindex_entry_t *existing = NULL;
+  uint32_t res = 0;
+  if ((ci->inode.permissions & EXT2_S_IFDIR) == 0) *err = -ENOTDIR;
+  else if ((res = find_dir_entry(self, ci, name, &existing))) *err = -EAGAIN;
+  else if (existing) *err = -EEXIST;
+  else return ci;
+
+  iunlock(self, ci);
+  return NULL;
+}
+
+static int32_t ext2_mkdir(fs_node_t *node, char *name, uint16_t mask)
+{
+  ext2_fs_t *self = node->device;
+  int32_t sres = 0;
+  ext2_cinode_t *ci = lock_dir_for_create(self, node, name, &sres);
+  if (ci == NULL) { finish_op(self); return sres; }
+
+  uint32_t inode_num = alloc_inode(
+    self, find_inode_group(self, node->inode, 1), 1
+    );
+  if (inode_num == 0) { iunlock(self, ci); finish_op(self); return -ENOSPC; }
+  uint32_t res = init_inode(self, inode_num, EXT2_S_IFDIR | (0xFFF & mask), 2);
+  CHECK_FINISH_I(res, "Failed to initialize inode.", -res);
+
+  sres = create_dir_entry_inode(self, ci, name, inode_num, EXT2_S_IFDIR);
+  CHECK_FINISH_I(sres < 0, "Failed to create directory entry.", sres);
+
+  ext2_cinode_t *child_ci = iget(self, inode_num);
+  CHECK_FINISH_I(child_ci == NULL, "Failed to get inode.", -EAGAIN);
+  child_ci->inode.size = self->block_size;
 
   uint8_t *buf = kmalloc(self->block_size);
-  CHECK_UNLOCK_O(buf == NULL, "No memory.", -ENOMEM);
-  ext2_dir_entry_t *ent = kmalloc(12);
-  CHECK_UNLOCK_O(ent == NULL, "No memory.", -ENOMEM);
-  u_memset(ent, 0, 12);
+  if (buf == NULL) iput(self, child_ci);
+  CHECK_FINISH_I(buf == NULL, "No memory.", -ENOMEM);
+  u_memset(buf, 0, self->block_size);
+  ext2_dir_entry_t *ent = (ext2_dir_entry_t *)buf;
   ent->inode = inode_num;
   ent->size = 12;
   ent->name_len = 1;
+  ent->type = dir_entry_type(self, EXT2_S_IFDIR);
   ent->name[0] = '.';
-  u_memcpy(buf, ent, 12);
+  ent = (ext2_dir_entry_t *)(buf + 12);
   ent->inode = node->inode;
+  ent->size = self->block_size - 12;
   ent->name_len = 2;
+  ent->type = dir_entry_type(self, EXT2_S_IFDIR);
+  ent->name[0] = '.';
   ent->name[1] = '.';
-  ent->size = self->block_size - 12;
-  u_memcpy(&buf[12], ent, 12);
-  res = write_inode_block(self, &inode, inode_num, 0, buf);
-  CHECK_UNLOCK_O(res != self->block_size, "Failed to write inode block.", -EAGAIN);
-  kfree(ent);
+  res = write_inode_block(self, child_ci, 0, buf);
   kfree(buf);
+  iput(self, child_ci);
+  CHECK_FINISH_I(
+    res != self->block_size, "Failed to write inode block.", -EAGAIN
+    );
 
-  ext2_inode_t parent_inode;
-  res = read_inode_info(self, &parent_inode, node->inode);
-  CHECK_UNLOCK_O(res, "Failed to read inode info.", -res);
-  ++(parent_inode.hard_link_count);
-  res = write_inode_info(self, &parent_inode, node->inode);
-  CHECK_UNLOCK_O(res, "Failed to write inode info.", -res);
-
-  uint32_t group_num = inode_num / self->inodes_per_group;
-  ++(self->bgds[group_num].dir_count);
-  res = write_bgds(self);
-  CHECK_UNLOCK_O(res, "Failed to write block group descriptors.", -res);
+  ++(ci->inode.hard_link_count);
+  ci->dirty |= EXT2_DIRTY_META;
 
-  kunlock(&(self->ops_lock));
+  iunlock(self, ci);
+  finish_op(self);
   return 0;
 }
 
 static int32_t ext2_create(fs_node_t *node, char *name, uint16_t mask)
 {
   ext2_fs_t *self = node->device;
-  fs_node_t *child = fs_finddir(node, name);
-  kfree(child);
-  if (child) return -EEXIST;
+  int32_t sres = 0;
+  ext2_cinode_t *ci = lock_dir_for_create(self, node, name, &sres);
+  if (ci == NULL) { finish_op(self); return sres; }
 
-  klock(&(self->ops_lock));
+  uint32_t inode_num = alloc_inode(
+    self, find_inode_group(self, node->inode, 0), 0
+    );
+  if (inode_num == 0) { iunlock(self, ci); finish_op(self); return -ENOSPC; }
+  uint32_t res = init_inode(self, inode_num, EXT2_S_IFREG | (0xFFF & mask), 1);
+  CHECK_FINISH_I(res, "Failed to initialize inode.", -res);
 
-  uint32_t inode_num = alloc_inode(self);
-  if (inode_num == 0) { kunlock(&(self->ops_lock)); return -ENOSPC; }
-  ext2_inode_t inode;
-  uint32_t res = read_inode_info(self, &inode, inode_num);
-  CHECK_UNLOCK_O(res, "Failed to read inode info.", -res);
+  sres = create_dir_entry_inode(self, ci, name, inode_num, EXT2_S_IFREG);
+  CHECK_FINISH_I(sres < 0, "Failed to create directory entry.", sres);
 
-  // TODO atime, mtime, ctime
-  inode.atime = 0;
-  inode.ctime = 0;
-  inode.mtime = 0;
-
-  u_memset(&(inode.block_pointer), 0, sizeof(inode.block_pointer));
-  inode.sector_count = 0;
-  inode.size = 0;
-
-  // TODO users
-  inode.uid = 0;
-  inode.gid = 0;
-
-  inode.fragment_addr = 0;
-  inode.hard_link_count = 1;
-  inode.flags = 0;
-  inode.os_1 = 0;
-  inode.generation_number = 0;
-  inode.file_acl = 0;
-  inode.dir_acl = 0;
-  inode.permissions = EXT2_S_IFREG;
-  inode.permissions |= 0xFFF & mask;
-
-  res = write_inode_info(self, &inode, inode_num);
-  CHECK_UNLOCK_O(res, "Failed to write inode info.", -res);
-  int32_t sres = create_dir_entry(node, name, inode_num);
-  CHECK_UNLOCK_O(sres < 0, "Failed to create directory entry.", sres);
-
-  kunlock(&(self->ops_lock));
+  iunlock(self, ci);
+  finish_op(self);
   return 0;
 }
 
 static int32_t ext2_unlink(fs_node_t *node, char *name)
 {
   ext2_fs_t *self = node->device;
-  klock(&(self->ops_lock));
-  ext2_inode_t inode;
-  uint32_t res = read_inode_info(self, &inode, node->inode);
-  CHECK_UNLOCK_O(res, "Failed to read inode info.", -res);
-  if ((inode.permissions & EXT2_S_IFDIR) == 0) {
-    kunlock(&(self->ops_lock)); return -ENOTDIR;
+  ext2_cinode_t *ci = ilock(self, node->inode, 1);
+  CHECK_FINISH(ci == NULL, "Failed to get inode.", -EAGAIN);
+  ext2_inode_t *inode = &(ci->inode);
+  if ((inode->permissions & EXT2_S_IFDIR) == 0) {
+    iunlock(self, ci); finish_op(self); return -ENOTDIR;
   }
 
-  uint8_t *blk_buf = kmalloc(self->block_size);
-  CHECK_UNLOCK_O(blk_buf == NULL, "No memory.", -ENOMEM);
-  uint32_t block_num = 0;
-  res = read_inode_block(self, &inode, block_num, blk_buf);
-  CHECK_UNLOCK_O(res != self->block_size, "Failed to read inode block.", -EAGAIN);
-
-  uint32_t idx = 0;
-  uint32_t dir_idx = 0;
-  ext2_dir_entry_t *current_entry = NULL;
-  ext2_dir_entry_t *found_entry = NULL;
-  for (
-    ;
-    idx < inode.size;
-    idx += current_entry->size, dir_idx += current_entry->size
-    )
-  {
-    if (dir_idx >= self->block_size) {
-      ++block_num;
-      dir_idx -= self->block_size;
-      res = read_inode_block(self, &inode, block_num, blk_buf);
-      CHECK_UNLOCK_O(
-        res != self->block_size, "Failed to read inode block.", -EAGAIN
-        );
-    }
-
-    current_entry = (ext2_dir_entry_t *)(blk_buf + dir_idx);
-    if (current_entry->inode == 0 || u_strlen(name) != current_entry->name_len)
-      continue;
-
-    char *dname = kmalloc(current_entry->name_len + 1);
-    CHECK_UNLOCK_O(dname == NULL, "No memory.", -ENOMEM);
-    u_memcpy(dname, current_entry->name, current_entry->name_len);
-    dname[current_entry->name_len] = '\0';
-    if (u_strcmp(dname, name) == 0) {
-      kfree(dname);
-      found_entry = current_entry;
-      break;
-    }
-    kfree(dname);
+  // The parent is always locked before the child, so the entries that
+  // refer to the directory itself or its parent can't be removed.
+  if (u_strcmp(name, FS_DIR_SELF) == 0 || u_strcmp(name, FS_DIR_UP) == 0) {
+    iunlock(self, ci); finish_op(self); return -EINVAL;
   }
 
-  if (found_entry == NULL) {
-    kfree(blk_buf); kunlock(&self->ops_lock); return -ENOENT;
+  ext2_dindex_entry_t *found_dentry = NULL;
+  uint32_t res = find_dir_entry(self, ci, name, &found_dentry);
+  CHECK_FINISH_I(res, "Failed to look up directory entry.", -EAGAIN);
+  if (found_dentry == NULL) {
+    iunlock(self, ci); finish_op(self); return -ENOENT;
   }
 
+  uint8_t *blk_buf = kmalloc(self->block_size);
+  CHECK_FINISH_I(blk_buf == NULL, "No memory.", -ENOMEM);
+  uint32_t block_num = found_dentry->block_num;
+  res = read_inode_block(self, ci, block_num, blk_buf);
+  if (res != self->block_size) kfree(blk_buf);
+  CHECK_FINISH_I(
+    res != self->block_size, "Failed to read inode block.", -EAGAIN
+    );
+  ext2_dir_entry_t *found_entry =
+    (ext2_dir_entry_t *)(blk_buf + found_dentry->offset);
+
   uint32_t child_inode_num = found_entry->inode;
-  ext2_inode_t child_inode;
-  res = read_inode_info(self, &child_inode, child_inode_num);
-  CHECK_UNLOCK_O(res, "Failed to read child inode info.", -res);
+  ext2_cinode_t *child_ci = ilock(self, child_inode_num, 1);
+  CHECK_FINISH_I(child_ci == NULL, "Failed to get child inode.", -EAGAIN);
+  ext2_inode_t *child_inode = &(child_ci->inode);
 
-  uint8_t isfile = (child_inode.permissions & EXT2_S_IFREG) == EXT2_S_IFREG;
-  uint8_t islink = (child_inode.permissions & EXT2_S_IFLNK) == EXT2_S_IFLNK;
-  uint8_t isdir = (child_inode.permissions & EXT2_S_IFDIR) == EXT2_S_IFDIR;
+  uint8_t isdir = (child_inode->permissions & EXT2_S_IFDIR) == EXT2_S_IFDIR;
 
-  if (isdir)
-    if (ext2_readdir_inode(self, &child_inode, 2)) {
-      kfree(blk_buf); kunlock(&(self->ops_lock)); return -EPERM;
+  if (isdir) {
+    uint32_t cursor_idx = 0, cursor_offset = 0;
+    struct dirent *ent = ext2_readdir_inode(
+      self, child_ci, 2, &cursor_idx, &cursor_offset
+      );
+    if (ent) {
+      kfree(ent); kfree(blk_buf); iunlock(self, child_ci); iunlock(self, ci);
+      finish_op(self); return -EPERM;
     }
+  }
 
   found_entry->inode = 0;
-  res = write_inode_block(self, &inode, node->inode, block_num, blk_buf);
-  CHECK_UNLOCK_O(res != self->block_size, "Failed to write inode block.", -EAGAIN);
-  --(child_inode.hard_link_count);
-  res = write_inode_info(self, &child_inode, child_inode_num);
-  CHECK_UNLOCK_O(res, "Failed to write child inode info.", -res);
+  res = write_inode_block(self, ci, block_num, blk_buf);
+  if (res != self->block_size) { kfree(blk_buf); iunlock(self, child_ci); }
+  CHECK_FINISH_I(
+    res != self->block_size, "Failed to write inode block.", -EAGAIN
+    );
+  dindex_remove(ci->dindex, found_dentry);
+  dindex_free_slot(self, ci->dindex, block_num, blk_buf);
+  kfree(blk_buf);
 
   if (isdir) {
-    --(inode.hard_link_count);
-    res = write_inode_info(self, &inode, node->inode);
-    CHECK_UNLOCK_O(res, "Failed to write inode info.", -res);
-  }
-
-  // TODO actually make freeing space work.
-  /* if ( */
-  /*   ((islink || isfile) && child_inode.hard_link_count == 0) */
-  /*   || (isdir && child_inode.hard_link_count == 1) */
-  /*   ) */
-  /* { */
-  /*   uint32_t tmp = child_inode.sector_count / (self->block_size / 512); */
-  /*   for (uint32_t i = 0; i < tmp; ++i) { */
-  /*     res = free_inode_block(self, &child_inode, child_inode_num, i); */
-  /*     CHECK(res, "Failed to free inode block.", -res); */
-  /*     res = read_inode_info(self, &child_inode, child_inode_num); */
-  /*     CHECK(res, "Failed to read inode info.", -res); */
-  /*   } */
-
-  /*   res = free_inode(self, child_inode_num); */
-  /*   CHECK(res, "Failed to free inode.", -res); */
-  /* } */
+    --(inode->hard_link_count);
+    ci->dirty |= EXT2_DIRTY_META;
+  }
 
-  kfree(blk_buf);
-  kunlock(&(self->ops_lock));
+  // A directory keeps one link to itself until it is removed.
+  --(child_inode->hard_link_count);
+  child_ci->dirty |= EXT2_DIRTY_META;
+  if (child_inode->hard_link_count > (isdir ? 1 : 0)) {
+    iunlock(self, child_ci);
+    iunlock(self, ci);
+    finish_op(self);
+    return 0;
+  }
+
+  // An open file keeps its blocks until it is released (see
+  // ext2_release).
+  child_inode->hard_link_count = 0;
+  if (fs_vnode_busy(self, child_inode_num)) {
+    child_ci->orphan = 1;
+    iget(self, child_inode_num);
+    iunlock(self, child_ci);
+    iunlock(self, ci);
+    finish_op(self);
+    return 0;
+  }
+
+  res = destroy_inode(self, child_ci);
+  CHECK_FINISH_I(res, "Failed to free inode.", -res);
+
+  iunlock(self, ci);
+  finish_op(self);
   return 0;
 }
 
 static int32_t ext2_chmod(fs_node_t *node, int32_t mask)
 {
   ext2_fs_t *self = node->device;
-  klock(&(self->ops_lock));
-  ext2_inode_t inode;
-  uint32_t res = read_inode_info(self, &inode, node->inode);
-  CHECK_UNLOCK_O(res, "Failed to read inode info.", -res);
-  inode.permissions = (inode.permissions & 0xFFFFF000) | mask;
-  res = write_inode_info(self, &inode, node->inode);
-  CHECK_UNLOCK_O(res, "Failed to write inode info.", -res);
-  kunlock(&(self->ops_lock));
+  ext2_cinode_t *ci = ilock(self, node->inode, 1);
+  CHECK_FINISH(ci == NULL, "Failed to get inode.", -EAGAIN);
+  ci->inode.permissions = (ci->inode.permissions & 0xFFFFF000) | mask;
+  ci->dirty |= EXT2_DIRTY_META;
+  iunlock(self, ci);
+  finish_op(self);
   return 0;
 }
 
 static int32_t ext2_symlink(fs_node_t *node, char *value, char *name)
 {
   ext2_fs_t *self = node->device;
-  fs_node_t *child = fs_finddir(node, name);
-  kfree(child);
-  if (child) return -EEXIST;
-
-  klock(&(self->ops_lock));
-
-  uint32_t inode_num = alloc_inode(self);
-  if (inode_num == 0) { kunlock(&(self->ops_lock)); return -ENOSPC; }
-  ext2_inode_t inode;
-  uint32_t res = read_inode_info(self, &inode, inode_num);
-  CHECK_UNLOCK_O(res, "Failed to read inode info.", -res);
+  int32_t sres = 0;
+  ext2_cinode_t *ci = lock_dir_for_create(self, node, name, &sres);
+  if (ci == NULL) { finish_op(self); return sres; }
 
-  // TODO atime, mtime, ctime
-  inode.atime = 0;
-  inode.ctime = 0;
-  inode.mtime = 0;
-
-  u_memset(&(inode.block_pointer), 0, sizeof(inode.block_pointer));
-  inode.sector_count = 0;
-  inode.size = 0;
-
-  // TODO users
-  inode.uid = 0;
-  inode.gid = 0;
-
-  inode.fragment_addr = 0;
-  inode.hard_link_count = 1;
-  inode.flags = 0;
-  inode.os_1 = 0;
-  inode.generation_number = 0;
-  inode.file_acl = 0;
-  inode.dir_acl = 0;
-  inode.permissions = EXT2_S_IFLNK;
-  inode.permissions |= 0660;
+  uint32_t inode_num = alloc_inode(
+    self, find_inode_group(self, node->inode, 0), 0
+    );
+  if (inode_num == 0) { iunlock(self, ci); finish_op(self); return -ENOSPC; }
+  uint32_t res = init_inode(self, inode_num, EXT2_S_IFLNK | 0660, 1);
+  CHECK_FINISH_I(res, "Failed to initialize inode.", -res);
 
   uint32_t src_len = u_strlen(value);
-  uint8_t embedded = src_len <= sizeof(inode.block_pointer);
+  uint8_t embedded = src_len <= sizeof(ci->inode.block_pointer);
   if (embedded) {
-    u_memcpy(&(inode.block_pointer), value, src_len);
-    inode.size = src_len;
+    ext2_cinode_t *child_ci = iget(self, inode_num);
+    CHECK_FINISH_I(child_ci == NULL, "Failed to get inode.", -EAGAIN);
+    u_memcpy(child_ci->inode.block_pointer, value, src_len);
+    child_ci->inode.size = src_len;
+    child_ci->dirty |= EXT2_DIRTY_DATA;
+    iput(self, child_ci);
   }
 
-  res = write_inode_info(self, &inode, inode_num);
-  CHECK_UNLOCK_O(res, "Failed to write inode info.", -res);
-  int32_t sres = create_dir_entry(node, name, inode_num);
-  CHECK_UNLOCK_O(sres < 0, "Failed to create directory entry.", sres);
+  sres = create_dir_entry_inode(self, ci, name, inode_num, EXT2_S_IFLNK);
+  CHECK_FINISH_I(sres < 0, "Failed to create directory entry.", sres);
 
-  kunlock(&(self->ops_lock));
+  iunlock(self, ci);
+  finish_op(self);
 
   if (!embedded) {
     fs_node_t tmp;
+    u_memset(&tmp, 0, sizeof(tmp));
     tmp.device = self;
     tmp.inode = inode_num;
     res = ext2_write(&tmp, 0, src_len, (uint8_t *)value);
@@ -1354,14 +2952,15 @@ static int32_t ext2_symlink(fs_node_t *node, char *value, char *name)
 static int32_t ext2_readlink(fs_node_t *node, char *buf, size_t bufsize)
 {
   ext2_fs_t *self = node->device;
-  klock(&(self->ops_lock));
+  ext2_cinode_t *ci = ilock(self, node->inode, 0);
+  CHECK_FINISH(ci == NULL, "Failed to get inode.", -EAGAIN);
   ext2_inode_t inode;
-  uint32_t res = read_inode_info(self, &inode, node->inode);
-  CHECK_UNLOCK_O(res, "Failed to read inode info.", -res);
+  u_memcpy(&inode, &(ci->inode), sizeof(ext2_inode_t));
+  iunlock(self, ci);
   uint32_t size = bufsize;
   if (inode.size < bufsize) size = inode.size;
 
-  kunlock(&(self->ops_lock));
+  finish_op(self);
 
   uint32_t read_size = 0;
   if (inode.size > sizeof(inode.block_pointer))
@@ -1379,84 +2978,478 @@ static int32_t ext2_readlink(fs_node_t *node, char *buf, size_t bufsize)
 static int32_t ext2_rename(fs_node_t *node, char *old, char *new)
 {
   ext2_fs_t *self = node->device;
-  klock(&(self->ops_lock));
-  ext2_inode_t inode;
-  uint32_t res = read_inode_info(self, &inode, node->inode);
-  CHECK_UNLOCK_O(res, "Failed to read inode info.", -res);
+  ext2_cinode_t *ci = ilock(self, node->inode, 1);
+  CHECK_FINISH(ci == NULL, "Failed to get inode.", -EAGAIN);
+
+  ext2_dindex_entry_t *old_dentry = NULL;
+  ext2_dindex_entry_t *new_dentry = NULL;
+  uint32_t res = find_dir_entry(self, ci, old, &old_dentry);
+  CHECK_FINISH_I(res, "Failed to look up directory entry.", -EAGAIN);
+  res = find_dir_entry(self, ci, new, &new_dentry);
+  CHECK_FINISH_I(res, "Failed to look up directory entry.", -EAGAIN);
+
+  if (old_dentry == NULL) {
+    iunlock(self, ci); finish_op(self); return -ENOENT;
+  }
+  if (new_dentry) {
+    // On most systems, `rename' removes the directory entry with the new
+    // name.
+    // I think that's a bad design choice and I also don't want to
+    // implement it, so I won't.
+    iunlock(self, ci); finish_op(self); return -EEXIST;
+  }
 
   uint8_t *blk_buf = kmalloc(self->block_size);
-  CHECK_UNLOCK_O(blk_buf == NULL, "No memory.", -ENOMEM);
-  uint32_t block_num = 0;
-  res = read_inode_block(self, &inode, block_num, blk_buf);
-  CHECK_UNLOCK_O(res != self->block_size, "Failed to read inode block.", -EAGAIN);
+  CHECK_FINISH_I(blk_buf == NULL, "No memory.", -ENOMEM);
+  uint32_t block_num = old_dentry->block_num;
+  res = read_inode_block(self, ci, block_num, blk_buf);
+  if (res != self->block_size) kfree(blk_buf);
+  CHECK_FINISH_I(
+    res != self->block_size, "Failed to read inode block.", -EAGAIN
+    );
 
-  uint32_t idx = 0;
-  uint32_t dir_idx = 0;
-  ext2_dir_entry_t *current_entry = NULL;
-  ext2_dir_entry_t *old_entry = NULL;
-  ext2_dir_entry_t *new_entry = NULL;
-  for (
-    ;
-    idx < inode.size;
-    idx += current_entry->size, dir_idx += current_entry->size
-    )
-  {
-    if (dir_idx >= self->block_size) {
-      ++block_num;
-      dir_idx -= self->block_size;
-      res = read_inode_block(self, &inode, block_num, blk_buf);
-      CHECK_UNLOCK_O(
-        res != self->block_size, "Failed to read inode block.", -EAGAIN
-        );
+  ext2_dir_entry_t *old_entry =
+    (ext2_dir_entry_t *)(blk_buf + old_dentry->offset);
+  uint32_t child_inode_num = old_entry->inode;
+  ext2_inode_t child_inode;
+  res = read_inode_info(self, &child_inode, child_inode_num);
+  if (res) kfree(blk_buf);
+  CHECK_FINISH_I(res, "Failed to read inode info.", -EAGAIN);
+  old_entry->inode = 0;
+  res = write_inode_block(self, ci, block_num, blk_buf);
+  if (res != self->block_size) kfree(blk_buf);
+  CHECK_FINISH_I(
+    res != self->block_size, "Failed to write inode block.", -EAGAIN
+    );
+  dindex_remove(ci->dindex, old_dentry);
+  dindex_free_slot(self, ci->dindex, block_num, blk_buf);
+  kfree(blk_buf);
+
+  int32_t sres = create_dir_entry_inode(
+    self, ci, new, child_inode_num, child_inode.permissions
+    );
+  CHECK_FINISH_I(sres < 0, "Failed to create directory entry.", sres);
+
+  iunlock(self, ci);
+  finish_op(self);
+  return 0;
+}
+
+// Find the next data or hole at or after an offset. Missing indirect
+// blocks are skipped as a whole.
+static int32_t ext2_seek(fs_node_t *node, uint32_t offset, uint32_t whence)
+{
+  ext2_fs_t *self = node->device;
+  ext2_cinode_t *ci = ilock(self, node->inode, 0);
+  CHECK_FINISH(ci == NULL, "Failed to get inode.", -EAGAIN);
+  uint32_t size = ci->inode.size;
+  if (offset >= size) { iunlock(self, ci); finish_op(self); return -ENXIO; }
+
+  uint8_t want_data = whence == SEEK_DATA;
+  uint32_t block_num = offset / self->block_size;
+  uint32_t last_block = (size - 1) / self->block_size;
+  uint32_t err = 0;
+  klock(&(ci->map_lock));
+  while (block_num <= last_block && !is_fast_symlink(&(ci->inode))) {
+    uint32_t hole_count = 1;
+    uint32_t disk_block_num =
+      lookup_disk_block_number(self, ci, block_num, &hole_count);
+    if (disk_block_num >= (uint32_t)(-ENOMEM)) { err = EAGAIN; break; }
+    if ((disk_block_num != 0) == want_data) break;
+    block_num += disk_block_num ? 1 : hole_count;
+  }
+  kunlock(&(ci->map_lock));
+  iunlock(self, ci);
+  finish_op(self);
+  CHECK(err, "Failed to get disk block number.", -err);
+
+  // The end of the file counts as a hole.
+  if (block_num > last_block) return want_data ? -ENXIO : (int32_t)size;
+  uint32_t found = block_num * self->block_size;
+  return found > offset ? found : offset;
+}
+
+// A run of blocks of a file that are consecutive both in the file and
+// on the disk.
+typedef struct ext2_segment_s {
+  uint32_t block_num;
+  uint32_t disk_block_num;
+  uint32_t count;
+} ext2_segment_t;
+
+// Walk the block map of an inode to count its data blocks and the runs
+// of contiguous disk blocks they are in. Holes don't end a run, so a
+// sparse file whose blocks are stored back to back has a single one.
+// The segments of the file are counted in `seg_count`, and the first
+// `max` of them are stored in `segs` if it isn't NULL.
+static uint32_t map_segments(
+  ext2_fs_t *self,
+  ext2_cinode_t *ci,
+  struct fs_fraginfo *info,
+  ext2_segment_t *segs,
+  uint32_t max,
+  uint32_t *seg_count
+  )
+{
+  info->blocks = 0;
+  info->extents = 0;
+  *seg_count = 0;
+  if (ci->inode.size == 0 || is_fast_symlink(&(ci->inode))) return 0;
+
+  uint32_t last_block = (ci->inode.size - 1) / self->block_size;
+  uint32_t prev_block = 0, prev_disk = 0;
+  uint32_t err = 0;
+  klock(&(ci->map_lock));
+  for (uint32_t block_num = 0; block_num <= last_block;) {
+    uint32_t hole_count = 1;
+    uint32_t disk_block_num =
+      lookup_disk_block_number(self, ci, block_num, &hole_count);
+    if (disk_block_num >= (uint32_t)(-ENOMEM)) { err = EAGAIN; break; }
+    if (disk_block_num == 0) { block_num += hole_count; continue; }
+
+    uint8_t contiguous = prev_disk && disk_block_num == prev_disk + 1;
+    if (!contiguous) ++(info->extents);
+    if (!contiguous || block_num != prev_block + 1) {
+      if (segs && *seg_count < max)
+        segs[*seg_count] = (ext2_segment_t){ block_num, disk_block_num, 0 };
+      ++(*seg_count);
     }
+    if (segs && *seg_count <= max) ++(segs[*seg_count - 1].count);
+    ++(info->blocks);
+    prev_block = block_num;
+    prev_disk = disk_block_num;
+    ++block_num;
+  }
+  kunlock(&(ci->map_lock));
 
-    current_entry = (ext2_dir_entry_t *)(blk_buf + dir_idx);
-    if (current_entry->inode == 0)
-      continue;
+  CHECK(err, "Failed to get disk block number.", err);
+  return 0;
+}
+
+// Copy the data of a file into `count` free blocks starting at
+// `dest`, in the order of its segments.
+static uint32_t copy_segments(
+  ext2_fs_t *self, ext2_segment_t *segs, uint32_t seg_count, uint32_t dest
+  )
+{
+  uint32_t chunk = EXT2_READAHEAD_MAX / self->block_size;
+  uint8_t *buf = kmalloc(chunk * self->block_size);
+  CHECK(buf == NULL, "No memory.", ENOMEM);
 
-    char *dname = kmalloc(current_entry->name_len + 1);
-    CHECK_UNLOCK_O(dname == NULL, "No memory.", -ENOMEM);
-    u_memcpy(dname, current_entry->name, current_entry->name_len);
-    dname[current_entry->name_len] = '\0';
-    if (u_strcmp(dname, old) == 0) old_entry = current_entry;
-    if (u_strcmp(dname, new) == 0) new_entry = current_entry;
-    kfree(dname);
+  uint32_t err = 0;
+  for (uint32_t i = 0; i < seg_count && err == 0; ++i) {
+    for (uint32_t done = 0; done < segs[i].count;) {
+      uint32_t n = segs[i].count - done;
+      if (n > chunk) n = chunk;
+      uint32_t size = n * self->block_size;
+      uint32_t res = read_blocks(self, segs[i].disk_block_num + done, n, buf);
+      if (res != size) { err = EIO; break; }
+      res = write_blocks(self, dest, n, buf);
+      if (res != size) { err = EIO; break; }
+      done += n;
+      dest += n;
+    }
   }
 
-  if (old_entry == NULL) {
-    kunlock(&(self->ops_lock)); kfree(blk_buf); return -ENOENT;
+  kfree(buf);
+  CHECK(err, "Failed to copy blocks.", err);
+  return 0;
+}
+
+// Move the data of a regular file into a single run of free blocks.
+// The new run is allocated and filled before the old blocks are
+// released, and the inode stays locked for writing throughout, so
+// other operations see either the old layout or the new one. Files
+// that don't fit in a single block group are left alone.
+static uint32_t defrag_inode(
+  ext2_fs_t *self, ext2_cinode_t *ci, struct fs_fraginfo *info
+  )
+{
+  uint32_t seg_count = 0;
+  uint32_t res = map_segments(self, ci, info, NULL, 0, &seg_count);
+  CHECK(res, "Failed to map file.", res);
+  if (info->extents <= 1) return 0;
+
+  ext2_segment_t *segs = kmalloc(seg_count * sizeof(ext2_segment_t));
+  CHECK(segs == NULL, "No memory.", ENOMEM);
+  res = map_segments(self, ci, info, segs, seg_count, &seg_count);
+  if (res) { kfree(segs); CHECK(1, "Failed to map file.", res); }
+
+  // The preallocation window may be part of the best free run.
+  release_prealloc(self, ci);
+  uint32_t first = alloc_contiguous(self, inode_goal(self, ci), info->blocks);
+  if (first == 0) { kfree(segs); return ENOSPC; }
+  res = copy_segments(self, segs, seg_count, first);
+  if (res) {
+    free_blocks(self, first, info->blocks);
+    kfree(segs);
+    CHECK(1, "Failed to copy file.", res);
   }
-  if (new_entry) {
-    // On most systems, `rename' removes the directory entry with the new
-    // name.
-    // I think that's a bad design choice and I also don't want to
-    // implement it, so I won't.
-    kunlock(&(self->ops_lock)); kfree(blk_buf); return -EEXIST;
+
+  // Build the new block map on an empty one while the old map is set
+  // aside, so that a failure can put the old map back untouched.
+  // Remapping can only fail if an indirect block or extent node can't
+  // be allocated.
+  ext2_inode_t *inode = &(ci->inode);
+  uint32_t old_map[sizeof(inode->block_pointer) / 4];
+  uint32_t old_sectors = inode->sector_count;
+  u_memcpy(old_map, inode->block_pointer, sizeof(old_map));
+  release_map(ci);
+  if (has_extents(inode)) init_extent_root(inode);
+  else u_memset(inode->block_pointer, 0, sizeof(inode->block_pointer));
+  inode->sector_count = info->blocks * (self->block_size / 512);
+
+  uint32_t mapped = 0;
+  for (uint32_t i = 0; i < seg_count && res == 0; ++i) {
+    ext2_segment_t *seg = &(segs[i]);
+    for (uint32_t j = 0; j < seg->count && res == 0;) {
+      uint32_t len = 1;
+      if (has_extents(inode)) {
+        len = seg->count - j;
+        if (len > EXT4_EXTENT_MAX_LEN) len = EXT4_EXTENT_MAX_LEN;
+        res = insert_extent(self, ci, seg->block_num + j, first + mapped, len);
+      } else {
+        res = set_disk_block_number(
+          self, ci, seg->block_num + j, first + mapped
+          );
+      }
+      if (res == 0) { j += len; mapped += len; }
+    }
   }
+  kfree(segs);
 
-  uint32_t child_inode_num = old_entry->inode;
-  old_entry->inode = 0;
-  res = write_inode_block(self, &inode, node->inode, block_num, blk_buf);
-  CHECK_UNLOCK_O(
-    res != self->block_size, "Failed to write inode block.", -EAGAIN
+  if (res) {
+    // The partial map holds the start of the new run and any index
+    // blocks allocated for it. The rest of the run is freed directly.
+    free_inode_blocks(self, ci);
+    if (mapped < info->blocks)
+      free_blocks(self, first + mapped, info->blocks - mapped);
+    u_memcpy(inode->block_pointer, old_map, sizeof(old_map));
+    inode->sector_count = old_sectors;
+    CHECK(1, "Failed to remap file.", res);
+  }
+
+  // Free the old blocks by swapping the old map back in for a moment.
+  uint32_t new_map[sizeof(inode->block_pointer) / 4];
+  uint32_t new_sectors = inode->sector_count;
+  u_memcpy(new_map, inode->block_pointer, sizeof(new_map));
+  release_map(ci);
+  u_memcpy(inode->block_pointer, old_map, sizeof(old_map));
+  inode->sector_count = old_sectors;
+  res = free_inode_blocks(self, ci);
+  if (res) log_error("ext2", "Failed to free old blocks.\n");
+  u_memcpy(inode->block_pointer, new_map, sizeof(new_map));
+  inode->sector_count = new_sectors;
+  ci->dirty |= EXT2_DIRTY_DATA;
+
+  return map_segments(self, ci, info, NULL, 0, &seg_count);
+}
+
+static int32_t ext2_ioctl(fs_node_t *node, uint32_t request, void *arg)
+{
+  if (request != FS_IOC_FRAGINFO && request != FS_IOC_DEFRAG) return -ENOTTY;
+  if (arg == NULL) return -EINVAL;
+
+  ext2_fs_t *self = node->device;
+  uint8_t defrag = request == FS_IOC_DEFRAG;
+  ext2_cinode_t *ci = ilock(self, node->inode, defrag);
+  CHECK_FINISH(ci == NULL, "Failed to get inode.", -EAGAIN);
+  if (defrag && (ci->inode.permissions & 0xF000) != EXT2_S_IFREG) {
+    iunlock(self, ci); finish_op(self); return -EINVAL;
+  }
+
+  uint32_t seg_count = 0;
+  uint32_t res = defrag
+    ? defrag_inode(self, ci, arg)
+    : map_segments(self, ci, arg, NULL, 0, &seg_count);
+  iunlock(self, ci);
+  finish_op(self);
+  return -res;
+}
+
+static int32_t ext2_sync(fs_node_t *node)
+{
+  ext2_fs_t *self = node->device;
+  uint32_t res = sync_fs(self);
+  CHECK(res, "Failed to sync filesystem.", -res);
+  return 0;
+}
+
+// Write back an indirect block and, if it points to other indirect
+// blocks, those blocks too. `depth` is 1 for singly indirect blocks.
+static uint32_t sync_indirect_block(
+  ext2_fs_t *self, uint32_t block_num, uint32_t depth
+  )
+{
+  if (block_num == 0) return 0;
+  uint32_t res = bcache_sync_blocks(
+    self->block_device, self->block_size, block_num, 1
+    );
+  CHECK(res, "Failed to sync block.", res);
+  if (depth == 1) return 0;
+
+  uint32_t *entries = kmalloc(self->block_size);
+  CHECK(entries == NULL, "No memory.", ENOMEM);
+  res = read_block(self, block_num, (uint8_t *)entries);
+  if (res != self->block_size) {
+    kfree(entries);
+    CHECK(1, "Failed to read block.", EAGAIN);
+  }
+  uint32_t err = 0;
+  for (uint32_t i = 0; i < self->block_size / sizeof(uint32_t); ++i) {
+    res = sync_indirect_block(self, entries[i], depth - 1);
+    if (res) err = res;
+  }
+  kfree(entries);
+  return err;
+}
+
+// Write back the nodes below an extent tree node.
+static uint32_t sync_extent_node(ext2_fs_t *self, ext4_extent_header_t *h)
+{
+  if (h->depth == 0) return 0;
+  uint8_t *buf = kmalloc(self->block_size);
+  CHECK(buf == NULL, "No memory.", ENOMEM);
+  uint32_t err = 0;
+  for (uint32_t i = 0; i < h->entries; ++i) {
+    uint32_t child = node_indexes(h)[i].leaf_lo;
+    uint32_t res = bcache_sync_blocks(
+      self->block_device, self->block_size, child, 1
+      );
+    if (res) err = res;
+    if (h->depth == 1) continue;
+    res = read_block(self, child, buf);
+    if (res != self->block_size) { err = EAGAIN; continue; }
+    res = sync_extent_node(self, (ext4_extent_header_t *)buf);
+    if (res) err = res;
+  }
+  kfree(buf);
+  return err;
+}
+
+// Write back the data and indirect blocks of an inode, coalescing
+// contiguous data blocks into one request.
+static uint32_t sync_inode_blocks(ext2_fs_t *self, ext2_cinode_t *ci)
+{
+  // Fast symlinks keep their target in the block pointers.
+  if (is_fast_symlink(&(ci->inode))) return 0;
+
+  uint32_t block_count =
+    (ci->inode.size + self->block_size - 1) / self->block_size;
+  uint32_t run_start = 0, run_count = 0, err = 0;
+  for (uint32_t i = 0; i <= block_count; ++i) {
+    uint32_t disk_block_num = 0;
+    if (i < block_count) {
+      disk_block_num = get_disk_block_number(self, ci, i);
+      if (disk_block_num >= (uint32_t)(-ENOMEM)) disk_block_num = 0;
+      if (disk_block_num && disk_block_num == run_start + run_count) {
+        ++run_count; continue;
+      }
+    }
+    if (run_count) {
+      uint32_t res = bcache_sync_blocks(
+        self->block_device, self->block_size, run_start, run_count
+        );
+      if (res) err = res;
+    }
+    run_start = disk_block_num;
+    run_count = disk_block_num ? 1 : 0;
+  }
+
+  if (has_extents(&(ci->inode))) {
+    uint32_t res = sync_extent_node(self, extent_root(&(ci->inode)));
+    if (res) err = res;
+  } else {
+    for (uint32_t depth = 1; depth <= 3; ++depth) {
+      uint32_t res = sync_indirect_block(
+        self, ci->inode.block_pointer[EXT2_DIRECT_BLOCKS + depth - 1], depth
+        );
+      if (res) err = res;
+    }
+  }
+  CHECK(err, "Failed to sync inode blocks.", err);
+  return 0;
+}
+
+// Write back the allocation metadata: bitmaps, block group descriptors
+// and the superblock.
+static uint32_t sync_metadata_blocks(ext2_fs_t *self)
+{
+  uint32_t res = sync_metadata(self);
+  CHECK(res, "Failed to sync metadata.", res);
+
+  fs_node_t *dev = self->block_device;
+  uint32_t err = 0;
+  for (uint32_t group = 0; group < self->group_count; ++group) {
+    res = bcache_sync_blocks(
+      dev, self->block_size, self->bgds[group].block_bitmap, 1
+      );
+    if (res) err = res;
+    res = bcache_sync_blocks(
+      dev, self->block_size, self->bgds[group].inode_bitmap, 1
+      );
+    if (res) err = res;
+  }
+  uint32_t bgd_block_offset = self->block_size > 1024 ? 1 : 2;
+  res = bcache_sync_blocks(
+    dev, self->block_size, bgd_block_offset, self->bgd_block_count
     );
+  if (res) err = res;
+  uint32_t superblock_block = self->block_size > 1024 ? 0 : 1;
+  res = bcache_sync_blocks(dev, self->block_size, superblock_block, 1);
+  if (res) err = res;
+
+  CHECK(err, "Failed to sync metadata blocks.", err);
+  return 0;
+}
 
-  int32_t sres = create_dir_entry(node, new, child_inode_num);
-  CHECK_UNLOCK_O(sres < 0, "Failed to create directory entry.", sres);
+// Write back the data of a file and the metadata needed to read it.
+// With `datasync`, the inode is only written back if its size or block
+// map changed.
+static int32_t ext2_fsync(fs_node_t *node, uint32_t datasync)
+{
+  ext2_fs_t *self = node->device;
+  ext2_cinode_t *ci = ilock(self, node->inode, 0);
+  CHECK(ci == NULL, "Failed to get inode.", -EAGAIN);
+
+  uint32_t res = sync_inode_blocks(self, ci);
+  if (res == 0) res = sync_metadata_blocks(self);
+
+  if (res == 0 && (datasync == 0 || (ci->dirty & EXT2_DIRTY_DATA))) {
+    klock(&(self->icache_lock));
+    uint8_t dirty = ci->dirty;
+    ci->dirty = 0;
+    if (dirty) res = store_inode(self, &(ci->inode), ci->inode_num);
+    if (res) ci->dirty |= dirty;
+    kunlock(&(self->icache_lock));
+
+    uint32_t block, offset;
+    if (res == 0) res = locate_inode(self, ci->inode_num, &block, &offset);
+    if (res == 0)
+      res = bcache_sync_blocks(
+        self->block_device, self->block_size, block, 1
+        );
+  }
 
-  kunlock(&(self->ops_lock));
+  iunlock(self, ci);
+  CHECK(res, "Failed to sync inode.", -res);
   return 0;
 }
 
 static void make_ext2_node(
-  ext2_fs_t *self, fs_node_t *node, ext2_inode_t *inode, ext2_dir_entry_t *ent
+  ext2_fs_t *self,
+  fs_node_t *node,
+  ext2_inode_t *inode,
+  uint32_t inode_num,
+  char *name,
+  uint32_t name_len
   )
 {
   u_memset(node, 0, sizeof(fs_node_t));
   node->device = self;
-  node->inode = ent->inode;
-  u_memcpy(node->name, ent->name, ent->name_len);
-  node->name[ent->name_len] = '\0';
+  node->inode = inode_num;
+  u_memcpy(node->name, name, name_len);
+  node->name[name_len] = '\0';
   node->uid = inode->uid;
   node->gid = inode->gid;
   node->length = inode->size;
@@ -1465,13 +3458,20 @@ static void make_ext2_node(
   node->mtime = inode->mtime;
   node->ctime = inode->ctime;
   node->open = ext2_open;
-  node->close = ext2_close;
+  node->release = ext2_release;
   node->chmod = ext2_chmod;
   node->rename = ext2_rename;
+  node->sync = ext2_sync;
+  node->fsync = ext2_fsync;
+  node->seek = ext2_seek;
+  node->ioctl = ext2_ioctl;
+  node->revalidate = ext2_revalidate;
   if ((inode->permissions & EXT2_S_IFREG) == EXT2_S_IFREG) {
     node->flags |= FS_FILE;
     node->read = ext2_read;
     node->write = ext2_write;
+    node->readv = ext2_readv;
+    node->writev = ext2_writev;
   }
   if ((inode->permissions & EXT2_S_IFDIR) == EXT2_S_IFDIR) {
     node->flags |= FS_DIRECTORY;
@@ -1514,7 +3514,7 @@ static uint32_t make_fs_root(
   node->readdir = ext2_readdir;
   node->finddir = ext2_finddir;
   node->open = ext2_open;
-  node->close = ext2_close;
+  node->release = ext2_release;
   node->mkdir = ext2_mkdir;
   node->create = ext2_create;
   node->chmod = ext2_chmod;
@@ -1522,6 +3522,11 @@ static uint32_t make_fs_root(
   node->symlink = ext2_symlink;
   node->readlink = ext2_readlink;
   node->rename = ext2_rename;
+  node->sync = ext2_sync;
+  node->fsync = ext2_fsync;
+  node->seek = ext2_seek;
+  node->ioctl = ext2_ioctl;
+  node->revalidate = ext2_revalidate;
 
   return 0;
 }
@@ -1547,34 +3552,101 @@ uint32_t ext2_init(const char *dev_path)
     "Not an ext2 filesystem.",
     1
     );
+  if (e2fs->superblock->version_major) {
+    CHECK(
+      e2fs->superblock->required_features & ~EXT2_SUPPORTED_INCOMPAT,
+      "Unsupported required features.",
+      EINVAL
+      );
+    CHECK(
+      e2fs->superblock->readonly_features & ~EXT2_SUPPORTED_RO_COMPAT,
+      "Unsupported read-only features.",
+      EINVAL
+      );
+  }
   e2fs->block_size = 1024 << e2fs->superblock->block_size_offset;
+  if (e2fs->block_size != 1024) {
+    // Drop the superblock we just cached with the wrong block size.
+    res = bcache_invalidate(e2fs->block_device);
+    CHECK(res, "Failed to invalidate block cache.", res);
+  }
   e2fs->blocks_per_group = e2fs->superblock->blocks_per_group;
   e2fs->inodes_per_group = e2fs->superblock->inodes_per_group;
+  // Revision 0 filesystems always have 128-byte inodes.
+  e2fs->inode_size = e2fs->superblock->version_major
+    ? e2fs->superblock->inode_size : sizeof(ext2_inode_t);
   e2fs->group_count = e2fs->superblock->block_count / e2fs->blocks_per_group;
   if (
     e2fs->group_count * e2fs->blocks_per_group
     < e2fs->superblock->block_count
     ) ++(e2fs->group_count);
 
-  e2fs->bgd_block_count = (e2fs->group_count * sizeof(ext2_bgd_t))
+  // 64-bit filesystems can have larger group descriptors.
+  e2fs->desc_size = sizeof(ext2_bgd_t);
+  if (
+    (e2fs->superblock->required_features & EXT4_FEATURE_INCOMPAT_64BIT)
+    && e2fs->superblock->desc_size > sizeof(ext2_bgd_t)
+    ) e2fs->desc_size = e2fs->superblock->desc_size;
+  e2fs->bgd_block_count = (e2fs->group_count * e2fs->desc_size)
     / e2fs->block_size;
   if (
     e2fs->bgd_block_count * e2fs->block_size
-    < e2fs->group_count * sizeof(ext2_bgd_t)
+    < e2fs->group_count * e2fs->desc_size
     ) ++(e2fs->bgd_block_count);
-  e2fs->bgds = kmalloc(e2fs->block_size * e2fs->bgd_block_count);
-  CHECK(e2fs->bgds == NULL, "No memory.", ENOMEM);
+  uint8_t *descs = kmalloc(e2fs->block_size * e2fs->bgd_block_count);
+  CHECK(descs == NULL, "No memory.", ENOMEM);
   uint32_t bgd_block_offset = e2fs->block_size > 1024 ? 1 : 2;
   for (uint32_t i = 0; i < e2fs->bgd_block_count; ++i) {
     res = read_block(
-      e2fs,
-      bgd_block_offset + i,
-      (uint8_t *)((uint32_t)e2fs->bgds + (i * e2fs->block_size))
+      e2fs, bgd_block_offset + i, descs + (i * e2fs->block_size)
       );
     CHECK(
       res != e2fs->block_size, "Unable to read block group descriptors.", res
       );
   }
+  if (e2fs->desc_size == sizeof(ext2_bgd_t))
+    e2fs->bgds = (ext2_bgd_t *)descs;
+  else {
+    e2fs->bgd_raw = descs;
+    e2fs->bgds = kmalloc(e2fs->group_count * sizeof(ext2_bgd_t));
+    CHECK(e2fs->bgds == NULL, "No memory.", ENOMEM);
+    for (uint32_t group = 0; group < e2fs->group_count; ++group) {
+      u_memcpy(
+        &(e2fs->bgds[group]),
+        descs + (group * e2fs->desc_size),
+        sizeof(ext2_bgd_t)
+        );
+    }
+  }
+
+  uint32_t ptrs_size = e2fs->group_count * sizeof(uint8_t *);
+  uint32_t hints_size = e2fs->group_count * sizeof(uint32_t);
+  e2fs->block_bitmaps = kmalloc(ptrs_size);
+  e2fs->inode_bitmaps = kmalloc(ptrs_size);
+  e2fs->block_bitmap_dirty = kmalloc(e2fs->group_count);
+  e2fs->inode_bitmap_dirty = kmalloc(e2fs->group_count);
+  e2fs->block_hints = kmalloc(hints_size);
+  e2fs->inode_hints = kmalloc(hints_size);
+  e2fs->group_locks = kmalloc(hints_size);
+  CHECK(
+    e2fs->block_bitmaps == NULL || e2fs->inode_bitmaps == NULL
+    || e2fs->block_bitmap_dirty == NULL || e2fs->inode_bitmap_dirty == NULL
+    || e2fs->block_hints == NULL || e2fs->inode_hints == NULL
+    || e2fs->group_locks == NULL,
+    "No memory.",
+    ENOMEM
+    );
+  u_memset(e2fs->block_bitmaps, 0, ptrs_size);
+  u_memset(e2fs->inode_bitmaps, 0, ptrs_size);
+  u_memset(e2fs->block_bitmap_dirty, 0, e2fs->group_count);
+  u_memset(e2fs->inode_bitmap_dirty, 0, e2fs->group_count);
+  u_memset(e2fs->block_hints, 0, hints_size);
+  u_memset(e2fs->inode_hints, 0, hints_size);
+  u_memset((uint32_t *)e2fs->group_locks, 0, hints_size);
+
+  e2fs->icache = kmalloc(EXT2_ICACHE_SIZE * sizeof(ext2_cinode_t *));
+  CHECK(e2fs->icache == NULL, "No memory.", ENOMEM);
+  u_memset(e2fs->icache, 0, EXT2_ICACHE_SIZE * sizeof(ext2_cinode_t *));
 
   ext2_inode_t root_inode;
   res = read_inode_info(e2fs, &root_inode, 2);
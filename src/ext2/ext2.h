@@ -45,7 +45,7 @@ struct ext2_superblock_s {
   uint16_t inode_size;
   uint16_t superblock_group;
   uint32_t optional_features;
-  uint16_t required_features;
+  uint32_t required_features;
   uint32_t readonly_features;
   uint8_t fs_id[16];
   uint8_t volume_name[16];
@@ -58,18 +58,36 @@ struct ext2_superblock_s {
   uint32_t journal_inode;
   uint32_t journal_device;
   uint32_t orphan_head;
-  uint8_t unused1[788];
+  uint32_t hash_seed[4];
+  uint8_t default_hash_version;
+  uint8_t journal_backup_type;
+  uint16_t desc_size;
+  uint8_t unused1[768];
 } __attribute__((packed));
 typedef struct ext2_superblock_s ext2_superblock_t;
 
+// Features in `required_features`.
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+#define EXT4_FEATURE_INCOMPAT_EXTENTS  0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT    0x0080
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG  0x0200
+
+// Features in `readonly_features`.
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE   0x0002
+#define EXT4_FEATURE_RO_COMPAT_HUGE_FILE    0x0008
+#define EXT4_FEATURE_RO_COMPAT_DIR_NLINK    0x0020
+#define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE  0x0040
+
 struct ext2_bgd_s {
   uint32_t block_bitmap;
   uint32_t inode_bitmap;
   uint32_t inode_table;
-  uint32_t free_block_count;
-  uint32_t free_inode_count;
-  uint32_t dir_count;
-  uint8_t unused[14];
+  uint16_t free_block_count;
+  uint16_t free_inode_count;
+  uint16_t dir_count;
+  uint16_t pad;
+  uint8_t unused[12];
 } __attribute__((packed));
 typedef struct ext2_bgd_s ext2_bgd_t;
 
@@ -98,6 +116,9 @@ struct ext2_inode_s {
 } __attribute__((packed));
 typedef struct ext2_inode_s ext2_inode_t;
 
+// Inode flags.
+#define EXT4_EXTENTS_FL 0x00080000
+
 #define EXT2_S_IFSOCK 0xC000
 #define EXT2_S_IFLNK  0xA000
 #define EXT2_S_IFREG  0x8000
@@ -120,6 +141,16 @@ typedef struct ext2_inode_s ext2_inode_t;
 #define EXT2_S_IWOTH 0x0002
 #define EXT2_S_IXOTH 0x0001
 
+// Directory entry file types, used with EXT2_FEATURE_INCOMPAT_FILETYPE.
+#define EXT2_FT_UNKNOWN  0
+#define EXT2_FT_REG_FILE 1
+#define EXT2_FT_DIR      2
+#define EXT2_FT_CHRDEV   3
+#define EXT2_FT_BLKDEV   4
+#define EXT2_FT_FIFO     5
+#define EXT2_FT_SOCK     6
+#define EXT2_FT_SYMLINK  7
+
 struct ext2_dir_entry_s {
   uint32_t inode;
   uint16_t size;
@@ -129,6 +160,38 @@ struct ext2_dir_entry_s {
 } __attribute__((packed));
 typedef struct ext2_dir_entry_s ext2_dir_entry_t;
 
+// Extent trees. Inodes with the EXT4_EXTENTS_FL flag keep the root
+// of the tree in their block pointers instead of the block map. Each
+// node starts with a header, followed by index entries in interior
+// nodes or extents in leaves, sorted by logical block.
+#define EXT4_EXTENT_MAGIC 0xF30A
+
+struct ext4_extent_header_s {
+  uint16_t magic;
+  uint16_t entries;
+  uint16_t max;
+  uint16_t depth;
+  uint32_t generation;
+} __attribute__((packed));
+typedef struct ext4_extent_header_s ext4_extent_header_t;
+
+// Extents longer than 32768 blocks are unwritten.
+struct ext4_extent_s {
+  uint32_t block;
+  uint16_t len;
+  uint16_t start_hi;
+  uint32_t start_lo;
+} __attribute__((packed));
+typedef struct ext4_extent_s ext4_extent_t;
+
+struct ext4_extent_idx_s {
+  uint32_t block;
+  uint32_t leaf_lo;
+  uint16_t leaf_hi;
+  uint16_t unused;
+} __attribute__((packed));
+typedef struct ext4_extent_idx_s ext4_extent_idx_t;
+
 uint32_t ext2_init(const char *);
 
 #endif /* _EXT2_H_ */
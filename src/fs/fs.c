@@ -14,6 +14,9 @@
 #include <util/util.h>
 #include <debug/log.h>
 #include <process/process.h>
+#include <interrupt/interrupt.h>
+#include <pit/pit.h>
+#include <sys/uio.h>
 #include "fs.h"
 
 #define CHECK(err, msg, code) if ((err)) {      \
@@ -28,10 +31,237 @@
 static tree_node_t *fs_tree = NULL;
 static volatile uint32_t fs_lock = 0;
 
+// Mount table. Every node of the mountpoint tree but the root is
+// indexed by its parent and name, so walking a path through the tree
+// costs one hash lookup per segment. Nodes with no children in the
+// tree have nothing mounted below them and skip the table entirely.
+// Mounts are never removed, so lookups don't take a lock.
+typedef struct fs_mount_s {
+  tree_node_t *parent;
+  tree_node_t *node;
+  struct fs_mount_s *next;
+} fs_mount_t;
+
+#define FS_MOUNT_BUCKETS 64
+static fs_mount_t *mount_table[FS_MOUNT_BUCKETS];
+
+// Shared nodes of open files, by device and inode number, so that
+// every open of a file refers to the same node. Each open file and
+// mount holds a reference; mount points are never freed.
+#define FS_VNODE_BUCKETS 128
+static fs_node_t *vnode_table[FS_VNODE_BUCKETS];
+static volatile uint32_t vnode_lock = 0;
+
+// Interval between write-backs of the flusher thread, in ms.
+static const uint32_t FS_FLUSH_INTERVAL = 5000;
+
+// Dentry cache. Names looked up in directories of filesystems that can
+// revalidate their nodes are cached by (device, directory inode, name),
+// along with names that were not found. Cached nodes are revalidated on
+// every hit, so their attributes are never stale. Entries are dropped
+// when names are created or removed, and the whole cache is dropped on
+// rename and mount. `dcache_generation` changes with every drop, so a
+// lookup that raced with one doesn't cache its result.
+typedef struct fs_dentry_s {
+  void *device;
+  uint32_t parent;
+  uint8_t negative;
+  fs_node_t node;
+  struct fs_dentry_s *hash_next;
+  struct fs_dentry_s *lru_prev;
+  struct fs_dentry_s *lru_next;
+} fs_dentry_t;
+
+#define FS_DCACHE_BUCKETS 256
+static const uint32_t FS_DCACHE_SIZE = 512;
+static fs_dentry_t *dcache[FS_DCACHE_BUCKETS];
+static fs_dentry_t *dcache_lru_head = NULL;
+static fs_dentry_t *dcache_lru_tail = NULL;
+static uint32_t dcache_count = 0;
+static uint32_t dcache_generation = 0;
+static volatile uint32_t dcache_lock = 0;
+
+static uint32_t dcache_hash(void *device, uint32_t parent, const char *name)
+{
+  uint32_t h = 2166136261u ^ (uint32_t)device ^ (parent * 16777619u);
+  for (; *name; ++name) h = (h ^ (uint8_t)*name) * 16777619u;
+  return h % FS_DCACHE_BUCKETS;
+}
+
+// Find an entry and move it to the front of the LRU list. Must be
+// called with dcache_lock held.
+static fs_dentry_t *dcache_find(fs_node_t *dir, const char *name)
+{
+  fs_dentry_t *e = dcache[dcache_hash(dir->device, dir->inode, name)];
+  for (; e; e = e->hash_next) {
+    if (e->device == dir->device && e->parent == dir->inode
+        && u_strcmp(e->node.name, name) == 0)
+      break;
+  }
+  if (e == NULL || e == dcache_lru_head) return e;
+
+  e->lru_prev->lru_next = e->lru_next;
+  if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+  else dcache_lru_tail = e->lru_prev;
+  e->lru_prev = NULL;
+  e->lru_next = dcache_lru_head;
+  dcache_lru_head->lru_prev = e;
+  dcache_lru_head = e;
+  return e;
+}
+
+// Unlink an entry from the table and the LRU list and free it. Must be
+// called with dcache_lock held.
+static void dcache_remove(fs_dentry_t *e)
+{
+  fs_dentry_t **link =
+    &(dcache[dcache_hash(e->device, e->parent, e->node.name)]);
+  for (; *link != e; link = &((*link)->hash_next));
+  *link = e->hash_next;
+  if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+  else dcache_lru_head = e->lru_next;
+  if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+  else dcache_lru_tail = e->lru_prev;
+  --dcache_count;
+  kfree(e);
+}
+
+// Cache the result of looking up a name, evicting the least recently
+// used entry if the cache is full. `child` is NULL if the name does not
+// exist. Nothing is cached if an entry was dropped since `generation`.
+static void dcache_insert(
+  fs_node_t *dir, const char *name, fs_node_t *child, uint32_t generation
+  )
+{
+  uint32_t len = u_strlen(name);
+  if (len >= FS_NAME_LEN) return;
+  fs_dentry_t *e = kmalloc(sizeof(fs_dentry_t));
+  if (e == NULL) return;
+  e->device = dir->device;
+  e->parent = dir->inode;
+  e->negative = child == NULL;
+  if (child) u_memcpy(&(e->node), child, sizeof(fs_node_t));
+  else u_memset(&(e->node), 0, sizeof(fs_node_t));
+  u_memcpy(e->node.name, name, len + 1);
+
+  klock(&dcache_lock);
+  if (generation != dcache_generation || dcache_find(dir, name)) {
+    kunlock(&dcache_lock); kfree(e); return;
+  }
+  if (dcache_count >= FS_DCACHE_SIZE) dcache_remove(dcache_lru_tail);
+  uint32_t h = dcache_hash(e->device, e->parent, name);
+  e->hash_next = dcache[h];
+  dcache[h] = e;
+  e->lru_prev = NULL;
+  e->lru_next = dcache_lru_head;
+  if (dcache_lru_head) dcache_lru_head->lru_prev = e;
+  else dcache_lru_tail = e;
+  dcache_lru_head = e;
+  ++dcache_count;
+  kunlock(&dcache_lock);
+}
+
+// Drop the entry for a name, and every entry in the directory with
+// inode `dir_inode` if it isn't 0.
+static void dcache_forget(fs_node_t *dir, const char *name, uint32_t dir_inode)
+{
+  klock(&dcache_lock);
+  ++dcache_generation;
+  fs_dentry_t *e = dcache_find(dir, name);
+  if (e) dcache_remove(e);
+  if (dir_inode) {
+    for (uint32_t i = 0; i < FS_DCACHE_BUCKETS; ++i) {
+      fs_dentry_t *next = NULL;
+      for (e = dcache[i]; e; e = next) {
+        next = e->hash_next;
+        if (e->device == dir->device && e->parent == dir_inode)
+          dcache_remove(e);
+      }
+    }
+  }
+  kunlock(&dcache_lock);
+}
+
+static void dcache_clear()
+{
+  klock(&dcache_lock);
+  ++dcache_generation;
+  while (dcache_lru_head) dcache_remove(dcache_lru_head);
+  kunlock(&dcache_lock);
+}
+
+// Look a name up in the dentry cache. Returns a copy of the cached
+// node, or NULL with `*negative` set if the name is known not to exist.
+static fs_node_t *dcache_lookup(
+  fs_node_t *dir, const char *name, uint8_t *negative
+  )
+{
+  *negative = 0;
+  klock(&dcache_lock);
+  fs_dentry_t *e = dcache_find(dir, name);
+  if (e == NULL || e->negative) {
+    *negative = e != NULL;
+    kunlock(&dcache_lock);
+    return NULL;
+  }
+  fs_node_t *node = kmalloc(sizeof(fs_node_t));
+  if (node) u_memcpy(node, &(e->node), sizeof(fs_node_t));
+  kunlock(&dcache_lock);
+
+  if (node && node->revalidate && node->revalidate(node)) {
+    kfree(node);
+    dcache_forget(dir, name, 0);
+    return NULL;
+  }
+  return node;
+}
+
+static uint32_t mount_hash(tree_node_t *parent, const char *name)
+{
+  uint32_t h = 2166136261u ^ (uint32_t)parent;
+  for (; *name; ++name) h = (h ^ (uint8_t)*name) * 16777619u;
+  return h % FS_MOUNT_BUCKETS;
+}
+
+// Find the node mounted at `name` in the mountpoint tree node `parent`.
+static tree_node_t *mount_find(tree_node_t *parent, const char *name)
+{
+  if (parent->children->size == 0) return NULL;
+  fs_mount_t *m = mount_table[mount_hash(parent, name)];
+  for (; m; m = m->next) {
+    fs_node_t *ent = m->node->value;
+    if (m->parent == parent && ent && u_strcmp(ent->name, name) == 0)
+      return m->node;
+  }
+  return NULL;
+}
+
+// Add a node to the mount table. Must be called with fs_lock held,
+// after the node is in the tree.
+static uint32_t mount_insert(tree_node_t *parent, tree_node_t *node)
+{
+  fs_mount_t *m = kmalloc(sizeof(fs_mount_t));
+  CHECK(m == NULL, "No memory.", ENOMEM);
+  fs_node_t *ent = node->value;
+  uint32_t h = mount_hash(parent, ent->name);
+  m->parent = parent;
+  m->node = node;
+  m->next = mount_table[h];
+  mount_table[h] = m;
+  return 0;
+}
+
 void fs_open(fs_node_t *node, uint32_t flags)
 { if (node && node->open) node->open(node, flags); }
+// Close a node. A copy from fs_open_node isn't shared, so its per-file
+// state is released here too. Shared nodes release theirs with the
+// last reference (see fs_vnode_put).
 void fs_close(fs_node_t *node)
-{ if (node && node->close) node->close(node); }
+{
+  if (node == NULL) return;
+  if (node->close) node->close(node);
+  if (node->refcount == 0 && node->release) node->release(node);
+}
 int32_t fs_read(
   fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer
   )
@@ -93,18 +323,20 @@ fs_node_t *fs_finddir(fs_node_t *node, char *name)
     return NULL;
 
   if (node->tree_node) {
-    tree_node_t *tnode = node->tree_node;
-    list_foreach(lchild, tnode->children) {
-      tree_node_t *tchild = lchild->value;
-      fs_node_t *fschild = tchild->value;
-      if (u_strcmp(fschild->name, name) == 0)
-        return fschild;
-    }
+    tree_node_t *tchild = mount_find(node->tree_node, name);
+    if (tchild) return tchild->value;
   }
 
-  if (node->finddir)
-    return node->finddir(node, name);
-  return NULL;
+  if (node->finddir == NULL) return NULL;
+  if (node->revalidate == NULL) return node->finddir(node, name);
+
+  uint8_t negative = 0;
+  fs_node_t *child = dcache_lookup(node, name, &negative);
+  if (child || negative) return child;
+  uint32_t generation = dcache_generation;
+  child = node->finddir(node, name);
+  dcache_insert(node, name, child, generation);
+  return child;
 }
 int32_t fs_chmod(fs_node_t *node, int32_t mask)
 {
@@ -117,266 +349,271 @@ int32_t fs_readlink(fs_node_t *node, char *buf, size_t bufsize)
   if (node && node->readlink) return node->readlink(node, buf, bufsize);
   return -ENODEV;
 }
+int32_t fs_fsync(fs_node_t *node, uint32_t datasync)
+{
+  if (node && node->fsync) return node->fsync(node, datasync);
+  return 0;
+}
 
-// Resolve a (relative) path.
-uint32_t resolve_path(char **outpath, const char *inpath)
+// Find the next data (SEEK_DATA) or hole (SEEK_HOLE) at or after an
+// offset. Files without holes are all data up to their end.
+int32_t fs_seek(fs_node_t *node, uint32_t offset, uint32_t whence)
 {
-  process_t *current = process_current();
-  uint32_t path_len = u_strlen(inpath);
-  char *path = kmalloc(path_len + 1);
-  CHECK(path == NULL, "No memory.", ENOMEM);
-  u_memcpy(path, inpath, path_len + 1);
-  for (; path[path_len - 1] == FS_PATH_SEP && path_len > 1; --path_len);
-  path[path_len] = '\0';
-  for (uint32_t i = 0; i < path_len; ++i)
-    if (path[i] == FS_PATH_SEP) path[i] = '\0';
+  if (node == NULL) return -ENODEV;
+  if (node->seek) return node->seek(node, offset, whence);
+  if (offset >= node->length) return -ENXIO;
+  return whence == SEEK_DATA ? offset : node->length;
+}
 
-  list_t *stack = kmalloc(sizeof(list_t));
-  CHECK(stack == NULL, "No memory.", ENOMEM);
-  u_memset(stack, 0, sizeof(list_t));
-
-  if (path[0] != '\0') {
-    if (current == NULL) { kfree(path); return 1; }
-    char *wd = kmalloc(u_strlen(current->wd) + 1);
-    CHECK(wd == NULL, "No memory.", ENOMEM);
-    u_memcpy(wd, current->wd, u_strlen(current->wd) + 1);
-    uint32_t wd_len = u_strlen(wd);
-    for (uint32_t i = 0; i < wd_len; ++i)
-      if (wd[i] == FS_PATH_SEP) wd[i] = '\0';
-    for (uint32_t i = 0; i < wd_len; i += u_strlen(wd + i) + 1) {
-      char *segment = kmalloc(u_strlen(wd + i) + 1);
-      CHECK(segment == NULL, "No memory.", ENOMEM);
-      u_memcpy(segment, wd + i, u_strlen(wd + i) + 1);
-      list_push_back(stack, segment);
-    }
-    kfree(wd);
+int32_t fs_ioctl(fs_node_t *node, uint32_t request, void *arg)
+{
+  if (node == NULL) return -ENODEV;
+  if (node->ioctl) return node->ioctl(node, request, arg);
+  return -ENOTTY;
+}
+
+// Read into or write from several buffers, which cover consecutive
+// ranges of the file starting at `offset`. Nodes without vectored
+// operations get one read or write per buffer, stopping at the first
+// short one.
+int32_t fs_readv(
+  fs_node_t *node, uint32_t offset, struct iovec *iov, uint32_t count
+  )
+{
+  if (node && node->readv) return node->readv(node, offset, iov, count);
+  if (node == NULL || node->read == NULL) return -ENODEV;
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    int32_t res = node->read(
+      node, offset + total, iov[i].iov_len, iov[i].iov_base
+      );
+    if (res < 0) return total ? (int32_t)total : res;
+    total += res;
+    if ((uint32_t)res < iov[i].iov_len) break;
   }
+  return total;
+}
+int32_t fs_writev(
+  fs_node_t *node, uint32_t offset, struct iovec *iov, uint32_t count
+  )
+{
+  if (node && node->writev) return node->writev(node, offset, iov, count);
+  if (node == NULL || node->write == NULL) return -ENODEV;
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    int32_t res = node->write(
+      node, offset + total, iov[i].iov_len, iov[i].iov_base
+      );
+    if (res < 0) return total ? (int32_t)total : res;
+    total += res;
+    if ((uint32_t)res < iov[i].iov_len) break;
+  }
+  return total;
+}
+
+// Scratch space for canonical paths. Each process has its own, since a
+// process can be preempted in the middle of a system call; the boot
+// buffer is used before the first process exists.
+static char boot_path_buf[FS_PATH_MAX];
 
-  for (uint32_t i = 0; i < path_len; i += u_strlen(path + i) + 1) {
-    char *segment = kmalloc(u_strlen(path + i) + 1);
-    CHECK(segment == NULL, "No memory.", ENOMEM);
-    u_memcpy(segment, path + i, u_strlen(path + i) + 1);
-    list_push_back(stack, segment);
-    if (u_strcmp(segment, FS_DIR_SELF) == 0)
-      list_pop_back(stack);
-    else if (u_strcmp(segment, FS_DIR_UP) == 0) {
-      list_pop_back(stack);
-      CHECK(stack->size == 0, "Cannot go up from root directory.", 1);
-      list_pop_back(stack);
+static char *path_buffer()
+{
+  process_t *current = process_current();
+  if (current == NULL) return boot_path_buf;
+  if (current->path_buf == NULL) current->path_buf = kmalloc(FS_PATH_MAX);
+  return current->path_buf;
+}
+
+// Append the segments of a path to a canonical path of length `*len`.
+// `stack` holds the length of the path before each segment was added,
+// so `..` just truncates it.
+static uint32_t push_segments(
+  char *out, uint32_t *len, uint16_t *stack, uint32_t *depth,
+  const char *path
+  )
+{
+  while (*path) {
+    for (; *path == FS_PATH_SEP; ++path);
+    if (*path == '\0') break;
+    const char *end = path;
+    for (; *end && *end != FS_PATH_SEP; ++end);
+    uint32_t seg_len = end - path;
+
+    if (seg_len == 1 && path[0] == '.') {
+      path = end; continue;
+    }
+    if (seg_len == 2 && path[0] == '.' && path[1] == '.') {
+      if (*depth) *len = stack[--(*depth)];
+      path = end; continue;
     }
-  }
 
-  uint32_t total_length = 0;
-  list_foreach(segment, stack) {
-    total_length += u_strlen((char *)segment->value);
-    if (segment->next || stack->size == 1) ++total_length;
+    if (*depth >= FS_PATH_DEPTH) return ENAMETOOLONG;
+    if (*len + seg_len + 2 > FS_PATH_MAX) return ENAMETOOLONG;
+    stack[(*depth)++] = *len;
+    if (*len > 1) out[(*len)++] = FS_PATH_SEP;
+    u_memcpy(out + *len, path, seg_len);
+    *len += seg_len;
+    path = end;
   }
 
-  *outpath = kmalloc(total_length + 1);
-  CHECK(*outpath == NULL, "No memory.", ENOMEM);
-  uint32_t i = 0;
-  list_foreach(segment, stack) {
-    uint32_t len = u_strlen((char *)segment->value);
-    u_memcpy((*outpath) + i, (char *)segment->value, len);
-    i += len;
-    if (segment->next || stack->size == 1)
-      (*outpath)[i] = FS_PATH_SEP;
-    ++i;
+  return 0;
+}
+
+// Canonicalize a (relative) path into `out`, which must hold
+// FS_PATH_MAX bytes. The result is absolute and has no `.`, `..` or
+// empty segments. `..` at the root stays at the root.
+uint32_t fs_canonicalize(char *out, const char *inpath)
+{
+  uint16_t stack[FS_PATH_DEPTH];
+  uint32_t depth = 0;
+  uint32_t len = 1;
+  out[0] = FS_PATH_SEP;
+
+  if (inpath[0] != FS_PATH_SEP) {
+    process_t *current = process_current();
+    if (current == NULL) return ENOENT;
+    uint32_t res = push_segments(out, &len, stack, &depth, current->wd);
+    if (res) return res;
   }
-  (*outpath)[total_length] = '\0';
 
-  list_destroy(stack);
-  kfree(path);
+  uint32_t res = push_segments(out, &len, stack, &depth, inpath);
+  if (res) return res;
+  out[len] = '\0';
   return 0;
 }
 
-// Create a symlink `dst` to `src`.
-int32_t fs_symlink(char *src, char *dst)
+// Resolve a (relative) path into a newly allocated string.
+uint32_t resolve_path(char **outpath, const char *inpath)
 {
-  char *dstpath;
-  uint32_t res = resolve_path(&dstpath, dst);
-  CHECK(res, "Could not resolve path.", -res);
+  char *path = path_buffer();
+  CHECK(path == NULL, "No memory.", ENOMEM);
+  uint32_t res = fs_canonicalize(path, inpath);
+  if (res) return res;
 
-  char *basename = dstpath + u_strlen(dstpath) - 1;
-  for (; *basename != FS_PATH_SEP && basename > dstpath; --basename);
-  if (*basename == FS_PATH_SEP) ++basename;
+  uint32_t len = u_strlen(path);
+  *outpath = kmalloc(len + 1);
+  CHECK(*outpath == NULL, "No memory.", ENOMEM);
+  u_memcpy(*outpath, path, len + 1);
+  return 0;
+}
 
-  char *parent_path = kmalloc(basename - dstpath + 1);
-  CHECK(parent_path == NULL, "No memory.", -ENOMEM);
-  u_memcpy(parent_path, dstpath, basename - dstpath);
-  parent_path[basename - dstpath] = '\0';
+static uint32_t open_path(fs_node_t *, char *, size_t, uint32_t);
+
+// Canonicalize a path in the scratch buffer and open its parent
+// directory. `basename` is left pointing at the last segment.
+static uint32_t open_parent(
+  fs_node_t *parent, const char *path, char **basename
+  )
+{
+  char *rpath = path_buffer();
+  CHECK(rpath == NULL, "No memory.", ENOMEM);
+  uint32_t res = fs_canonicalize(rpath, path);
+  CHECK(res, "Could not resolve path.", res);
+
+  char *base = rpath + u_strlen(rpath);
+  for (; base > rpath && base[-1] != FS_PATH_SEP; --base);
+  *basename = base;
+  return open_path(parent, rpath, base - rpath, 0);
+}
+
+// Create a symlink `dst` to `src`.
+int32_t fs_symlink(char *src, char *dst)
+{
+  // `src` is resolved first, since `dst` lives in the scratch buffer.
+  char *rsrc;
+  uint32_t res = resolve_path(&rsrc, src);
+  CHECK(res, "Failed to resolve path.", -res);
 
   fs_node_t *parent = kmalloc(sizeof(fs_node_t));
   CHECK(parent == NULL, "No memory.", -ENOMEM);
-  res = fs_open_node(parent, parent_path, 0);
+  char *basename;
+  res = open_parent(parent, dst, &basename);
   if (res) {
     kfree(parent);
-    kfree(parent_path);
-    kfree(dstpath);
+    kfree(rsrc);
     return -res;
   }
 
+  int32_t ret = 0;
   if (parent->symlink) {
-    char *rsrc;
-    res = resolve_path(&rsrc, src);
-    CHECK(res, "Failed to resolve path.", -res);
-    res = parent->symlink(parent, rsrc, basename);
-    kfree(parent);
-    kfree(parent_path);
-    kfree(dstpath);
-    kfree(rsrc);
-    return res;
+    ret = parent->symlink(parent, rsrc, basename);
+    dcache_forget(parent, basename, 0);
   }
 
   kfree(parent);
-  kfree(parent_path);
-  kfree(dstpath);
-  return 0;
+  kfree(rsrc);
+  return ret;
 }
 
 int32_t fs_mkdir(char *path, uint16_t mask)
 {
-  char *rpath;
-  uint32_t res = resolve_path(&rpath, path);
-  CHECK(res, "Could not resolve path.", -res);
-
-  char *basename = rpath + u_strlen(rpath) - 1;
-  for (; *basename != FS_PATH_SEP && basename > rpath; --basename);
-  if (*basename == FS_PATH_SEP) ++basename;
-
-  char *parent_path = kmalloc(basename - rpath + 1);
-  CHECK(parent_path == NULL, "No memory.", -ENOMEM);
-  u_memcpy(parent_path, rpath, basename - rpath);
-  parent_path[basename - rpath] = '\0';
-
   fs_node_t *parent = kmalloc(sizeof(fs_node_t));
   CHECK(parent == NULL, "No memory.", -ENOMEM);
-  res = fs_open_node(parent, parent_path, 0);
-  if (res) {
-    kfree(parent_path);
-    kfree(parent);
-    kfree(rpath);
-    return -res;
-  }
+  char *basename;
+  uint32_t res = open_parent(parent, path, &basename);
+  if (res) { kfree(parent); return -res; }
 
+  int32_t ret = 0;
   if (parent->mkdir) {
-    res = parent->mkdir(parent, basename, mask);
-    kfree(parent_path);
-    kfree(parent);
-    kfree(rpath);
-    return res;
+    ret = parent->mkdir(parent, basename, mask);
+    dcache_forget(parent, basename, 0);
   }
 
-  kfree(parent_path);
   kfree(parent);
-  kfree(rpath);
-  return 0;
+  return ret;
 }
 
 // TODO Make create and mkdir one function.
 int32_t fs_create(char *path, uint16_t mask)
 {
-  char *rpath;
-  uint32_t res = resolve_path(&rpath, path);
-  CHECK(res, "Could not resolve path.", -res);
-
-  char *basename = rpath + u_strlen(rpath) - 1;
-  for (; *basename != FS_PATH_SEP && basename > rpath; --basename);
-  if (*basename == FS_PATH_SEP) ++basename;
-
-  char *parent_path = kmalloc(basename - rpath + 1);
-  CHECK(parent_path == NULL, "No memory.", -ENOMEM);
-  u_memcpy(parent_path, rpath, basename - rpath);
-  parent_path[basename - rpath] = '\0';
-
   fs_node_t *parent = kmalloc(sizeof(fs_node_t));
   CHECK(parent == NULL, "No memory.", -ENOMEM);
-  res = fs_open_node(parent, parent_path, 0);
-  if (res) {
-    kfree(parent_path);
-    kfree(parent);
-    kfree(rpath);
-    return -res;
-  }
+  char *basename;
+  uint32_t res = open_parent(parent, path, &basename);
+  if (res) { kfree(parent); return -res; }
 
+  int32_t ret = 0;
   if (parent->create) {
-    res = parent->create(parent, basename, mask);
-    kfree(parent_path);
-    kfree(parent);
-    kfree(rpath);
-    return res;
+    ret = parent->create(parent, basename, mask);
+    dcache_forget(parent, basename, 0);
   }
 
-  kfree(parent_path);
   kfree(parent);
-  kfree(rpath);
-  return 0;
+  return ret;
 }
 
 int32_t fs_unlink(char *path)
 {
-  char *rpath;
-  uint32_t res = resolve_path(&rpath, path);
-  CHECK(res, "Could not resolve path.", -res);
-
-  char *basename = rpath + u_strlen(rpath) - 1;
-  for (; *basename != FS_PATH_SEP && basename > rpath; --basename);
-  if (*basename == FS_PATH_SEP) ++basename;
-
-  char *parent_path = kmalloc(basename - rpath + 1);
-  CHECK(parent_path == NULL, "No memory.", -ENOMEM);
-  u_memcpy(parent_path, rpath, basename - rpath);
-  parent_path[basename - rpath] = '\0';
-
   fs_node_t *parent = kmalloc(sizeof(fs_node_t));
   CHECK(parent == NULL, "No memory.", -ENOMEM);
-  res = fs_open_node(parent, parent_path, 0);
-  if (res) {
-    kfree(parent_path);
-    kfree(parent);
-    kfree(rpath);
-    return -res;
-  }
+  char *basename;
+  uint32_t res = open_parent(parent, path, &basename);
+  if (res) { kfree(parent); return -res; }
 
+  int32_t ret = 0;
   if (parent->unlink) {
-    res = parent->unlink(parent, basename);
-    kfree(parent_path);
-    kfree(parent);
-    kfree(rpath);
-    return res;
+    // Removing a directory drops the cached names in it too.
+    fs_node_t *child = fs_finddir(parent, basename);
+    uint32_t dir_inode = 0;
+    if (child && (child->flags & FS_DIRECTORY)) dir_inode = child->inode;
+    if (child && child->tree_node == NULL) kfree(child);
+    ret = parent->unlink(parent, basename);
+    dcache_forget(parent, basename, dir_inode);
   }
 
-  kfree(parent_path);
   kfree(parent);
-  kfree(rpath);
-  return 0;
+  return ret;
 }
 
 int32_t fs_rename(char *old, char *new)
 {
-  char *oldpath;
-  uint32_t res = resolve_path(&oldpath, old);
-  CHECK(res, "Could not resolve path.", -res);
-
-  char *basename = oldpath + u_strlen(oldpath) - 1;
-  for (; *basename != FS_PATH_SEP && basename > oldpath; --basename);
-  if (*basename == FS_PATH_SEP) ++basename;
-
-  char *parent_path = kmalloc(basename - oldpath + 1);
-  CHECK(parent_path == NULL, "No memory.", -ENOMEM);
-  u_memcpy(parent_path, oldpath, basename - oldpath);
-  parent_path[basename - oldpath] = '\0';
-
   fs_node_t *parent = kmalloc(sizeof(fs_node_t));
   CHECK(parent == NULL, "No memory.", -ENOMEM);
-  res = fs_open_node(parent, parent_path, 0);
-  if (res) {
-    kfree(parent);
-    kfree(parent_path);
-    kfree(oldpath);
-    return -res;
-  }
+  char *basename;
+  uint32_t res = open_parent(parent, old, &basename);
+  if (res) { kfree(parent); return -res; }
 
+  int32_t ret = 0;
   if (parent->rename) {
     uint32_t len = u_strlen(new);
     char *newname = kmalloc(len + 1);
@@ -389,18 +626,13 @@ int32_t fs_rename(char *old, char *new)
     if (*nbasename == FS_PATH_SEP && nbasename[1]) ++nbasename;
     if (*nbasename == FS_PATH_SEP) *nbasename = ':';
 
-    res = parent->rename(parent, basename, nbasename);
-    kfree(parent);
-    kfree(parent_path);
-    kfree(oldpath);
+    ret = parent->rename(parent, basename, nbasename);
+    dcache_clear();
     kfree(newname);
-    return res;
   }
 
   kfree(parent);
-  kfree(parent_path);
-  kfree(oldpath);
-  return 0;
+  return ret;
 }
 
 static fs_node_t *vfs_node_create()
@@ -410,6 +642,7 @@ static fs_node_t *vfs_node_create()
   u_memset(node, 0, sizeof(fs_node_t));
   node->mask = 0555;
   node->flags = FS_DIRECTORY;
+  node->refcount = 1;
   return node;
 }
 
@@ -433,10 +666,10 @@ uint32_t fs_mount(fs_node_t *local_root, const char *path)
     );
 
   klock(&fs_lock);
-
-  char *mpath;
-  uint32_t res = resolve_path(&mpath, path);
-  CHECK(res, "Failed to resolve path.", res);
+  char *mpath = path_buffer();
+  CHECK_UNLOCK(mpath == NULL, "No memory.", ENOMEM);
+  uint32_t res = fs_canonicalize(mpath, path);
+  CHECK_UNLOCK(res, "Failed to resolve path.", res);
   size_t path_len = u_strlen(mpath);
   for (size_t i = 0; i < path_len; ++i)
     if (mpath[i] == FS_PATH_SEP) mpath[i] = '\0';
@@ -448,18 +681,9 @@ uint32_t fs_mount(fs_node_t *local_root, const char *path)
     path_idx += u_strlen(mpath + path_idx) + 1
     )
   {
-    uint8_t found = 0;
-    list_foreach(lchild, node->children) {
-      tree_node_t *child = (tree_node_t *)(lchild->value);
-      fs_node_t *ent = (fs_node_t *)(child->value);
-      if (u_strcmp(ent->name, mpath + path_idx) == 0) {
-        found = 1;
-        node = child;
-        break;
-      }
-    }
-
-    if (found == 0) {
+    tree_node_t *found = mount_find(node, mpath + path_idx);
+    if (found) node = found;
+    else {
       fs_node_t *vfs_node = NULL;
       if (path_idx + u_strlen(mpath + path_idx) + 1 < path_len) {
         vfs_node = vfs_node_create();
@@ -471,6 +695,8 @@ uint32_t fs_mount(fs_node_t *local_root, const char *path)
       tree_node_t *child = tree_init(vfs_node);
       vfs_node->tree_node = child;
       tree_insert(node, child);
+      res = mount_insert(node, child);
+      CHECK_UNLOCK(res, "Could not add mount point.", res);
       node = child;
     }
   }
@@ -481,8 +707,10 @@ uint32_t fs_mount(fs_node_t *local_root, const char *path)
     u_memcpy(local_root->name, "/", 2);
   }
 
-  kfree(mpath);
+  // Mounted nodes stay referenced so that they are never freed.
+  ++(local_root->refcount);
   kunlock(&fs_lock);
+  dcache_clear();
   return 0;
 }
 
@@ -493,21 +721,11 @@ static fs_node_t *get_mount_point(
 {
   size_t path_idx = 1;
   tree_node_t *node = fs_tree;
-  uint8_t found = 1;
-  while (found && path_idx < path_len) {
-    found = 0;
-    list_foreach(lchild, node->children) {
-      tree_node_t *child = (tree_node_t *)(lchild->value);
-      fs_node_t *ent = (fs_node_t *)(child->value);
-      if (!ent) continue;
-
-      if (u_strcmp(ent->name, path + path_idx) == 0) {
-        node = child;
-        path_idx += u_strlen(path + path_idx) + 1;
-        found = 1;
-        break;
-      }
-    }
+  while (path_idx < path_len) {
+    tree_node_t *child = mount_find(node, path + path_idx);
+    if (child == NULL) break;
+    node = child;
+    path_idx += u_strlen(path + path_idx) + 1;
   }
 
   fs_node_t *ent = (fs_node_t *)(node->value);
@@ -516,8 +734,12 @@ static fs_node_t *get_mount_point(
   return ent;
 }
 
-// Open the filesystem node at a path.
-uint32_t fs_open_node(fs_node_t *out_node, const char *path, uint32_t flags)
+// Find the node at the first `path_len` bytes of a canonical path.
+// Only that part of `path` is modified, so anything after it survives.
+// The node is allocated unless it is a mount point.
+static uint32_t walk_path(
+  fs_node_t **out_node, char *path, size_t path_len, uint32_t flags
+  )
 {
   CHECK(
     fs_tree == NULL,
@@ -525,64 +747,269 @@ uint32_t fs_open_node(fs_node_t *out_node, const char *path, uint32_t flags)
     ENXIO
     );
 
-  char *mpath;
-  uint32_t res = resolve_path(&mpath, path);
-  CHECK(res, "Failed to resolve path.", res);
-  size_t path_len = u_strlen(mpath);
   for (size_t i = 0; i < path_len; ++i)
-    if (mpath[i] == FS_PATH_SEP) mpath[i] = '\0';
+    if (path[i] == FS_PATH_SEP) path[i] = '\0';
+
+  // Symlinks are expanded into a separate buffer.
+  char *mpath = path;
+  char *expanded = NULL;
 
   size_t path_idx = 0;
   fs_node_t *mount_point = get_mount_point(mpath, path_len, &path_idx);
-  if (mount_point == NULL) { kfree(mpath); return ENOENT; }
+  if (mount_point == NULL) return ENOENT;
 
   fs_node_t *node = mount_point;
   while (path_idx < path_len) {
     if ((node->flags & FS_SYMLINK) && (flags & O_NOFOLLOW) == 0) {
-      char *target = kmalloc(1024);
+      char *target = kmalloc(FS_PATH_MAX);
       CHECK(target == NULL, "No memory.", ENOMEM);
+      char *rtarget = kmalloc(FS_PATH_MAX);
+      if (rtarget == NULL) { kfree(target); kfree(expanded); return ENOMEM; }
 
-      int32_t sres = fs_readlink(node, target, 1024);
-      if (sres < 0) { kfree(target); kfree(mpath); return -sres; }
-      char *rtarget = NULL;
-      res = resolve_path(&rtarget, target);
-      if (res) {
-        kfree(rtarget); kfree(target); kfree(mpath);
-        return res;
-      }
+      int32_t sres = fs_readlink(node, target, FS_PATH_MAX);
+      uint32_t res = sres < 0 ? -sres : 0;
+      if (res == 0 && sres >= FS_PATH_MAX) res = ENAMETOOLONG;
+      if (res == 0) res = fs_canonicalize(rtarget, target);
+      kfree(target);
 
       uint32_t rpath_len = u_strlen(rtarget);
+      if (res == 0 && rpath_len + 1 + path_len - path_idx >= FS_PATH_MAX)
+        res = ENAMETOOLONG;
+      if (res) { kfree(rtarget); kfree(expanded); return res; }
+
       for (size_t i = 0; i < rpath_len; ++i)
         if (rtarget[i] == FS_PATH_SEP) rtarget[i] = '\0';
-
-      if (rpath_len >= 1024) {
-        kfree(mpath); kfree(target); kfree(rtarget);
-        return ENOENT;
-      }
-
-      u_memset(target, 0, 1024);
-      u_memcpy(target, rtarget, rpath_len);
-      u_memcpy(target + rpath_len + 1, mpath + path_idx, path_len - path_idx);
+      u_memcpy(rtarget + rpath_len + 1, mpath + path_idx, path_len - path_idx);
+      rtarget[rpath_len + 1 + path_len - path_idx] = '\0';
 
       path_len += rpath_len - path_idx + 1;
       path_idx = 0;
-      kfree(mpath); mpath = target;
-      kfree(rtarget);
+      kfree(expanded);
+      expanded = rtarget;
+      mpath = expanded;
 
       mount_point = get_mount_point(mpath, path_len, &path_idx);
-      if (mount_point == NULL) { kfree(mpath); return ENOENT; }
+      if (mount_point == NULL) { kfree(expanded); return ENOENT; }
       node = mount_point;
     }
 
     fs_node_t *new_node = fs_finddir(node, mpath + path_idx);
     if (node != mount_point) kfree(node); // Not sure about this.
     node = new_node;
-    if (node == NULL) { kfree(mpath); return ENOENT; }
+    if (node == NULL) { kfree(expanded); return ENOENT; }
     path_idx += u_strlen(mpath + path_idx) + 1;
   }
 
+  kfree(expanded);
+  *out_node = node;
+  return 0;
+}
+
+// Open a copy of the node at the first `path_len` bytes of a canonical
+// path. The copy has no open file state and no references.
+static uint32_t open_path(
+  fs_node_t *out_node, char *path, size_t path_len, uint32_t flags
+  )
+{
+  fs_node_t *node = NULL;
+  uint32_t res = walk_path(&node, path, path_len, flags);
+  if (res) return res;
+
   fs_open(node, flags & (~O_CREAT));
   u_memcpy(out_node, node, sizeof(fs_node_t));
-  kfree(mpath);
+  if (flags & O_DIRECT) out_node->flags |= FS_DIRECT;
+  out_node->dir_index = 0;
+  out_node->dir_offset = 0;
+  out_node->readahead = NULL;
+  out_node->refcount = 0;
+  out_node->vnode_next = NULL;
+  if (node->tree_node == NULL) kfree(node);
+  return 0;
+}
+
+// Open the filesystem node at a path.
+uint32_t fs_open_node(fs_node_t *out_node, const char *path, uint32_t flags)
+{
+  char *mpath = path_buffer();
+  CHECK(mpath == NULL, "No memory.", ENOMEM);
+  uint32_t res = fs_canonicalize(mpath, path);
+  CHECK(res, "Failed to resolve path.", res);
+  return open_path(out_node, mpath, u_strlen(mpath), flags);
+}
+
+static uint32_t vnode_hash(void *device, uint32_t inode)
+{ return ((uint32_t)device ^ (inode * 2654435761u)) % FS_VNODE_BUCKETS; }
+
+// Get the shared node for a node that was just looked up, taking
+// ownership of it. Mount points are already shared, and nodes without
+// an inode number (devices, pipes) can't be told apart, so they stay
+// private to whoever opened them.
+static fs_node_t *vnode_get(fs_node_t *node)
+{
+  if (node->tree_node) {
+    klock(&vnode_lock);
+    ++(node->refcount);
+    kunlock(&vnode_lock);
+    return node;
+  }
+
+  node->refcount = 1;
+  node->dir_index = 0;
+  node->dir_offset = 0;
+  node->readahead = NULL;
+  node->vnode_next = NULL;
+  if (node->inode == 0) return node;
+
+  uint32_t h = vnode_hash(node->device, node->inode);
+  klock(&vnode_lock);
+  fs_node_t *vnode = vnode_table[h];
+  for (; vnode; vnode = vnode->vnode_next) {
+    if (
+      vnode->device == node->device
+      && vnode->inode == node->inode
+      && (vnode->flags & FS_DIRECT) == 0
+      ) break;
+  }
+
+  if (vnode) {
+    // The node that was just looked up has the latest attributes,
+    // which may have changed through another name or a copy.
+    ++(vnode->refcount);
+    vnode->mask = node->mask;
+    vnode->uid = node->uid;
+    vnode->gid = node->gid;
+    vnode->length = node->length;
+    vnode->atime = node->atime;
+    vnode->ctime = node->ctime;
+    vnode->mtime = node->mtime;
+    kunlock(&vnode_lock);
+    kfree(node);
+    return vnode;
+  }
+
+  node->vnode_next = vnode_table[h];
+  vnode_table[h] = node;
+  kunlock(&vnode_lock);
+  return node;
+}
+
+// Private nodes of files are kept in the table too, so that
+// fs_vnode_busy sees them, but they are never shared.
+static void vnode_add_private(fs_node_t *node)
+{
+  if (node->inode == 0 || node->tree_node) return;
+  uint32_t h = vnode_hash(node->device, node->inode);
+  klock(&vnode_lock);
+  node->vnode_next = vnode_table[h];
+  vnode_table[h] = node;
+  kunlock(&vnode_lock);
+}
+
+// Open the shared node of the file at a path. O_DIRECT changes how a
+// node is cached, so those opens get a private node.
+uint32_t fs_open_vnode(fs_node_t **out_node, const char *path, uint32_t flags)
+{
+  char *mpath = path_buffer();
+  CHECK(mpath == NULL, "No memory.", ENOMEM);
+  uint32_t res = fs_canonicalize(mpath, path);
+  CHECK(res, "Failed to resolve path.", res);
+  fs_node_t *node = NULL;
+  res = walk_path(&node, mpath, u_strlen(mpath), flags);
+  if (res) return res;
+
+  if (flags & O_DIRECT) {
+    fs_node_t *copy = node;
+    if (node->tree_node) {
+      copy = kmalloc(sizeof(fs_node_t));
+      CHECK(copy == NULL, "No memory.", ENOMEM);
+      u_memcpy(copy, node, sizeof(fs_node_t));
+    }
+    copy->flags |= FS_DIRECT;
+    copy->dir_index = 0;
+    copy->dir_offset = 0;
+    copy->readahead = NULL;
+    copy->refcount = 1;
+    copy->vnode_next = NULL;
+    node = copy;
+    vnode_add_private(node);
+  } else node = vnode_get(node);
+
+  // The file may have been unlinked between the lookup and now, in
+  // which case the filesystem could have freed it without seeing this
+  // node (see fs_vnode_busy).
+  if (node->tree_node == NULL && node->revalidate) {
+    int32_t err = node->revalidate(node);
+    if (err) { fs_vnode_put(node); return -err; }
+  }
+
+  fs_open(node, flags & (~O_CREAT));
+  *out_node = node;
+  return 0;
+}
+
+// Drop a reference to a shared node, freeing it with the last one.
+void fs_vnode_put(fs_node_t *node)
+{
+  klock(&vnode_lock);
+  if (--(node->refcount)) { kunlock(&vnode_lock); return; }
+
+  fs_node_t **link = &(vnode_table[vnode_hash(node->device, node->inode)]);
+  for (; *link && *link != node; link = &((*link)->vnode_next));
+  if (*link) *link = node->vnode_next;
+  kunlock(&vnode_lock);
+  if (node->release) node->release(node);
+  kfree(node);
+}
+
+// Check whether any node from fs_open_vnode still refers to an inode.
+uint8_t fs_vnode_busy(void *device, uint32_t inode)
+{
+  klock(&vnode_lock);
+  fs_node_t *vnode = vnode_table[vnode_hash(device, inode)];
+  for (; vnode; vnode = vnode->vnode_next)
+    if (vnode->device == device && vnode->inode == inode) break;
+  kunlock(&vnode_lock);
+  return vnode != NULL;
+}
+
+static void sync_tree(tree_node_t *node)
+{
+  fs_node_t *fsnode = node->value;
+  if (fsnode && fsnode->sync) {
+    int32_t res = fsnode->sync(fsnode);
+    if (res) log_error("fs", "Failed to sync filesystem.\n");
+  }
+  list_foreach(lchild, node->children) sync_tree(lchild->value);
+}
+
+// Write back the cached data of every mounted filesystem. Mount points
+// are never removed, so the tree is walked without holding the lock.
+void fs_sync()
+{ if (fs_tree) sync_tree(fs_tree); }
+
+static void flusher()
+{
+  for (;;) {
+    uint32_t eflags = interrupt_save_disable();
+    process_t *current = process_current();
+    uint32_t wake_time = pit_get_time() + FS_FLUSH_INTERVAL;
+    current->is_running = 0;
+    uint32_t res = process_sleep(current, wake_time);
+    if (res) current->is_running = 1;
+    interrupt_restore(eflags);
+    while (wake_time > pit_get_time());
+
+    fs_sync();
+  }
+}
+
+// Start the kernel thread that periodically writes back cached data.
+uint32_t fs_start_flusher()
+{
+  process_t *p = kmalloc(sizeof(process_t));
+  CHECK(p == NULL, "No memory.", ENOMEM);
+  uint32_t res = process_create_kernel(p, "flusher", flusher);
+  CHECK(res, "Failed to create flusher thread.", res);
+  process_schedule(p);
   return 0;
 }
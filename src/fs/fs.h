@@ -15,6 +15,10 @@
 // The maximum length of a file name.
 #define FS_NAME_LEN 256
 
+// The maximum length and depth of a canonical path.
+#define FS_PATH_MAX   1024
+#define FS_PATH_DEPTH 64
+
 // Path constants.
 #define FS_DIR_SELF     "."
 #define FS_DIR_UP       ".."
@@ -30,6 +34,7 @@
 #define FS_SYMLINK     0x20
 #define FS_MOUNTPOINT  0x40
 #define FS_TTY         0x80
+#define FS_DIRECT      0x100
 
 // fs_open flags.
 #define O_RDONLY    0
@@ -43,13 +48,21 @@
 #define O_PATH      0x2000
 #define O_NONBLOCK  0x4000
 #define O_DIRECTORY 0x8000
+#define O_DIRECT    0x10000
+#define O_CLOEXEC   0x20000
+
+// lseek whence values that look for data or holes in sparse files.
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
 
 struct fs_node_s;
 struct dirent;
+struct iovec;
 
 // File operations: open, close, etc.
 typedef void (*open_type_t)(struct fs_node_s *, uint32_t);
 typedef void (*close_type_t)(struct fs_node_s *);
+typedef void (*release_type_t)(struct fs_node_s *);
 typedef uint32_t (*read_type_t)(
   struct fs_node_s *, uint32_t, uint32_t, uint8_t *
   );
@@ -65,6 +78,17 @@ typedef int32_t (*chmod_type_t)(struct fs_node_s *, int32_t);
 typedef int32_t (*symlink_type_t)(struct fs_node_s *, char *, char *);
 typedef int32_t (*readlink_type_t)(struct fs_node_s *, char *, size_t);
 typedef int32_t (*rename_type_t)(struct fs_node_s *, char *, char *);
+typedef int32_t (*sync_type_t)(struct fs_node_s *);
+typedef int32_t (*fsync_type_t)(struct fs_node_s *, uint32_t);
+typedef int32_t (*seek_type_t)(struct fs_node_s *, uint32_t, uint32_t);
+typedef int32_t (*ioctl_type_t)(struct fs_node_s *, uint32_t, void *);
+typedef int32_t (*revalidate_type_t)(struct fs_node_s *);
+typedef int32_t (*readv_type_t)(
+  struct fs_node_s *, uint32_t, struct iovec *, uint32_t
+  );
+typedef int32_t (*writev_type_t)(
+  struct fs_node_s *, uint32_t, struct iovec *, uint32_t
+  );
 
 // A single filesystem node.
 typedef struct fs_node_s {
@@ -77,6 +101,11 @@ typedef struct fs_node_s {
   uint32_t length;        // File size in bytes.
   void *device;           // Device object.
   tree_node_t *tree_node; // (Optional) mount point tree node.
+  uint32_t dir_index;     // Index of the next entry read from a directory.
+  uint32_t dir_offset;    // Filesystem-specific position of that entry.
+  void *readahead;        // (Optional) filesystem-specific readahead state.
+  uint32_t refcount;      // References to a shared node (see fs_open_vnode).
+  struct fs_node_s *vnode_next;
 
   uint32_t atime;         // Accessed time.
   uint32_t ctime;         // Created time.
@@ -96,6 +125,14 @@ typedef struct fs_node_s {
   symlink_type_t symlink;
   readlink_type_t readlink;
   rename_type_t rename;
+  sync_type_t sync;       // Write back the whole filesystem.
+  fsync_type_t fsync;     // Write back one file (or just its data).
+  seek_type_t seek;       // Find the next data or hole in a file.
+  ioctl_type_t ioctl;     // Device or filesystem specific requests.
+  revalidate_type_t revalidate; // Refresh a cached node (see fs_finddir).
+  readv_type_t readv;     // (Optional) read into several buffers at once.
+  writev_type_t writev;   // (Optional) write several buffers at once.
+  release_type_t release; // (Optional) drop per-file state (see fs_close).
 } fs_node_t;
 
 // A single directory entry.
@@ -113,6 +150,11 @@ struct dirent *fs_readdir(fs_node_t *, uint32_t);
 fs_node_t *fs_finddir(fs_node_t *, char *);
 int32_t fs_chmod(fs_node_t *, int32_t);
 int32_t fs_readlink(fs_node_t *, char *, size_t);
+int32_t fs_fsync(fs_node_t *, uint32_t);
+int32_t fs_seek(fs_node_t *, uint32_t, uint32_t);
+int32_t fs_ioctl(fs_node_t *, uint32_t, void *);
+int32_t fs_readv(fs_node_t *, uint32_t, struct iovec *, uint32_t);
+int32_t fs_writev(fs_node_t *, uint32_t, struct iovec *, uint32_t);
 
 // Non-trivial wrappers around internal functions.
 int32_t fs_symlink(char *, char *);
@@ -127,10 +169,30 @@ uint32_t fs_init();
 // Mount a filesystem.
 uint32_t fs_mount(fs_node_t *, const char *);
 
+// Write back the cached data of every mounted filesystem.
+void fs_sync();
+
+// Start the kernel thread that periodically writes back cached data.
+uint32_t fs_start_flusher();
+
 // Open the filesystem node at a path.
 uint32_t fs_open_node(fs_node_t *, const char *, uint32_t);
 
-// Resolve a (relative) path.
+// Open the shared node of the file at a path, or take another
+// reference to an already open one.
+uint32_t fs_open_vnode(fs_node_t **, const char *, uint32_t);
+
+// Drop a reference to a shared node.
+void fs_vnode_put(fs_node_t *);
+
+// Check whether a file is still open, so that a filesystem can keep an
+// unlinked file until its last node is released.
+uint8_t fs_vnode_busy(void *, uint32_t);
+
+// Canonicalize a (relative) path into a buffer of FS_PATH_MAX bytes.
+uint32_t fs_canonicalize(char *, const char *);
+
+// Resolve a (relative) path into a newly allocated string.
 uint32_t resolve_path(char **outpath, const char *inpath);
 
 #endif /* _FS_H_ */
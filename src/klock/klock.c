@@ -24,3 +24,32 @@ void klock_wait(process_registers_t regs)
 
 void kunlock(klock_t lock)
 { *lock = 0; }
+
+// Acquire a reader/writer lock for reading.
+void krlock(krwlock_t *rw)
+{
+  klock(&(rw->lock));
+  if (++(rw->readers) == 1) klock(&(rw->write_lock));
+  kunlock(&(rw->lock));
+}
+
+// Acquire a reader/writer lock for writing.
+void kwlock(krwlock_t *rw)
+{
+  klock(&(rw->write_lock));
+  rw->writer = 1;
+}
+
+// Release a reader/writer lock held for either reading or writing.
+void krwunlock(krwlock_t *rw)
+{
+  if (rw->writer) {
+    rw->writer = 0;
+    kunlock(&(rw->write_lock));
+    return;
+  }
+
+  klock(&(rw->lock));
+  if (--(rw->readers) == 0) kunlock(&(rw->write_lock));
+  kunlock(&(rw->lock));
+}
@@ -15,4 +15,18 @@ typedef volatile uint32_t *klock_t;
 void klock(klock_t);
 void kunlock(klock_t);
 
+// Reader/writer lock. Any number of readers can hold the lock at once;
+// the first reader takes `write_lock` on behalf of all of them and the
+// last one releases it.
+typedef struct krwlock_s {
+  volatile uint32_t lock;
+  volatile uint32_t write_lock;
+  uint32_t readers;
+  uint8_t writer;
+} krwlock_t;
+
+void krlock(krwlock_t *);
+void kwlock(krwlock_t *);
+void krwunlock(krwlock_t *);
+
 #endif /* _KLOCK_H_ */
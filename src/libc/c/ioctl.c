@@ -0,0 +1,18 @@
+
+// ioctl.c
+//
+// Device and filesystem control.
+//
+// Author: Ajay Tatachar <ajaymt2@illinois.edu>
+
+#include <stdint.h>
+#include <_syscall.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+int32_t ioctl(uint32_t fd, uint32_t request, void *arg)
+{
+  int32_t res = _syscall3(SYSCALL_IOCTL, fd, request, (uint32_t)arg);
+  if (res < 0) { errno = -res; res = -1; }
+  return res;
+}
@@ -0,0 +1,26 @@
+
+// uio.c
+//
+// Vectored I/O.
+//
+// Author: Ajay Tatachar <ajaymt2@illinois.edu>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <_syscall.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+size_t readv(uint32_t fd, const struct iovec *iov, uint32_t iovcnt)
+{
+  int32_t res = _syscall3(SYSCALL_READV, fd, (uint32_t)iov, iovcnt);
+  if (res < 0) { errno = -res; res = -1; }
+  return res;
+}
+
+size_t writev(uint32_t fd, const struct iovec *iov, uint32_t iovcnt)
+{
+  int32_t res = _syscall3(SYSCALL_WRITEV, fd, (uint32_t)iov, iovcnt);
+  if (res < 0) { errno = -res; res = -1; }
+  return res;
+}
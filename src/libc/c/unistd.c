@@ -134,3 +134,20 @@ int32_t dup(uint32_t fd)
   if (res < 0) { errno = -res; res = -1; }
   return res;
 }
+
+void sync()
+{ _syscall0(SYSCALL_SYNC); }
+
+int32_t fsync(uint32_t fd)
+{
+  int32_t res = _syscall1(SYSCALL_FSYNC, fd);
+  if (res < 0) { errno = -res; res = -1; }
+  return res;
+}
+
+int32_t fdatasync(uint32_t fd)
+{
+  int32_t res = _syscall1(SYSCALL_FDATASYNC, fd);
+  if (res < 0) { errno = -res; res = -1; }
+  return res;
+}
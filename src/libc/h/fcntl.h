@@ -22,6 +22,8 @@
 #define O_PATH      0x2000
 #define O_NONBLOCK  0x4000
 #define O_DIRECTORY 0x8000
+#define O_DIRECT    0x10000
+#define O_CLOEXEC   0x20000
 
 int32_t open(const char *path, int32_t flags, ...);
 int32_t chmod(const char *path, mode_t mode);
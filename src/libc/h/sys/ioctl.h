@@ -0,0 +1,28 @@
+
+// ioctl.h
+//
+// Device and filesystem control.
+//
+// Author: Ajay Tatachar <ajaymt2@illinois.edu>
+
+#ifndef _IOCTL_H_
+#define _IOCTL_H_
+
+#include <stdint.h>
+
+// Fragmentation of a file: the number of data blocks it has and the
+// number of runs of contiguous disk blocks they are stored in.
+struct fs_fraginfo {
+  uint32_t blocks;
+  uint32_t extents;
+};
+
+// Filesystem requests. Both take a `struct fs_fraginfo *`.
+// FS_IOC_DEFRAG moves the data of a file into a single run of free
+// blocks and reports the layout it ends up with.
+#define FS_IOC_FRAGINFO 1
+#define FS_IOC_DEFRAG   2
+
+int32_t ioctl(uint32_t fd, uint32_t request, void *arg);
+
+#endif /* _IOCTL_H_ */
@@ -0,0 +1,26 @@
+
+// uio.h
+//
+// Vectored I/O.
+//
+// Author: Ajay Tatachar <ajaymt2@illinois.edu>
+
+#ifndef _UIO_H_
+#define _UIO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A buffer for readv and writev.
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+
+// The maximum number of buffers in one call.
+#define IOV_MAX 1024
+
+size_t readv(uint32_t fd, const struct iovec *iov, uint32_t iovcnt);
+size_t writev(uint32_t fd, const struct iovec *iov, uint32_t iovcnt);
+
+#endif /* _UIO_H_ */
@@ -29,5 +29,8 @@ off_t lseek(uint32_t fd, off_t offset, int32_t whence);
 int32_t unlink(const char *path);
 int32_t rmdir(const char *path);
 int32_t dup(uint32_t fd);
+void sync();
+int32_t fsync(uint32_t fd);
+int32_t fdatasync(uint32_t fd);
 
 #endif /* _UNISTD_H_ */
@@ -14,6 +14,7 @@
 #include <debug/log.h>
 #include <fs/fs.h>
 #include <ringbuffer/ringbuffer.h>
+#include <sys/uio.h>
 #include "pipe.h"
 
 #define CHECK(err, msg, code) if ((err)) {      \
@@ -88,6 +89,39 @@ static uint32_t pipe_write(
   return written_size;
 }
 
+// Read into several buffers. Only the first buffer waits for data, the
+// rest take what is already in the pipe, so readv returns whenever
+// read would have.
+static int32_t pipe_readv(
+  fs_node_t *node, uint32_t offset, struct iovec *iov, uint32_t count
+  )
+{
+  pipe_t *self = node->device;
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (iov[i].iov_len == 0) continue;
+    if (self == NULL || self->rb == NULL) break;
+    if (total && ringbuffer_check_read(self->rb) == 0) break;
+    uint32_t r = pipe_read(node, offset, iov[i].iov_len, iov[i].iov_base);
+    total += r;
+    if (r < iov[i].iov_len) break;
+  }
+  return total;
+}
+
+static int32_t pipe_writev(
+  fs_node_t *node, uint32_t offset, struct iovec *iov, uint32_t count
+  )
+{
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t w = pipe_write(node, offset, iov[i].iov_len, iov[i].iov_base);
+    total += w;
+    if (w < iov[i].iov_len) break;
+  }
+  return total;
+}
+
 static void pipe_close_read(fs_node_t *node)
 {
   pipe_t *self = node->device;
@@ -131,6 +165,8 @@ uint32_t pipe_create(
   write_node->device = pipe;
   read_node->read = pipe_read;
   write_node->write = pipe_write;
+  read_node->readv = pipe_readv;
+  write_node->writev = pipe_writev;
   read_node->close = pipe_close_read;
   write_node->close = pipe_close_write;
   read_node->mask = 0666;
@@ -378,9 +378,6 @@ uint32_t process_create_init(process_t *out_init, process_image_t img)
   CHECK(init->wd == NULL, "No memory.", ENOMEM);
   u_memcpy(init->wd, "/", u_strlen("/") + 1);
   init->is_running = 1;
-  init->fds = kmalloc(sizeof(list_t));
-  CHECK(init->fds == NULL, "No memory.", ENOMEM);
-  u_memset(init->fds, 0, sizeof(list_t));
   init->ui_event_queue = kmalloc(sizeof(list_t));
   CHECK(init->ui_event_queue == NULL, "No memory.", ENOMEM);
   u_memset(init->ui_event_queue, 0, sizeof(list_t));
@@ -415,6 +412,57 @@ uint32_t process_create_init(process_t *out_init, process_image_t img)
   return 0;
 }
 
+// Create a process that runs a function in kernel mode. The function
+// must never return.
+uint32_t process_create_kernel(
+  process_t *process, const char *name, void (*entry)()
+  )
+{
+  uint32_t eflags = interrupt_save_disable();
+
+  u_memset(process, 0, sizeof(process_t));
+  uint32_t name_len = u_strlen(name);
+  if (name_len >= PROCESS_NAME_LEN) name_len = PROCESS_NAME_LEN - 1;
+  u_memcpy(process->name, name, name_len);
+  process->wd = kmalloc(u_strlen("/") + 1);
+  CHECK(process->wd == NULL, "No memory.", ENOMEM);
+  u_memcpy(process->wd, "/", u_strlen("/") + 1);
+  process->is_running = 1;
+  process->ui_event_queue = kmalloc(sizeof(list_t));
+  CHECK(process->ui_event_queue == NULL, "No memory.", ENOMEM);
+  u_memset(process->ui_event_queue, 0, sizeof(list_t));
+
+  page_directory_t kernel_pd; uint32_t kernel_cr3;
+  paging_get_kernel_pd(&kernel_pd, &kernel_cr3);
+  uint32_t err = paging_clone_process_directory(&(process->cr3), kernel_cr3);
+  CHECK(err, "Failed to clone page directory.", err);
+
+  uint32_t kstack_vaddr = paging_prev_vaddr(1, FIRST_PT_VADDR);
+  CHECK(kstack_vaddr == 0, "No memory.", ENOMEM);
+  uint32_t kstack_paddr = pmm_alloc(1);
+  CHECK(kstack_paddr == 0, "No memory.", ENOMEM);
+  page_table_entry_t flags; u_memset(&flags, 0, sizeof(flags));
+  flags.rw = 1;
+  paging_result_t res = paging_map(kstack_vaddr, kstack_paddr, flags);
+  CHECK(res != PAGING_OK, "Failed to map kernel stack.", res);
+  process->mmap.kernel_stack_bottom = kstack_vaddr;
+  process->mmap.kernel_stack_top = kstack_vaddr + PAGE_SIZE - 1;
+
+  // Kernel processes are not part of the process tree, so they can't
+  // be signalled or waited on.
+  process->pid = ++next_pid;
+  process->gid = process->pid;
+  process->in_kernel = 1;
+  process->kregs.eip = (uint32_t)entry;
+  process->kregs.cs = SEGMENT_SELECTOR_KERNEL_CS;
+  process->kregs.ss = SEGMENT_SELECTOR_KERNEL_DS;
+  process->kregs.esp = (kstack_vaddr + PAGE_SIZE) & ~0xF;
+  process->kregs.eflags = 0x202;
+
+  interrupt_restore(eflags);
+  return 0;
+}
+
 // Fork a process.
 uint32_t process_fork(
   process_t *out_child, process_t *process, uint8_t is_thread
@@ -474,20 +522,25 @@ uint32_t process_fork(
     interrupt_restore(eflags);
   }
 
-  list_t *fds = kmalloc(sizeof(list_t));
-  CHECK_UNLOCK(fds == NULL, "No memory.", ENOMEM);
-  u_memset(fds, 0, sizeof(list_t));
-  list_foreach(lchild, process->fds) {
-    process_fd_t *fd = lchild->value;
+  child->path_buf = NULL;
+  child->fds = NULL;
+  child->fd_capacity = 0;
+  if (process->fd_capacity) {
+    uint32_t size = process->fd_capacity * sizeof(process_fd_slot_t);
+    child->fds = kmalloc(size);
+    CHECK_UNLOCK(child->fds == NULL, "No memory.", ENOMEM);
+    u_memcpy(child->fds, process->fds, size);
+    child->fd_capacity = process->fd_capacity;
+  }
+  for (uint32_t i = 0; i < child->fd_capacity; ++i) {
+    process_fd_t *fd = child->fds[i].fd;
     if (fd) ++(fd->refcount);
-    if (fd && (fd->node.flags & FS_PIPE)) {
-      pipe_t *p = fd->node.device;
-      if (p && fd->node.read) ++(p->read_refcount);
-      else if (p && fd->node.write) ++(p->write_refcount);
+    if (fd && (fd->node->flags & FS_PIPE)) {
+      pipe_t *p = fd->node->device;
+      if (p && fd->node->read) ++(p->read_refcount);
+      else if (p && fd->node->write) ++(p->write_refcount);
     }
-    list_push_back(fds, fd);
   }
-  child->fds = fds;
 
   uint32_t eflags = interrupt_save_disable();
   uint32_t kstack_vaddr = paging_prev_vaddr(1, FIRST_PT_VADDR);
@@ -666,6 +719,86 @@ void process_finish(process_t *process)
   kunlock(&process_tree_lock);
 }
 
+// Get the slot of an open file descriptor, or NULL.
+process_fd_slot_t *process_fd_slot(process_t *process, uint32_t fdnum)
+{
+  if (fdnum >= process->fd_capacity) return NULL;
+  process_fd_slot_t *slot = process->fds + fdnum;
+  if (slot->fd == NULL) return NULL;
+  return slot;
+}
+
+// Put an open file in the lowest free file descriptor that is at
+// least `min`, growing the table if there isn't one.
+int32_t process_fd_install(
+  process_t *process, process_fd_t *fd, uint32_t min, uint32_t flags
+  )
+{
+  if (min >= PROCESS_MAX_FDS) return -EINVAL;
+
+  uint32_t eflags = interrupt_save_disable();
+  uint32_t fdnum = min;
+  for (; fdnum < process->fd_capacity; ++fdnum)
+    if (process->fds[fdnum].fd == NULL) break;
+
+  if (fdnum >= process->fd_capacity) {
+    if (fdnum >= PROCESS_MAX_FDS) {
+      interrupt_restore(eflags);
+      return -EMFILE;
+    }
+    uint32_t capacity = process->fd_capacity ? process->fd_capacity : 8;
+    while (capacity <= fdnum) capacity *= 2;
+    if (capacity > PROCESS_MAX_FDS) capacity = PROCESS_MAX_FDS;
+
+    process_fd_slot_t *fds = kmalloc(capacity * sizeof(process_fd_slot_t));
+    if (fds == NULL) {
+      interrupt_restore(eflags);
+      return -ENOMEM;
+    }
+    uint32_t old_size = process->fd_capacity * sizeof(process_fd_slot_t);
+    u_memcpy(fds, process->fds, old_size);
+    u_memset(
+      (uint8_t *)fds + old_size, 0,
+      capacity * sizeof(process_fd_slot_t) - old_size
+      );
+    kfree(process->fds);
+    process->fds = fds;
+    process->fd_capacity = capacity;
+  }
+
+  process->fds[fdnum].fd = fd;
+  process->fds[fdnum].flags = flags;
+  interrupt_restore(eflags);
+  return fdnum;
+}
+
+// Drop a reference to an open file, freeing it with the last one.
+void process_fd_release(process_fd_t *fd)
+{
+  --(fd->refcount);
+  fs_close(fd->node);
+  if (fd->refcount) return;
+  if (fd->node->flags & FS_PIPE) {
+    pipe_t *p = fd->node->device;
+    if (p && p->read_closed && p->write_closed) kfree(p);
+  }
+  fs_vnode_put(fd->node);
+  kfree(fd);
+}
+
+// Close the file descriptors that are marked close-on-exec.
+void process_close_on_exec(process_t *process)
+{
+  for (uint32_t i = 0; i < process->fd_capacity; ++i) {
+    process_fd_slot_t *slot = process->fds + i;
+    if (slot->fd == NULL || !(slot->flags & PROCESS_FD_CLOEXEC)) continue;
+    process_fd_t *fd = slot->fd;
+    slot->fd = NULL;
+    slot->flags = 0;
+    process_fd_release(fd);
+  }
+}
+
 // Destroy a process.
 static uint32_t process_destroy(process_t *process)
 {
@@ -718,23 +851,11 @@ static uint32_t process_destroy(process_t *process)
     }
   }
 
-  while (process->fds->size) {
-    list_node_t *head = process->fds->head;
-    process_fd_t *fd = head->value;
-    list_remove(process->fds, head, 0);
-    kfree(head);
-    if (fd == NULL) continue;
-    --(fd->refcount);
-    fs_close(&(fd->node));
-    if (fd->refcount) continue;
-    if (fd->node.flags & FS_PIPE) {
-      pipe_t *p = fd->node.device;
-      if (p && p->read_closed && p->write_closed) kfree(p);
-    }
-    kfree(fd);
-  }
+  for (uint32_t i = 0; i < process->fd_capacity; ++i)
+    if (process->fds[i].fd) process_fd_release(process->fds[i].fd);
 
   kfree(process->fds);
+  kfree(process->path_buf);
   list_destroy(process->ui_event_queue);
   kfree(process->wd);
   kfree(tree_node);
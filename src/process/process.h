@@ -55,20 +55,36 @@ typedef struct process_image_s {
   uint32_t data_vaddr;
 } process_image_t;
 
-// File descriptor.
+// File descriptor. `node` is shared with other opens of the same file.
 typedef struct process_fd_s {
-  fs_node_t node;
+  fs_node_t *node;
   uint32_t offset;
   uint32_t refcount;
 } process_fd_t;
 
+// A slot in a process's file descriptor table. Descriptors made by dup
+// and fork share the same open file, but each has its own flags. `fd`
+// is NULL in free slots.
+typedef struct process_fd_slot_s {
+  process_fd_t *fd;
+  uint32_t flags;
+} process_fd_slot_t;
+
+// File descriptor flags.
+#define PROCESS_FD_CLOEXEC 1
+
+// Maximum number of file descriptors per process.
+#define PROCESS_MAX_FDS 1024
+
 // Process structure.
 typedef struct process_s {
   uint32_t pid;
   uint32_t gid;
   char name[PROCESS_NAME_LEN];
   char *wd;
-  list_t *fds;
+  char *path_buf; // Scratch space for path resolution.
+  process_fd_slot_t *fds;
+  uint32_t fd_capacity;
 
   uint8_t is_running;
   uint8_t is_thread;
@@ -135,6 +151,10 @@ void process_switch(process_t *);
 // Create the `init` process.
 uint32_t process_create_init(process_t *, process_image_t);
 
+// Create a process that runs a function in kernel mode. The function
+// must never return.
+uint32_t process_create_kernel(process_t *, const char *, void (*)());
+
 // Overwrite process image.
 uint32_t process_load(process_t *, process_image_t);
 
@@ -150,4 +170,17 @@ void process_schedule(process_t *);
 // Mark a process as finished, deal with children.
 void process_finish(process_t *);
 
+// Get the slot of an open file descriptor, or NULL.
+process_fd_slot_t *process_fd_slot(process_t *, uint32_t);
+
+// Put an open file in the lowest free file descriptor that is at least
+// `min`. Returns the descriptor, or a negative error code.
+int32_t process_fd_install(process_t *, process_fd_t *, uint32_t, uint32_t);
+
+// Drop a reference to an open file, freeing it with the last one.
+void process_fd_release(process_fd_t *);
+
+// Close the file descriptors that are marked close-on-exec.
+void process_close_on_exec(process_t *);
+
 #endif /* _PROCESS_H_ */
@@ -21,6 +21,7 @@
 #include <util/util.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <ui/ui.h>
 #include "syscall.h"
 
@@ -87,6 +88,7 @@ static void syscall_execve(char *path, char *argv[], char *envp[])
     if (res) { current->uregs.eax = -res; return; }
     res = process_set_env(current, kargv, kenvp);
     if (res) { current->uregs.eax = -res; return; }
+    process_close_on_exec(current);
 
     for (uint32_t i = 0; kargv[i]; ++i) kfree(kargv[i]);
     kfree(kargv);
@@ -236,17 +238,11 @@ static void syscall_signal_send(uint32_t pid, uint32_t signum)
 static void syscall_getpid()
 { process_current()->uregs.eax = process_current()->pid; }
 
-static list_node_t *find_fd(uint32_t fdnum)
+static process_fd_t *find_fd(uint32_t fdnum)
 {
-  process_t *current = process_current();
-  uint32_t eflags = interrupt_save_disable();
-  list_node_t *lnode = NULL;
-  list_foreach(fdnode, current->fds) {
-    if (fdnum == 0) lnode = fdnode;
-    --fdnum;
-  }
-  interrupt_restore(eflags);
-  return lnode;
+  process_fd_slot_t *slot = process_fd_slot(process_current(), fdnum);
+  if (slot == NULL) return NULL;
+  return slot->fd;
 }
 
 static void syscall_open(char *path, uint32_t flags, uint32_t mode)
@@ -261,38 +257,33 @@ static void syscall_open(char *path, uint32_t flags, uint32_t mode)
   process_fd_t *fd = kmalloc(sizeof(process_fd_t));
   if (fd == NULL) { current->uregs.eax = -ENOMEM; return; }
   u_memset(fd, 0, sizeof(process_fd_t));
-  res = fs_open_node(&(fd->node), path, flags);
+  res = fs_open_vnode(&(fd->node), path, flags);
   if (res) {
     kfree(fd); current->uregs.eax = -res; return;
   }
   fd->refcount = 1;
 
-  list_push_back(current->fds, fd);
-  current->uregs.eax = current->fds->size - 1;
+  uint32_t fd_flags = (flags & O_CLOEXEC) ? PROCESS_FD_CLOEXEC : 0;
+  res = process_fd_install(current, fd, 0, fd_flags);
+  if (res < 0) process_fd_release(fd);
+  current->uregs.eax = res;
 }
 
 static void syscall_close(int32_t fdnum)
 {
   process_t *current = process_current();
   uint32_t eflags = interrupt_save_disable();
-  list_node_t *lnode = find_fd(fdnum);
-  if (lnode == NULL) {
-  fail:
+  process_fd_slot_t *slot = process_fd_slot(current, fdnum);
+  if (slot == NULL) {
     current->uregs.eax = -EBADF;
     interrupt_restore(eflags);
     return;
   }
 
-  process_fd_t *fd = lnode->value;
-  if (fd == NULL) goto fail;
-  --(fd->refcount);
-  fs_close(&(fd->node));
-  if (fd->node.flags & FS_PIPE) {
-    pipe_t *p = fd->node.device;
-    if (p && p->read_closed && p->write_closed) kfree(p);
-  }
-  if (fd->refcount == 0) kfree(fd);
-  lnode->value = NULL;
+  process_fd_t *fd = slot->fd;
+  slot->fd = NULL;
+  slot->flags = 0;
+  process_fd_release(fd);
 
   current->uregs.eax = 0;
   interrupt_restore(eflags);
@@ -301,11 +292,9 @@ static void syscall_close(int32_t fdnum)
 static void syscall_read(uint32_t fdnum, uint8_t *buf, uint32_t size)
 {
   process_t *current = process_current();
-  list_node_t *lnode = find_fd(fdnum);
-  if (lnode == NULL) { current->uregs.eax = -EBADF; return; }
-  process_fd_t *fd = lnode->value;
+  process_fd_t *fd = find_fd(fdnum);
   if (fd == NULL) { current->uregs.eax = -EBADF; return; }
-  int32_t res = fs_read(&(fd->node), fd->offset, size, buf);
+  int32_t res = fs_read(fd->node, fd->offset, size, buf);
   if (res < 0) { current->uregs.eax = res; return; }
   fd->offset += res;
   current->uregs.eax = res;
@@ -314,11 +303,9 @@ static void syscall_read(uint32_t fdnum, uint8_t *buf, uint32_t size)
 static void syscall_write(uint32_t fdnum, uint8_t *buf, uint32_t size)
 {
   process_t *current = process_current();
-  list_node_t *lnode = find_fd(fdnum);
-  if (lnode == NULL) { current->uregs.eax = -EBADF; return; }
-  process_fd_t *fd = lnode->value;
+  process_fd_t *fd = find_fd(fdnum);
   if (fd == NULL) { current->uregs.eax = -EBADF; return; }
-  int32_t res = fs_write(&(fd->node), fd->offset, size, buf);
+  int32_t res = fs_write(fd->node, fd->offset, size, buf);
   if (res < 0) { current->uregs.eax = res; return; }
   fd->offset += res;
   current->uregs.eax = res;
@@ -327,13 +314,12 @@ static void syscall_write(uint32_t fdnum, uint8_t *buf, uint32_t size)
 static void syscall_readdir(int32_t fdnum, struct dirent *ent, uint32_t index)
 {
   process_t *current = process_current();
-  list_node_t *lnode = find_fd(fdnum);
-  if (lnode == NULL) { current->uregs.eax = -EBADF; return; }
-  process_fd_t *fd = lnode->value;
+  process_fd_t *fd = find_fd(fdnum);
   if (fd == NULL) { current->uregs.eax = -EBADF; return; }
-  struct dirent *res = fs_readdir(&(fd->node), index);
+  struct dirent *res = fs_readdir(fd->node, index);
   if (res == NULL) { current->uregs.eax = -ENOENT; return; }
   u_memcpy(ent, res, sizeof(struct dirent));
+  kfree(res);
   current->uregs.eax = 0;
 }
 
@@ -372,22 +358,48 @@ static void syscall_pipe(
   uint32_t eflags = interrupt_save_disable();
 
   process_fd_t *read_fd = kmalloc(sizeof(process_fd_t));
-  if (read_fd == NULL) { current->uregs.eax = -ENOMEM; return; }
+  process_fd_t *write_fd = kmalloc(sizeof(process_fd_t));
+  fs_node_t *read_node = kmalloc(sizeof(fs_node_t));
+  fs_node_t *write_node = kmalloc(sizeof(fs_node_t));
+  uint32_t res = ENOMEM;
+  if (read_fd && write_fd && read_node && write_node) {
+    u_memset(read_node, 0, sizeof(fs_node_t));
+    u_memset(write_node, 0, sizeof(fs_node_t));
+    res = pipe_create(read_node, write_node, rb, wb);
+  }
+  if (res) {
+    kfree(read_fd); kfree(write_fd); kfree(read_node); kfree(write_node);
+    current->uregs.eax = -res;
+    interrupt_restore(eflags);
+    return;
+  }
+
   u_memset(read_fd, 0, sizeof(process_fd_t));
+  read_fd->node = read_node;
   read_fd->refcount = 1;
-
-  process_fd_t *write_fd = kmalloc(sizeof(process_fd_t));
-  if (write_fd == NULL) { current->uregs.eax = -ENOMEM; return; }
+  read_node->refcount = 1;
   u_memset(write_fd, 0, sizeof(process_fd_t));
+  write_fd->node = write_node;
   write_fd->refcount = 1;
-
-  uint32_t res = pipe_create(&(read_fd->node), &(write_fd->node), rb, wb);
-  if (res) { current->uregs.eax = -res; return; }
-
-  list_push_back(current->fds, read_fd);
-  *read_fdnum = current->fds->size - 1;
-  list_push_back(current->fds, write_fd);
-  *write_fdnum = current->fds->size - 1;
+  write_node->refcount = 1;
+
+  int32_t read_res = process_fd_install(current, read_fd, 0, 0);
+  int32_t write_res = -EMFILE;
+  if (read_res >= 0)
+    write_res = process_fd_install(current, write_fd, 0, 0);
+  if (write_res < 0) {
+    if (read_res >= 0) {
+      current->fds[read_res].fd = NULL;
+      current->fds[read_res].flags = 0;
+    }
+    process_fd_release(read_fd);
+    process_fd_release(write_fd);
+    current->uregs.eax = read_res < 0 ? read_res : write_res;
+    interrupt_restore(eflags);
+    return;
+  }
+  *read_fdnum = read_res;
+  *write_fdnum = write_res;
 
   current->uregs.eax = 0;
   interrupt_restore(eflags);
@@ -398,20 +410,25 @@ static void syscall_movefd(uint32_t fdn1, uint32_t fdn2)
   process_t *current = process_current();
   uint32_t eflags = interrupt_save_disable();
 
-  list_node_t *lnode = find_fd(fdn1);
-  if (lnode == NULL) { current->uregs.eax = -EBADF; return; }
-  process_fd_t *fd1 = lnode->value;
-  list_node_t *lnode2 = find_fd(fdn2);
-  if (lnode2 == NULL) { current->uregs.eax = -EBADF; return; }
-  process_fd_t *fd2 = lnode2->value;
-
-  syscall_close(fdn2);
-  if (current->uregs.eax != 0) {
-    interrupt_restore(eflags); return;
+  process_fd_slot_t *slot1 = process_fd_slot(current, fdn1);
+  if (slot1 && fdn1 == fdn2) {
+    current->uregs.eax = 0;
+    interrupt_restore(eflags);
+    return;
+  }
+  process_fd_slot_t *slot2 = process_fd_slot(current, fdn2);
+  if (slot1 == NULL || slot2 == NULL) {
+    current->uregs.eax = -EBADF;
+    interrupt_restore(eflags);
+    return;
   }
 
-  lnode->value = NULL;
-  lnode2->value = fd1;
+  process_fd_t *fd2 = slot2->fd;
+  slot2->fd = slot1->fd;
+  slot2->flags = slot1->flags;
+  slot1->fd = NULL;
+  slot1->flags = 0;
+  process_fd_release(fd2);
   current->uregs.eax = 0;
 
   interrupt_restore(eflags);
@@ -462,22 +479,19 @@ static void syscall_wait(uint32_t pid, struct _wait_result *w)
 static void syscall_fstat(uint32_t fdnum, struct stat *st)
 {
   process_t *current = process_current();
-  list_node_t *lnode = find_fd(fdnum);
-  if (lnode == NULL) { current->uregs.eax = -EBADF; return; }
-
-  process_fd_t *fd = lnode->value;
+  process_fd_t *fd = find_fd(fdnum);
   if (fd == NULL) { current->uregs.eax = -EBADF; return; }
   u_memset(st, 0, sizeof(struct stat));
-  st->st_dev = fd->node.flags;
-  st->st_ino = fd->node.inode;
-  st->st_mode = fd->node.mask;
+  st->st_dev = fd->node->flags;
+  st->st_ino = fd->node->inode;
+  st->st_mode = fd->node->mask;
   st->st_nlink = 1;
-  st->st_uid = fd->node.uid;
-  st->st_gid = fd->node.gid;
-  st->st_size = fd->node.length;
-  st->st_atime = fd->node.atime;
-  st->st_mtime = fd->node.mtime;
-  st->st_ctime = fd->node.ctime;
+  st->st_uid = fd->node->uid;
+  st->st_gid = fd->node->gid;
+  st->st_size = fd->node->length;
+  st->st_atime = fd->node->atime;
+  st->st_mtime = fd->node->mtime;
+  st->st_ctime = fd->node->ctime;
   st->st_blksize = 1024;
   current->uregs.eax = 0;
 }
@@ -506,12 +520,15 @@ static void syscall_lstat(char *path, struct stat *st)
 static void syscall_lseek(uint32_t fd, int32_t offset, uint32_t whence)
 {
   process_t *current = process_current();
-  list_node_t *lnode = find_fd(fd);
-  if (lnode == NULL) { current->uregs.eax = -EBADF; return; }
-  process_fd_t *pfd = lnode->value;
+  process_fd_t *pfd = find_fd(fd);
   if (pfd == NULL) { current->uregs.eax = -EBADF; return; }
-  if (whence == 1) pfd->offset += offset;
-  else if (whence == 2) pfd->offset = pfd->node.length + offset;
+  if (whence == SEEK_DATA || whence == SEEK_HOLE) {
+    if (offset < 0) { current->uregs.eax = -EINVAL; return; }
+    int32_t res = fs_seek(pfd->node, offset, whence);
+    if (res < 0) { current->uregs.eax = res; return; }
+    pfd->offset = res;
+  } else if (whence == 1) pfd->offset += offset;
+  else if (whence == 2) pfd->offset = pfd->node->length + offset;
   else pfd->offset = offset;
   current->uregs.eax = pfd->offset;
 }
@@ -536,23 +553,22 @@ static void syscall_thread(uint32_t eip, uint32_t data)
 static void syscall_dup(uint32_t fdnum)
 {
   process_t *current = process_current();
-  list_node_t *lnode = find_fd(fdnum);
-  if (lnode == NULL) { current->uregs.eax = -EBADF; return; }
   uint32_t eflags = interrupt_save_disable();
-  process_fd_t *fd1 = lnode->value;
+  process_fd_t *fd1 = find_fd(fdnum);
   if (fd1 == NULL) {
     interrupt_restore(eflags);
     current->uregs.eax = -EBADF;
     return;
   }
   ++(fd1->refcount);
-  if (fd1->node.flags & FS_PIPE) {
-    pipe_t *p = fd1->node.device;
-    if (fd1->node.read) ++(p->read_refcount);
-    else if (fd1->node.write) ++(p->write_refcount);
+  if (fd1->node->flags & FS_PIPE) {
+    pipe_t *p = fd1->node->device;
+    if (fd1->node->read) ++(p->read_refcount);
+    else if (fd1->node->write) ++(p->write_refcount);
   }
-  list_push_back(current->fds, fd1);
-  current->uregs.eax = current->fds->size - 1;
+  int32_t res = process_fd_install(current, fd1, 0, 0);
+  if (res < 0) process_fd_release(fd1);
+  current->uregs.eax = res;
   interrupt_restore(eflags);
 }
 
@@ -636,18 +652,83 @@ static void syscall_resolve(char *outpath, char *inpath, size_t len)
 static void syscall_maketty(uint32_t fdnum)
 {
   process_t *current = process_current();
-  list_node_t *lnode = find_fd(fdnum);
-  if (lnode == NULL || lnode->value == NULL) {
-    current->uregs.eax = -EBADF; return;
-  }
-  process_fd_t *fd = lnode->value;
-  fd->node.flags |= FS_TTY;
+  process_fd_t *fd = find_fd(fdnum);
+  if (fd == NULL) { current->uregs.eax = -EBADF; return; }
+  fd->node->flags |= FS_TTY;
   current->uregs.eax = 0;
 }
 
 static void syscall_systime()
 { process_current()->uregs.eax = pit_get_time(); }
 
+static void syscall_sync()
+{
+  fs_sync();
+  process_current()->uregs.eax = 0;
+}
+
+static void fsync_fd(uint32_t fdnum, uint32_t datasync)
+{
+  process_t *current = process_current();
+  process_fd_t *fd = find_fd(fdnum);
+  if (fd == NULL) { current->uregs.eax = -EBADF; return; }
+  current->uregs.eax = fs_fsync(fd->node, datasync);
+}
+
+static void syscall_fsync(uint32_t fdnum)
+{ fsync_fd(fdnum, 0); }
+
+static void syscall_fdatasync(uint32_t fdnum)
+{ fsync_fd(fdnum, 1); }
+
+static void syscall_ioctl(uint32_t fdnum, uint32_t request, void *arg)
+{
+  process_t *current = process_current();
+  process_fd_t *fd = find_fd(fdnum);
+  if (fd == NULL) { current->uregs.eax = -EBADF; return; }
+  current->uregs.eax = fs_ioctl(fd->node, request, arg);
+}
+
+// Check that the buffers of a readv/writev call add up to a size that
+// fits the return value and doesn't wrap the file offset.
+static int32_t check_iov(uint32_t offset, struct iovec *iov, uint32_t count)
+{
+  if (count > IOV_MAX) return -EINVAL;
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (iov[i].iov_len > (uint32_t)INT32_MAX - total) return -EINVAL;
+    total += iov[i].iov_len;
+  }
+  if (offset + total < offset) return -EINVAL;
+  return 0;
+}
+
+static void syscall_readv(uint32_t fdnum, struct iovec *iov, uint32_t count)
+{
+  process_t *current = process_current();
+  process_fd_t *fd = find_fd(fdnum);
+  if (fd == NULL) { current->uregs.eax = -EBADF; return; }
+  int32_t res = check_iov(fd->offset, iov, count);
+  if (res) { current->uregs.eax = res; return; }
+  res = fs_readv(fd->node, fd->offset, iov, count);
+  if (res < 0) { current->uregs.eax = res; return; }
+  fd->offset += res;
+  current->uregs.eax = res;
+}
+
+static void syscall_writev(uint32_t fdnum, struct iovec *iov, uint32_t count)
+{
+  process_t *current = process_current();
+  process_fd_t *fd = find_fd(fdnum);
+  if (fd == NULL) { current->uregs.eax = -EBADF; return; }
+  int32_t res = check_iov(fd->offset, iov, count);
+  if (res) { current->uregs.eax = res; return; }
+  res = fs_writev(fd->node, fd->offset, iov, count);
+  if (res < 0) { current->uregs.eax = res; return; }
+  fd->offset += res;
+  current->uregs.eax = res;
+}
+
 static syscall_t syscall_table[] = {
   syscall_exit,
   syscall_fork,
@@ -691,7 +772,13 @@ static syscall_t syscall_table[] = {
   syscall_rename,
   syscall_resolve,
   syscall_maketty,
-  syscall_systime
+  syscall_systime,
+  syscall_sync,
+  syscall_fsync,
+  syscall_fdatasync,
+  syscall_ioctl,
+  syscall_readv,
+  syscall_writev
 };
 
 process_registers_t *syscall_handler(cpu_state_t cs, stack_state_t ss)
@@ -51,5 +51,11 @@
 #define SYSCALL_RESOLVE           40
 #define SYSCALL_MAKETTY           41
 #define SYSCALL_SYSTIME           42
+#define SYSCALL_SYNC              43
+#define SYSCALL_FSYNC             44
+#define SYSCALL_FDATASYNC         45
+#define SYSCALL_IOCTL             46
+#define SYSCALL_READV             47
+#define SYSCALL_WRITEV            48
 
 #endif /* _SYSCALL_NUMS_H_ */
@@ -31,6 +31,17 @@ void *u_memcpy(void *dest, const void *src, size_t n)
   return dest;
 }
 
+// Forward copies are safe when the destination comes first, so only
+// copies towards higher addresses go backwards.
+void *u_memmove(void *dest, const void *src, size_t n)
+{
+  if ((uint8_t *)dest <= (const uint8_t *)src) return u_memcpy(dest, src, n);
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+  while (n--) d[n] = s[n];
+  return dest;
+}
+
 size_t u_strlen(const char *s)
 {
   size_t i = 0;
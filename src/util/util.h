@@ -13,6 +13,7 @@
 
 void *u_memset(void *, int32_t, size_t);
 void *u_memcpy(void *, const void *, size_t);
+void *u_memmove(void *, const void *, size_t);
 size_t u_strlen(const char *);
 int32_t u_strcmp(const char *, const char *);
 
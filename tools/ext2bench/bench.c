@@ -0,0 +1,353 @@
+// bench.c
+//
+// Benchmark for the ext2 driver on an image file. Runs a series of
+// phases against the mounted image and prints the time and device
+// traffic of each, then optionally leaves a small tree of files on the
+// image and checks it with e2fsck.
+//
+// Usage: ext2bench [-n files] [-m file MB] [-r random ops] [-c cache
+//        blocks] [-d] [-f] image
+//
+//   -d  drop the block cache before each read phase
+//   -f  run `e2fsck -fn` on the image at the end, failing on any
+//       problem it reports
+//
+// Author: Ajay Tatachar <ajaymt2@illinois.edu>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fs/fs.h>
+#include <libc/h/sys/ioctl.h>
+#include "host.h"
+
+static const uint32_t CHUNK_SIZE = 65536;
+static const uint32_t RANDOM_IO_SIZE = 4096;
+
+static uint32_t file_count = 2000;
+static uint32_t file_mb = 16;
+static uint32_t random_ops = 2000;
+static uint32_t cache_blocks = 1024;
+static uint8_t drop_caches = 0;
+static uint8_t check_image = 0;
+
+static uint32_t failures = 0;
+static uint32_t phase_start;
+static host_io_stats_t phase_io;
+
+// Byte of the test pattern at an offset of the big file.
+static inline uint8_t pattern(uint32_t offset)
+{ return (uint8_t)((offset * 7) ^ (offset >> 9) ^ (offset >> 17)); }
+
+static void fill_pattern(uint8_t *buf, uint32_t offset, uint32_t size)
+{ for (uint32_t i = 0; i < size; ++i) buf[i] = pattern(offset + i); }
+
+static uint8_t check_pattern(uint8_t *buf, uint32_t offset, uint32_t size)
+{
+  for (uint32_t i = 0; i < size; ++i) {
+    if (buf[i] != pattern(offset + i)) return 0;
+  }
+  return 1;
+}
+
+// Deterministic random numbers, so runs are comparable.
+static uint32_t random_state = 12345;
+static uint32_t next_random()
+{
+  random_state = random_state * 1103515245 + 12345;
+  return random_state >> 8;
+}
+
+static void fail(const char *what, const char *path)
+{
+  fprintf(stderr, "ext2bench: %s failed: %s\n", what, path);
+  ++failures;
+}
+
+static void phase_begin(uint8_t reads)
+{
+  if (reads && drop_caches && host_drop_caches())
+    fail("dropping caches", "");
+  phase_start = host_time();
+  phase_io = host_io_stats;
+}
+
+// Print a phase. Writes are synced first so that their cost is
+// counted in the phase that caused them.
+static void phase_end(const char *name, uint32_t ops, uint64_t bytes)
+{
+  fs_sync();
+  uint32_t ms = host_time() - phase_start;
+  double seconds = (ms ? ms : 1) / 1000.0;
+  printf(
+    "%-10s %8u ops %8u ms %10.0f ops/s",
+    name, ops, ms, ops / seconds
+    );
+  if (bytes) printf(" %8.1f MB/s", bytes / seconds / (1024 * 1024));
+  else printf("            ");
+  printf(
+    "  dev r %6u (%7llu KB) w %6u (%7llu KB)\n",
+    host_io_stats.reads - phase_io.reads,
+    (unsigned long long)(host_io_stats.read_bytes - phase_io.read_bytes)
+    >> 10,
+    host_io_stats.writes - phase_io.writes,
+    (unsigned long long)(host_io_stats.write_bytes - phase_io.write_bytes)
+    >> 10
+    );
+}
+
+static void file_path(char *buf, uint32_t i)
+{ snprintf(buf, FS_NAME_LEN, "/bench/f%u", i); }
+
+static void bench_create()
+{
+  char path[FS_NAME_LEN];
+  phase_begin(0);
+  if (fs_mkdir("/bench", 0755)) fail("mkdir", "/bench");
+  for (uint32_t i = 0; i < file_count; ++i) {
+    file_path(path, i);
+    if (fs_create(path, 0644)) fail("create", path);
+  }
+  phase_end("create", file_count, 0);
+}
+
+static void bench_lookup()
+{
+  char path[FS_NAME_LEN];
+  phase_begin(1);
+  for (uint32_t i = 0; i < file_count; ++i) {
+    fs_node_t node;
+    file_path(path, i);
+    if (fs_open_node(&node, path, 0)) { fail("lookup", path); continue; }
+    fs_close(&node);
+  }
+  phase_end("lookup", file_count, 0);
+}
+
+static void bench_readdir()
+{
+  fs_node_t dir;
+  phase_begin(1);
+  if (fs_open_node(&dir, "/bench", 0)) { fail("open", "/bench"); return; }
+  uint32_t count = 0;
+  struct dirent *ent;
+  while ((ent = fs_readdir(&dir, count))) { ++count; free(ent); }
+  fs_close(&dir);
+  // The count includes "." and "..".
+  if (count != file_count + 2) fail("readdir count", "/bench");
+  phase_end("readdir", count, 0);
+}
+
+static void bench_seq_write(uint8_t *buf)
+{
+  fs_node_t node;
+  uint32_t size = file_mb << 20;
+  phase_begin(0);
+  if (fs_create("/bench/big", 0644)) fail("create", "/bench/big");
+  if (fs_open_node(&node, "/bench/big", 0)) {
+    fail("open", "/bench/big"); return;
+  }
+  uint32_t ops = 0;
+  for (uint32_t offset = 0; offset < size; offset += CHUNK_SIZE, ++ops) {
+    fill_pattern(buf, offset, CHUNK_SIZE);
+    if (fs_write(&node, offset, CHUNK_SIZE, buf) != (int32_t)CHUNK_SIZE)
+      fail("write", "/bench/big");
+  }
+  fs_close(&node);
+  phase_end("seqwrite", ops, size);
+}
+
+static void bench_seq_read(uint8_t *buf)
+{
+  fs_node_t node;
+  uint32_t size = file_mb << 20;
+  phase_begin(1);
+  if (fs_open_node(&node, "/bench/big", 0)) {
+    fail("open", "/bench/big"); return;
+  }
+  uint32_t ops = 0;
+  for (uint32_t offset = 0; offset < size; offset += CHUNK_SIZE, ++ops) {
+    if (
+      fs_read(&node, offset, CHUNK_SIZE, buf) != (int32_t)CHUNK_SIZE
+      || !check_pattern(buf, offset, CHUNK_SIZE)
+      ) fail("read", "/bench/big");
+  }
+  fs_close(&node);
+  phase_end("seqread", ops, size);
+}
+
+// Random I/O rewrites the pattern in place, so reads can always check
+// what they get.
+static void bench_random(uint8_t *buf, uint8_t write)
+{
+  fs_node_t node;
+  uint32_t slots = (file_mb << 20) / RANDOM_IO_SIZE;
+  phase_begin(!write);
+  if (fs_open_node(&node, "/bench/big", 0)) {
+    fail("open", "/bench/big"); return;
+  }
+  for (uint32_t i = 0; i < random_ops; ++i) {
+    uint32_t offset = (next_random() % slots) * RANDOM_IO_SIZE;
+    if (write) {
+      fill_pattern(buf, offset, RANDOM_IO_SIZE);
+      int32_t res = fs_write(&node, offset, RANDOM_IO_SIZE, buf);
+      if (res != (int32_t)RANDOM_IO_SIZE) fail("write", "/bench/big");
+    } else if (
+      fs_read(&node, offset, RANDOM_IO_SIZE, buf) != (int32_t)RANDOM_IO_SIZE
+      || !check_pattern(buf, offset, RANDOM_IO_SIZE)
+      ) fail("read", "/bench/big");
+  }
+  fs_close(&node);
+  uint64_t bytes = (uint64_t)random_ops * RANDOM_IO_SIZE;
+  phase_end(write ? "randwrite" : "randread", random_ops, bytes);
+}
+
+static void bench_unlink()
+{
+  char path[FS_NAME_LEN];
+  phase_begin(0);
+  for (uint32_t i = 0; i < file_count; ++i) {
+    file_path(path, i);
+    if (fs_unlink(path)) fail("unlink", path);
+  }
+  if (fs_unlink("/bench/big")) fail("unlink", "/bench/big");
+  phase_end("unlink", file_count + 1, 0);
+}
+
+// Leave a tree on the image for e2fsck to check while it still holds
+// live files: plain files, a fast and a slow symlink, a sparse file and
+// a defragmented file. The files are written just before the image is
+// closed, so their inodes are still cached with whatever allocation
+// state the driver keeps for them.
+static void build_check_tree(uint8_t *buf)
+{
+  char path[FS_NAME_LEN];
+  fs_node_t node;
+  if (fs_mkdir("/keep", 0755)) fail("mkdir", "/keep");
+  for (uint32_t i = 0; i < 8; ++i) {
+    snprintf(path, sizeof(path), "/keep/f%u", i);
+    uint32_t size = (i * 3000) + 1;
+    fill_pattern(buf, 0, size);
+    if (fs_create(path, 0644) || fs_open_node(&node, path, 0)) {
+      fail("create", path); continue;
+    }
+    if (fs_write(&node, 0, size, buf) != (int32_t)size) fail("write", path);
+    fs_close(&node);
+  }
+
+  // Targets of up to 60 bytes are stored in the inode itself.
+  if (fs_symlink("/keep/f1", "/keep/fast")) fail("symlink", "/keep/fast");
+  char *target =
+    "/keep/a/target/that/is/too/long/to/fit/in/the/block/pointers/of/an/inode";
+  if (fs_symlink(target, "/keep/slow")) fail("symlink", "/keep/slow");
+
+  fill_pattern(buf, 0, CHUNK_SIZE);
+  if (fs_create("/keep/sparse", 0644) || fs_open_node(&node, "/keep/sparse", 0))
+    fail("create", "/keep/sparse");
+  else {
+    if (
+      fs_write(&node, 0, CHUNK_SIZE, buf) != (int32_t)CHUNK_SIZE
+      || fs_write(&node, 64 * CHUNK_SIZE, CHUNK_SIZE, buf)
+      != (int32_t)CHUNK_SIZE
+      ) fail("write", "/keep/sparse");
+    fs_close(&node);
+  }
+
+  // Interleave the writes of two files so that both are fragmented,
+  // then defragment one of them.
+  fs_node_t pad;
+  if (
+    fs_create("/keep/frag", 0644) || fs_create("/keep/pad", 0644)
+    || fs_open_node(&node, "/keep/frag", 0)
+    || fs_open_node(&pad, "/keep/pad", 0)
+    ) { fail("create", "/keep/frag"); return; }
+  for (uint32_t i = 0; i < 32; ++i) {
+    uint32_t offset = i * RANDOM_IO_SIZE;
+    if (
+      fs_write(&node, offset, RANDOM_IO_SIZE, buf) != (int32_t)RANDOM_IO_SIZE
+      || fs_write(&pad, offset, RANDOM_IO_SIZE, buf) != (int32_t)RANDOM_IO_SIZE
+      ) fail("write", "/keep/frag");
+  }
+  struct fs_fraginfo info;
+  if (fs_ioctl(&node, FS_IOC_DEFRAG, &info) || info.extents != 1)
+    fail("defrag", "/keep/frag");
+  fs_close(&node);
+  fs_close(&pad);
+}
+
+// Run `e2fsck -fn` on the image and pass its output through. Any
+// problem fails the run, including bitmap differences in pass 5 that
+// e2fsck only reports.
+static uint8_t check_image_file(const char *image)
+{
+  char command[FS_NAME_LEN + 32];
+  snprintf(command, sizeof(command), "e2fsck -fn '%s' 2>&1", image);
+  FILE *out = popen(command, "r");
+  if (out == NULL) return 0;
+  char line[256];
+  uint8_t ok = 1;
+  while (fgets(line, sizeof(line), out)) {
+    fputs(line, stdout);
+    if (strstr(line, "differences")) ok = 0;
+  }
+  if (pclose(out)) ok = 0;
+  return ok;
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "n:m:r:c:df")) != -1) {
+    switch (opt) {
+    case 'n': file_count = strtoul(optarg, NULL, 0); break;
+    case 'm': file_mb = strtoul(optarg, NULL, 0); break;
+    case 'r': random_ops = strtoul(optarg, NULL, 0); break;
+    case 'c': cache_blocks = strtoul(optarg, NULL, 0); break;
+    case 'd': drop_caches = 1; break;
+    case 'f': check_image = 1; break;
+    default:
+      fprintf(
+        stderr,
+        "usage: %s [-n files] [-m file MB] [-r random ops] "
+        "[-c cache blocks] [-d] [-f] image\n",
+        argv[0]
+        );
+      return 2;
+    }
+  }
+  if (optind != argc - 1 || file_mb == 0) {
+    fprintf(stderr, "%s: expected one image file\n", argv[0]);
+    return 2;
+  }
+  const char *image = argv[optind];
+
+  if (host_mount_image(image, cache_blocks)) {
+    fprintf(stderr, "%s: failed to mount %s\n", argv[0], image);
+    return 1;
+  }
+  uint8_t *buf = malloc(CHUNK_SIZE);
+  if (buf == NULL) return 1;
+
+  bench_create();
+  bench_lookup();
+  bench_readdir();
+  bench_seq_write(buf);
+  bench_seq_read(buf);
+  bench_random(buf, 1);
+  bench_random(buf, 0);
+  bench_unlink();
+  if (check_image) build_check_tree(buf);
+
+  free(buf);
+  host_unmount_image();
+  if (failures) fprintf(stderr, "%s: %u failures\n", argv[0], failures);
+
+  if (check_image && !check_image_file(image)) {
+    fprintf(stderr, "%s: e2fsck found problems\n", argv[0]);
+    return 1;
+  }
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,203 @@
+// host.c
+//
+// Stand-ins for the parts of the kernel that the filesystem code uses,
+// for the host build. Everything runs on one thread, so locks only
+// check that they are not taken twice.
+//
+// Author: Ajay Tatachar <ajaymt2@illinois.edu>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fs/fs.h>
+#include <ext2/ext2.h>
+#include <bcache/bcache.h>
+#include <kheap/kheap.h>
+#include <klock/klock.h>
+#include <pit/pit.h>
+#include <interrupt/interrupt.h>
+#include <process/process.h>
+#include <debug/log.h>
+#include "host.h"
+
+host_io_stats_t host_io_stats;
+
+static fs_node_t *image_node = NULL;
+static int32_t image_fd = -1;
+static struct timespec start_time;
+static process_t host_process;
+static char host_wd[] = "/";
+
+void *kmalloc(size_t size)
+{ return malloc(size); }
+
+void kfree(void *ptr)
+{ free(ptr); }
+
+void klock(klock_t lock)
+{
+  if (*lock) {
+    fprintf(stderr, "ext2bench: lock %p is already held\n", (void *)lock);
+    abort();
+  }
+  *lock = 1;
+}
+
+void kunlock(klock_t lock)
+{ *lock = 0; }
+
+void krlock(krwlock_t *rw)
+{
+  if (rw->writer) {
+    fprintf(stderr, "ext2bench: read lock of a write-locked inode\n");
+    abort();
+  }
+  ++(rw->readers);
+}
+
+void kwlock(krwlock_t *rw)
+{
+  if (rw->writer || rw->readers) {
+    fprintf(stderr, "ext2bench: write lock of a locked inode\n");
+    abort();
+  }
+  rw->writer = 1;
+}
+
+void krwunlock(krwlock_t *rw)
+{
+  if (rw->writer) rw->writer = 0;
+  else --(rw->readers);
+}
+
+uint32_t interrupt_save_disable()
+{ return 0; }
+
+void interrupt_restore(uint32_t enable)
+{ (void)enable; }
+
+uint32_t host_time()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start_time.tv_sec) * 1000
+    + (now.tv_nsec - start_time.tv_nsec) / 1000000;
+}
+
+uint32_t pit_get_time()
+{ return host_time(); }
+
+process_t *process_current()
+{
+  host_process.wd = host_wd;
+  return &host_process;
+}
+
+// There is no scheduler, so nothing sleeps and the flusher never
+// starts. Callers sync explicitly.
+uint32_t process_sleep(process_t *process, uint32_t ms)
+{ (void)process; (void)ms; return 0; }
+
+void process_schedule(process_t *process)
+{ (void)process; }
+
+uint32_t process_create_kernel(
+  process_t *process, const char *name, void (*entry)()
+  )
+{ (void)process; (void)name; (void)entry; return 0; }
+
+static void log_message(char *level, char *fname, char *fmt, va_list args)
+{
+  fprintf(stderr, "%s %s: ", level, fname);
+  vfprintf(stderr, fmt, args);
+}
+
+void log_debug(char *fname, char *fmt, ...)
+{
+  if (getenv("EXT2BENCH_DEBUG") == NULL) return;
+  va_list args;
+  va_start(args, fmt);
+  log_message("D", fname, fmt, args);
+  va_end(args);
+}
+
+void log_info(char *fname, char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  log_message("I", fname, fmt, args);
+  va_end(args);
+}
+
+void log_error(char *fname, char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  log_message("E", fname, fmt, args);
+  va_end(args);
+}
+
+static uint32_t image_node_read(
+  fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer
+  )
+{
+  (void)node;
+  ++(host_io_stats.reads);
+  host_io_stats.read_bytes += size;
+  int32_t res = image_read(image_fd, buffer, size, offset);
+  return res < 0 ? 0 : (uint32_t)res;
+}
+
+static uint32_t image_node_write(
+  fs_node_t *node, uint32_t offset, uint32_t size, uint8_t *buffer
+  )
+{
+  (void)node;
+  ++(host_io_stats.writes);
+  host_io_stats.write_bytes += size;
+  int32_t res = image_write(image_fd, buffer, size, offset);
+  return res < 0 ? 0 : (uint32_t)res;
+}
+
+uint32_t host_mount_image(const char *path, uint32_t cache_blocks)
+{
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  uint32_t size = 0;
+  image_fd = image_open(path, &size);
+  if (image_fd < 0) return 1;
+
+  uint32_t res = fs_init();
+  if (res) return res;
+  image_node = kmalloc(sizeof(fs_node_t));
+  if (image_node == NULL) return 1;
+  memset(image_node, 0, sizeof(fs_node_t));
+  memcpy(image_node->name, "imgdev", 7);
+  image_node->mask = 0660;
+  image_node->flags = FS_BLOCKDEVICE;
+  image_node->length = size;
+  image_node->read = image_node_read;
+  image_node->write = image_node_write;
+  res = fs_mount(image_node, "/dev/hda");
+  if (res) return res;
+
+  res = bcache_init(cache_blocks);
+  if (res) return res;
+  return ext2_init("/dev/hda");
+}
+
+uint32_t host_drop_caches()
+{
+  fs_sync();
+  return bcache_invalidate(image_node);
+}
+
+void host_unmount_image()
+{
+  fs_sync();
+  image_close(image_fd);
+  image_fd = -1;
+}
@@ -0,0 +1,46 @@
+// host.h
+//
+// Host environment for running the filesystem code as a normal
+// program. Only uses types that the kernel and host headers agree on,
+// so it can be included on both sides.
+//
+// Author: Ajay Tatachar <ajaymt2@illinois.edu>
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stdint.h>
+
+// Counters of the requests that reach the image file.
+typedef struct host_io_stats_s {
+  uint32_t reads;
+  uint32_t writes;
+  uint64_t read_bytes;
+  uint64_t write_bytes;
+} host_io_stats_t;
+
+extern host_io_stats_t host_io_stats;
+
+// Access to the image file. These use the host's headers, which
+// clash with the kernel's.
+int32_t image_open(const char *path, uint32_t *size);
+int32_t image_read(int32_t fd, void *buf, uint32_t size, uint32_t offset);
+int32_t image_write(
+  int32_t fd, const void *buf, uint32_t size, uint32_t offset
+  );
+void image_close(int32_t fd);
+
+// Mount an image file at the root like the kernel does at boot, with
+// a block cache of `cache_blocks` blocks.
+uint32_t host_mount_image(const char *path, uint32_t cache_blocks);
+
+// Write back and drop every cached block of the image.
+uint32_t host_drop_caches();
+
+// Write back everything and close the image.
+void host_unmount_image();
+
+// Milliseconds since the image was mounted.
+uint32_t host_time();
+
+#endif /* _HOST_H_ */
@@ -0,0 +1,36 @@
+// image.c
+//
+// Image file access for the host build.
+//
+// Author: Ajay Tatachar <ajaymt2@illinois.edu>
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "host.h"
+
+int32_t image_open(const char *path, uint32_t *size)
+{
+  int fd = open(path, O_RDWR);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) || (uint64_t)st.st_size > 0xFFFFFFFFull) {
+    close(fd); return -1;
+  }
+  *size = st.st_size;
+  return fd;
+}
+
+int32_t image_read(int32_t fd, void *buf, uint32_t size, uint32_t offset)
+{ return pread(fd, buf, size, offset); }
+
+int32_t image_write(
+  int32_t fd, const void *buf, uint32_t size, uint32_t offset
+  )
+{ return pwrite(fd, buf, size, offset); }
+
+void image_close(int32_t fd)
+{ fsync(fd); close(fd); }